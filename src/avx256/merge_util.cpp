@@ -1,10 +1,14 @@
 #include "avx256/merge_util.h"
+#include "execution_context.h"
+#include <algorithm>
 
 #ifdef AVX2
 namespace avx2 {
 
 template<typename InType, typename RegType>
 void MergeRuns8(InType *&arr, size_t N) {
+  ExecutionScope scope;
+  InType *input = arr;
   InType *buffer;
   int UNIT_RUN_SIZE = 8;
   aligned_init(buffer, N);
@@ -12,12 +16,17 @@ void MergeRuns8(InType *&arr, size_t N) {
     MergePass8<InType, RegType>(arr, buffer, N, run_size);
     std::swap(arr, buffer);
   }
+  if (buffer != input) {
+    aligned_free(buffer, N);
+  }
 }
 template void MergeRuns8<int, __m256i>(int *&arr, size_t N);
 template void MergeRuns8<float, __m256>(float *&arr, size_t N);
 
 template<typename InType, typename RegType>
 void MaskedMergeRuns8(InType *&arr, size_t N) {
+  ExecutionScope scope;
+  InType *input = arr;
   InType *buffer;
   int UNIT_RUN_SIZE = 8;
   aligned_init(buffer, N);
@@ -25,12 +34,17 @@ void MaskedMergeRuns8(InType *&arr, size_t N) {
     MaskedMergePass8<InType, RegType>(arr, buffer, N, run_size);
     std::swap(arr, buffer);
   }
+  if (buffer != input) {
+    aligned_free(buffer, N);
+  }
 }
 template void MaskedMergeRuns8<int, __m256i>(int *&arr, size_t N);
 template void MaskedMergeRuns8<float, __m256>(float *&arr, size_t N);
 
 template<typename InType, typename RegType>
 void MergeRuns4(InType *&arr, size_t N) {
+  ExecutionScope scope;
+  InType *input = arr;
   InType *buffer;
   int UNIT_RUN_SIZE = 4;
   aligned_init(buffer, N);
@@ -38,6 +52,9 @@ void MergeRuns4(InType *&arr, size_t N) {
     MergePass4<InType, RegType>(arr, buffer, N, run_size);
     std::swap(arr, buffer);
   }
+  if (buffer != input) {
+    aligned_free(buffer, N);
+  }
 }
 
 template void MergeRuns4<int64_t, __m256i>(int64_t *&arr, size_t N);
@@ -45,6 +62,8 @@ template void MergeRuns4<double, __m256d>(double *&arr, size_t N);
 
 template<typename InType, typename RegType>
 void MaskedMergeRuns4(InType *&arr, size_t N) {
+  ExecutionScope scope;
+  InType *input = arr;
   InType *buffer;
   int UNIT_RUN_SIZE = 4;
   aligned_init(buffer, N);
@@ -52,251 +71,466 @@ void MaskedMergeRuns4(InType *&arr, size_t N) {
     MaskedMergePass4<InType, RegType>(arr, buffer, N, run_size);
     std::swap(arr, buffer);
   }
+  if (buffer != input) {
+    aligned_free(buffer, N);
+  }
 }
 template void MaskedMergeRuns4<int64_t, __m256i>(int64_t *&arr, size_t N);
 template void MaskedMergeRuns4<double, __m256d>(double *&arr, size_t N);
 
-template<typename InType, typename RegType>
-void MergePass8(InType *&arr, InType *buffer, size_t N, unsigned int run_size) {
-  int UNIT_RUN_SIZE = 8;
-#pragma omp parallel for
-  for (int i = 0; i < N; i += 2 * run_size) {
-    int start = i;
-    int mid = i + run_size;
-    int end = i + 2 * run_size;
-    int buffer_offset = start;
-    RegType ra, rb;
-    int p1_ptr = start;
-    int p2_ptr = mid;
-    LoadReg(ra, &arr[p1_ptr]);
-    LoadReg(rb, &arr[p2_ptr]);
-    p1_ptr += UNIT_RUN_SIZE;
-    p2_ptr += UNIT_RUN_SIZE;
-
-    while (p1_ptr < mid && p2_ptr < end) {
-      BitonicMerge8(ra, rb);
-
-      StoreReg(ra, &buffer[buffer_offset]);
-      buffer_offset += UNIT_RUN_SIZE;
-
-      if (arr[p1_ptr] > arr[p2_ptr]) {
-        LoadReg(ra, &arr[p2_ptr]);
-        p2_ptr += UNIT_RUN_SIZE;
-      } else {
-        LoadReg(ra, &arr[p1_ptr]);
-        p1_ptr += UNIT_RUN_SIZE;
+// Smallest merge path segment worth its co-rank searches and scalar tails
+const size_t MIN_SEGMENT_SIZE = 1024;
+// Independent segment merges a thread steps through in lock-step
+const size_t MERGE_STREAMS = 2;
+// Shortest stream, in steps of the wide network, that is merged with it; the
+// scalar tail grows with the step
+const size_t MIN_WIDE_STEPS = 16;
+// How far ahead of the run pointers input is prefetched, in bytes
+const size_t PREFETCH_DISTANCE = 512;
+
+// Registers per side of the wide merge network for each pass kernel and type,
+// picked by per-core merge throughput; 1 keeps the one register network
+template<typename InType>
+const int WIDE_REGS_8 = 1;
+template<>
+const int WIDE_REGS_8<int> = 2;
+template<>
+const int WIDE_REGS_8<float> = 4;
+template<typename InType>
+const int WIDE_REGS_4 = 1;
+template<>
+const int WIDE_REGS_4<int64_t> = 4;
+template<>
+const int WIDE_REGS_4<double> = 4;
+template<typename InType>
+const int MASKED_WIDE_REGS_8 = 1;
+template<>
+const int MASKED_WIDE_REGS_8<float> = 2;
+
+// Output that does not fit in the LLC is evicted before it is read again, so
+// it is written with streaming stores that skip the read-for-ownership
+static bool StreamOutput(size_t bytes) {
+  return bytes > StreamingThreshold();
+}
+
+// Runs a one register per side merge network on the register array layout
+template<typename RegType, void (*Merge)(RegType &, RegType &)>
+static void MergeRegisters(RegType *r) {
+  Merge(r[0], r[1]);
+}
+
+/**
+ * Bitonic merge of REGS sorted registers r[0, REGS) with REGS sorted registers
+ * r[REGS, 2 * REGS). The second half is reversed as a whole, the stages that
+ * cross registers are whole register MinMax, and the last cross-register stage
+ * together with the in-register stages is IntraRegisterSort on neighbours.
+ */
+template<typename RegType, int REGS, void (*Reverse)(RegType &), void (*MinMax)(RegType &, RegType &),
+    void (*IntraRegisterSort)(RegType &, RegType &)>
+static void BitonicMergeRegisters(RegType *r) {
+  for (int i = 0; i < REGS; i++) {
+    Reverse(r[REGS + i]);
+  }
+  for (int i = 0; i < REGS / 2; i++) {
+    std::swap(r[REGS + i], r[2 * REGS - 1 - i]);
+  }
+  for (int stride = REGS; stride > 1; stride /= 2) {
+    for (int i = 0; i < 2 * REGS; i++) {
+      if ((i & stride) == 0) {
+        MinMax(r[i], r[i + stride]);
       }
     }
+  }
+  for (int i = 0; i < 2 * REGS; i += 2) {
+    IntraRegisterSort(r[i], r[i + 1]);
+  }
+}
+
+// Output of the merge kernels. Store writes a merged register, Tail converts
+// values the scalar tail merge already wrote; the plain output keeps the
+// merged values, the others fold a layout transform into the last pass.
+template<typename InType, typename RegType>
+struct PlainOutput {
+  void Store(const RegType &r, InType *out, bool stream) const {
+    if (stream) {
+      StreamReg(r, out);
+    } else {
+      StoreUnalignedReg(r, out);
+    }
+  }
+
+  void Tail(InType *out, size_t n) const {}
+};
+
+// (key << 32 | index) values replaced by the 64-bit record at the index
+struct GatherOutput {
+  const int64_t *records;
+
+  void Store(const __m256i &r, int64_t *out, bool stream) const {
+    __m256i index = _mm256_and_si256(r, _mm256_set1_epi64x(0xffffffff));
+    __m256i gathered = _mm256_i64gather_epi64((const long long *) records, index, sizeof(int64_t));
+    if (stream) {
+      StreamReg(gathered, out);
+    } else {
+      StoreUnalignedReg(gathered, out);
+    }
+  }
+
+  void Tail(int64_t *out, size_t n) const {
+    for (size_t i = 0; i < n; i++) {
+      out[i] = records[out[i] & 0xffffffff];
+    }
+  }
+};
+
+/**
+ * Merges two sorted sequences of arbitrary length (in values) into out, REGS
+ * registers per side and Step. The merge network runs while both runs still
+ * have REGS full registers left, so the next registers can be picked without a
+ * branch; what remains is finished with scalar merges. With stream the output
+ * is written with non-temporal stores (when out is register aligned) and the
+ * input is prefetched; out may have any alignment for the plain stores.
+ * Everything written goes through the Output policy.
+ */
+template<typename InType, typename RegType, int UNIT_RUN_SIZE, int STRIDE, int REGS,
+    void (*Merge)(RegType *), typename Output = PlainOutput<InType, RegType>>
+struct SegmentMerger {
+  static const size_t STEP_SIZE = REGS * UNIT_RUN_SIZE;
+  InType *a, *b, *out;
+  size_t na, nb;
+  size_t p1_ptr, p2_ptr, buffer_offset;
+  // r[0, REGS) is the merged output, r[REGS, 2 * REGS) carries over
+  RegType r[2 * REGS];
+  bool stream;
+  bool active;
+  Output output;
+
+  void Init(InType *a_run, size_t a_size, InType *b_run, size_t b_size, InType *out_run, bool stream_out,
+            Output out_policy = Output()) {
+    output = out_policy;
+    a = a_run;
+    na = a_size;
+    b = b_run;
+    nb = b_size;
+    out = out_run;
+    stream = stream_out && (uintptr_t) out % sizeof(RegType) == 0;
+    active = na >= STEP_SIZE && nb >= STEP_SIZE;
+    if (!active) return;
+    p1_ptr = STEP_SIZE;
+    p2_ptr = STEP_SIZE;
+    buffer_offset = 0;
+    for (int i = 0; i < REGS; i++) {
+      LoadUnalignedReg(r[i], &a[i * UNIT_RUN_SIZE]);
+      LoadUnalignedReg(r[REGS + i], &b[i * UNIT_RUN_SIZE]);
+    }
+  }
 
-    BitonicMerge8(ra, rb);
+  void Step() {
+    Merge(r);
 
-    StoreReg(ra, &buffer[buffer_offset]);
-    buffer_offset += UNIT_RUN_SIZE;
+    for (int i = 0; i < REGS; i++) {
+      output.Store(r[i], &out[buffer_offset + i * UNIT_RUN_SIZE], stream);
+    }
+    if (stream) {
+      _mm_prefetch((const char *) &a[p1_ptr] + PREFETCH_DISTANCE, _MM_HINT_T0);
+      _mm_prefetch((const char *) &b[p2_ptr] + PREFETCH_DISTANCE, _MM_HINT_T0);
+    }
+    buffer_offset += STEP_SIZE;
 
-    while (p1_ptr < mid) {
-      LoadReg(ra, &arr[p1_ptr]);
-      p1_ptr += UNIT_RUN_SIZE;
-      BitonicMerge8(ra, rb);
-      StoreReg(ra, &buffer[buffer_offset]);
-      buffer_offset += UNIT_RUN_SIZE;
+    if (na - p1_ptr < STEP_SIZE || nb - p2_ptr < STEP_SIZE) {
+      active = false;
+      return;
+    }
+    bool take_b = a[p1_ptr] > b[p2_ptr];
+    InType *next = take_b ? &b[p2_ptr] : &a[p1_ptr];
+    for (int i = 0; i < REGS; i++) {
+      LoadUnalignedReg(r[i], &next[i * UNIT_RUN_SIZE]);
     }
+    p1_ptr += take_b ? 0 : STEP_SIZE;
+    p2_ptr += take_b ? STEP_SIZE : 0;
+  }
 
-    while (p2_ptr < end) {
-      LoadReg(ra, &arr[p2_ptr]);
-      p2_ptr += UNIT_RUN_SIZE;
-      BitonicMerge8(ra, rb);
-      StoreReg(ra, &buffer[buffer_offset]);
-      buffer_offset += UNIT_RUN_SIZE;
+  void Finish() {
+    if (na < STEP_SIZE || nb < STEP_SIZE) {
+      ScalarMerge(a, na / STRIDE, b, nb / STRIDE, out, STRIDE);
+      output.Tail(out, na + nb);
+      return;
+    }
+    // The carried over registers, the run with less than a step left, then the other run
+    alignas(64) InType pending[STEP_SIZE];
+    InType tail[2 * STEP_SIZE];
+    for (int i = 0; i < REGS; i++) {
+      StoreReg(r[REGS + i], &pending[i * UNIT_RUN_SIZE]);
+    }
+    bool short_a = na - p1_ptr < STEP_SIZE;
+    InType *short_run = short_a ? &a[p1_ptr] : &b[p2_ptr];
+    size_t short_size = short_a ? na - p1_ptr : nb - p2_ptr;
+    InType *long_run = short_a ? &b[p2_ptr] : &a[p1_ptr];
+    size_t long_size = short_a ? nb - p2_ptr : na - p1_ptr;
+    ScalarMerge(pending, STEP_SIZE / STRIDE, short_run, short_size / STRIDE, tail, STRIDE);
+    ScalarMerge(tail, (STEP_SIZE + short_size) / STRIDE, long_run, long_size / STRIDE,
+                &out[buffer_offset], STRIDE);
+    output.Tail(&out[buffer_offset], na + nb - buffer_offset);
+    if (stream) {
+      _mm_sfence();
+    }
+  }
+};
+
+// Steps independent merges alternately so their merge networks overlap in the
+// pipeline instead of each waiting on its own dependency chain
+template<typename Merger>
+static void MergeInterleaved(Merger *mergers, size_t streams) {
+  bool all_active = true;
+  for (size_t m = 0; m < streams; m++) {
+    all_active &= mergers[m].active;
+  }
+  while (all_active) {
+    for (size_t m = 0; m < streams; m++) {
+      mergers[m].Step();
+      all_active &= mergers[m].active;
+    }
+  }
+  for (size_t m = 0; m < streams; m++) {
+    while (mergers[m].active) {
+      mergers[m].Step();
     }
+    mergers[m].Finish();
+  }
+}
+
+/**
+ * Merges one of `segments` equal output segments of the run pair starting at
+ * start. Segment boundaries are located with merge path co-ranks; large
+ * segments are cut once more and merged as interleaved streams. Streams long
+ * enough for it use the WIDE registers per side network WideMerge.
+ */
+template<typename InType, typename RegType, int UNIT_RUN_SIZE, int STRIDE, void (*Merge)(RegType *),
+    int WIDE, void (*WideMerge)(RegType *), typename Output = PlainOutput<InType, RegType>>
+static void MergeRunPair(InType *arr, InType *buffer, size_t start, size_t run_size,
+                         size_t segment, size_t segments, bool stream, Output output = Output()) {
+  InType *a = &arr[start];
+  InType *b = &arr[start + run_size];
+  size_t run_records = run_size / STRIDE;
+  size_t segment_size = 2 * run_size / segments;
+  size_t streams = segment_size >= MERGE_STREAMS * MIN_SEGMENT_SIZE ? MERGE_STREAMS : 1;
+  size_t stream_size = segment_size / streams;
+
+  SegmentMerger<InType, RegType, UNIT_RUN_SIZE, STRIDE, 1, Merge, Output> mergers[MERGE_STREAMS];
+  SegmentMerger<InType, RegType, UNIT_RUN_SIZE, STRIDE, WIDE, WideMerge, Output> wide_mergers[MERGE_STREAMS];
+  bool wide = WIDE > 1 && stream_size >= MIN_WIDE_STEPS * WIDE * UNIT_RUN_SIZE;
+  size_t k0 = segment * segment_size;
+  size_t i0 = CoRank(k0 / STRIDE, a, run_records, b, run_records, STRIDE) * STRIDE;
+  for (size_t m = 0; m < streams; m++) {
+    size_t k1 = k0 + stream_size;
+    size_t i1 = CoRank(k1 / STRIDE, a, run_records, b, run_records, STRIDE) * STRIDE;
+    if (wide) {
+      wide_mergers[m].Init(&a[i0], i1 - i0, &b[k0 - i0], (k1 - i1) - (k0 - i0), &buffer[start + k0], stream,
+                           output);
+    } else {
+      mergers[m].Init(&a[i0], i1 - i0, &b[k0 - i0], (k1 - i1) - (k0 - i0), &buffer[start + k0], stream, output);
+    }
+    k0 = k1;
+    i0 = i1;
+  }
+  if (wide) {
+    MergeInterleaved(wide_mergers, streams);
+  } else {
+    MergeInterleaved(mergers, streams);
+  }
+}
+
+/**
+ * Merges two sorted sequences of arbitrary length into out with a single
+ * merger, the wide network when the output is long enough for it.
+ */
+template<typename InType, typename RegType, int UNIT_RUN_SIZE, int STRIDE, void (*Merge)(RegType *),
+    int WIDE, void (*WideMerge)(RegType *)>
+static void MergeSegment(InType *a, size_t na, InType *b, size_t nb, InType *out) {
+  if (WIDE > 1 && na + nb >= MIN_WIDE_STEPS * WIDE * UNIT_RUN_SIZE) {
+    SegmentMerger<InType, RegType, UNIT_RUN_SIZE, STRIDE, WIDE, WideMerge> merger;
+    merger.Init(a, na, b, nb, out, false);
+    MergeInterleaved(&merger, 1);
+  } else {
+    SegmentMerger<InType, RegType, UNIT_RUN_SIZE, STRIDE, 1, Merge> merger;
+    merger.Init(a, na, b, nb, out, false);
+    MergeInterleaved(&merger, 1);
+  }
+}
+
+/**
+ * One merge pass over runs of run_size values. The output of every run pair is
+ * cut into equal segments, so there is enough work for all threads even in the
+ * final passes where only one or two run pairs are left.
+ */
+template<typename InType>
+struct MergePassItems {
+  InType *arr;
+  InType *buffer;
+  size_t run_size;
+  size_t segments;
+  bool stream;
+};
+
+template<typename InType, typename RegType, int UNIT_RUN_SIZE, int STRIDE, void (*Merge)(RegType *),
+    int WIDE, void (*WideMerge)(RegType *)>
+static void MergePassItem(void *arg, size_t s) {
+  MergePassItems<InType> *items = (MergePassItems<InType> *) arg;
+  size_t segments = items->segments;
+  MergeRunPair<InType, RegType, UNIT_RUN_SIZE, STRIDE, Merge, WIDE, WideMerge>(
+      items->arr, items->buffer, (s / segments) * 2 * items->run_size, items->run_size, s % segments, segments,
+      items->stream);
+}
 
-    StoreReg(rb, &buffer[buffer_offset]);
-    buffer_offset += UNIT_RUN_SIZE;
+template<typename InType, typename RegType, int UNIT_RUN_SIZE, int STRIDE, void (*Merge)(RegType *),
+    int WIDE, void (*WideMerge)(RegType *)>
+static void MergePass(InType *arr, InType *buffer, size_t N, size_t run_size) {
+  size_t pairs = std::max(N / (2 * run_size), (size_t) 1);
+  size_t threads = InParallelTask() ? 1 : ParallelThreads();
+  size_t segments = 1;
+  while (pairs * segments < threads && 2 * run_size / (2 * segments) >= MIN_SEGMENT_SIZE) {
+    segments *= 2;
+  }
+  MergePassItems<InType> items = {arr, buffer, run_size, segments, StreamOutput(2 * N * sizeof(InType))};
+  auto item = MergePassItem<InType, RegType, UNIT_RUN_SIZE, STRIDE, Merge, WIDE, WideMerge>;
+  if (items.stream) {
+    StreamingParallelFor(pairs * segments, item, &items, 2 * N * sizeof(InType));
+  } else {
+    ParallelFor(pairs * segments, item, &items);
   }
 }
 
+template<typename InType, typename RegType>
+void MergePass8(InType *&arr, InType *buffer, size_t N, unsigned int run_size) {
+  MergePass<InType, RegType, 8, 1, MergeRegisters<RegType, BitonicMerge8<RegType>>,
+            WIDE_REGS_8<InType>, BitonicMergeRegisters<RegType, WIDE_REGS_8<InType>, Reverse8<RegType>, MinMax8, IntraRegisterSort8x8>>(arr, buffer, N, run_size);
+}
+
 template void MergePass8<int, __m256i>(int *&arr, int *buffer, size_t N, unsigned int run_size);
 template void MergePass8<float, __m256>(float *&arr, float *buffer, size_t N, unsigned int run_size);
 
 template<typename InType, typename RegType>
-void MaskedMergePass8(InType *&arr, InType *buffer, size_t N, unsigned int run_size) {
-  int UNIT_RUN_SIZE = 8;
-#pragma omp parallel for
-  for (int i = 0; i < N; i += 2 * run_size) {
-    int start = i;
-    int mid = i + run_size;
-    int end = i + 2 * run_size;
-    int buffer_offset = start;
-    RegType ra, rb;
-    int p1_ptr = start;
-    int p2_ptr = mid;
-    LoadReg(ra, &arr[p1_ptr]);
-    LoadReg(rb, &arr[p2_ptr]);
-    p1_ptr += UNIT_RUN_SIZE;
-    p2_ptr += UNIT_RUN_SIZE;
-
-    while (p1_ptr < mid && p2_ptr < end) {
-      MaskedBitonicMerge8(ra, rb);
-
-      StoreReg(ra, &buffer[buffer_offset]);
-      buffer_offset += UNIT_RUN_SIZE;
-
-      if (arr[p1_ptr] > arr[p2_ptr]) {
-        LoadReg(ra, &arr[p2_ptr]);
-        p2_ptr += UNIT_RUN_SIZE;
-      } else {
-        LoadReg(ra, &arr[p1_ptr]);
-        p1_ptr += UNIT_RUN_SIZE;
-      }
-    }
+void MergeRunPair8(InType *arr, InType *buffer, size_t start, size_t run_size,
+                   size_t segment, size_t segments) {
+  bool stream = StreamOutput(4 * run_size * sizeof(InType));
+  MergeRunPair<InType, RegType, 8, 1, MergeRegisters<RegType, BitonicMerge8<RegType>>,
+               WIDE_REGS_8<InType>, BitonicMergeRegisters<RegType, WIDE_REGS_8<InType>, Reverse8<RegType>, MinMax8, IntraRegisterSort8x8>>(arr, buffer, start, run_size, segment, segments, stream);
+}
 
-    MaskedBitonicMerge8(ra, rb);
+template void MergeRunPair8<int, __m256i>(int *arr, int *buffer, size_t start, size_t run_size,
+                                          size_t segment, size_t segments);
+template void MergeRunPair8<float, __m256>(float *arr, float *buffer, size_t start, size_t run_size,
+                                           size_t segment, size_t segments);
 
-    StoreReg(ra, &buffer[buffer_offset]);
-    buffer_offset += UNIT_RUN_SIZE;
+template<typename InType, typename RegType>
+void MergeSegment8(InType *a, size_t na, InType *b, size_t nb, InType *out) {
+  MergeSegment<InType, RegType, 8, 1, MergeRegisters<RegType, BitonicMerge8<RegType>>,
+                WIDE_REGS_8<InType>, BitonicMergeRegisters<RegType, WIDE_REGS_8<InType>, Reverse8<RegType>, MinMax8, IntraRegisterSort8x8>>(a, na, b, nb, out);
+}
 
-    while (p1_ptr < mid) {
-      LoadReg(ra, &arr[p1_ptr]);
-      p1_ptr += UNIT_RUN_SIZE;
-      MaskedBitonicMerge8(ra, rb);
-      StoreReg(ra, &buffer[buffer_offset]);
-      buffer_offset += UNIT_RUN_SIZE;
-    }
+template void MergeSegment8<int, __m256i>(int *a, size_t na, int *b, size_t nb, int *out);
+template void MergeSegment8<float, __m256>(float *a, size_t na, float *b, size_t nb, float *out);
 
-    while (p2_ptr < end) {
-      LoadReg(ra, &arr[p2_ptr]);
-      p2_ptr += UNIT_RUN_SIZE;
-      MaskedBitonicMerge8(ra, rb);
-      StoreReg(ra, &buffer[buffer_offset]);
-      buffer_offset += UNIT_RUN_SIZE;
-    }
-
-    StoreReg(rb, &buffer[buffer_offset]);
-    buffer_offset += UNIT_RUN_SIZE;
-  }
+template<typename InType, typename RegType>
+void MaskedMergePass8(InType *&arr, InType *buffer, size_t N, unsigned int run_size) {
+  MergePass<InType, RegType, 8, 2, MergeRegisters<RegType, MaskedBitonicMerge8<RegType>>,
+            MASKED_WIDE_REGS_8<InType>, BitonicMergeRegisters<RegType, MASKED_WIDE_REGS_8<InType>, MaskedReverse8<RegType>, MaskedMinMax8, MaskedIntraRegisterSort8x8<RegType>>>(arr, buffer, N, run_size);
 }
 
 template void MaskedMergePass8<int, __m256i>(int *&arr, int *buffer, size_t N, unsigned int run_size);
 template void MaskedMergePass8<float, __m256>(float *&arr, float *buffer, size_t N, unsigned int run_size);
 
 template<typename InType, typename RegType>
-void MergePass4(InType *&arr, InType *buffer, size_t N, unsigned int run_size) {
-  int UNIT_RUN_SIZE = 4;
-#pragma omp parallel for
-  for (int i = 0; i < N; i += 2 * run_size) {
-    int start = i;
-    int mid = i + run_size;
-    int end = i + 2 * run_size;
-    int buffer_offset = start;
-    RegType ra, rb;
-    int p1_ptr = start;
-    int p2_ptr = mid;
-    LoadReg(ra, &arr[p1_ptr]);
-    LoadReg(rb, &arr[p2_ptr]);
-    p1_ptr += UNIT_RUN_SIZE;
-    p2_ptr += UNIT_RUN_SIZE;
-
-    while (p1_ptr < mid && p2_ptr < end) {
-      BitonicMerge4(ra, rb);
-
-      StoreReg(ra, &buffer[buffer_offset]);
-      buffer_offset += UNIT_RUN_SIZE;
-
-      if (arr[p1_ptr] > arr[p2_ptr]) {
-        LoadReg(ra, &arr[p2_ptr]);
-        p2_ptr += UNIT_RUN_SIZE;
-      } else {
-        LoadReg(ra, &arr[p1_ptr]);
-        p1_ptr += UNIT_RUN_SIZE;
-      }
-    }
-
-    BitonicMerge4(ra, rb);
+void MaskedMergeRunPair8(InType *arr, InType *buffer, size_t start, size_t run_size,
+                         size_t segment, size_t segments) {
+  bool stream = StreamOutput(4 * run_size * sizeof(InType));
+  MergeRunPair<InType, RegType, 8, 2, MergeRegisters<RegType, MaskedBitonicMerge8<RegType>>,
+               MASKED_WIDE_REGS_8<InType>, BitonicMergeRegisters<RegType, MASKED_WIDE_REGS_8<InType>, MaskedReverse8<RegType>, MaskedMinMax8, MaskedIntraRegisterSort8x8<RegType>>>(arr, buffer, start, run_size, segment, segments, stream);
+}
 
-    StoreReg(ra, &buffer[buffer_offset]);
-    buffer_offset += UNIT_RUN_SIZE;
+template void MaskedMergeRunPair8<int, __m256i>(int *arr, int *buffer, size_t start, size_t run_size,
+                                                size_t segment, size_t segments);
+template void MaskedMergeRunPair8<float, __m256>(float *arr, float *buffer, size_t start, size_t run_size,
+                                                 size_t segment, size_t segments);
 
-    while (p1_ptr < mid) {
-      LoadReg(ra, &arr[p1_ptr]);
-      p1_ptr += UNIT_RUN_SIZE;
-      BitonicMerge4(ra, rb);
-      StoreReg(ra, &buffer[buffer_offset]);
-      buffer_offset += UNIT_RUN_SIZE;
-    }
+template<typename InType, typename RegType>
+void MaskedMergeSegment8(InType *a, size_t na, InType *b, size_t nb, InType *out) {
+  MergeSegment<InType, RegType, 8, 2, MergeRegisters<RegType, MaskedBitonicMerge8<RegType>>,
+                MASKED_WIDE_REGS_8<InType>, BitonicMergeRegisters<RegType, MASKED_WIDE_REGS_8<InType>, MaskedReverse8<RegType>, MaskedMinMax8, MaskedIntraRegisterSort8x8<RegType>>>(a, na, b, nb, out);
+}
 
-    while (p2_ptr < end) {
-      LoadReg(ra, &arr[p2_ptr]);
-      p2_ptr += UNIT_RUN_SIZE;
-      BitonicMerge4(ra, rb);
-      StoreReg(ra, &buffer[buffer_offset]);
-      buffer_offset += UNIT_RUN_SIZE;
-    }
+template void MaskedMergeSegment8<int, __m256i>(int *a, size_t na, int *b, size_t nb, int *out);
+template void MaskedMergeSegment8<float, __m256>(float *a, size_t na, float *b, size_t nb, float *out);
 
-    StoreReg(rb, &buffer[buffer_offset]);
-    buffer_offset += UNIT_RUN_SIZE;
-  }
+template<typename InType, typename RegType>
+void MergePass4(InType *&arr, InType *buffer, size_t N, unsigned int run_size) {
+  MergePass<InType, RegType, 4, 1, MergeRegisters<RegType, BitonicMerge4<RegType>>,
+            WIDE_REGS_4<InType>, BitonicMergeRegisters<RegType, WIDE_REGS_4<InType>, Reverse4<RegType>, MinMax4, IntraRegisterSort4x4<RegType>>>(arr, buffer, N, run_size);
 }
+
 template void MergePass4<int64_t, __m256i>(int64_t *&arr, int64_t *buffer, size_t N, unsigned int run_size);
 template void MergePass4<double, __m256d>(double *&arr, double *buffer, size_t N, unsigned int run_size);
 
 template<typename InType, typename RegType>
-void MaskedMergePass4(InType *&arr, InType *buffer, size_t N, unsigned int run_size) {
-  int UNIT_RUN_SIZE = 4;
-#pragma omp parallel for
-  for (int i = 0; i < N; i += 2 * run_size) {
-    int start = i;
-    int mid = i + run_size;
-    int end = i + 2 * run_size;
-    int buffer_offset = start;
-    RegType ra, rb;
-    int p1_ptr = start;
-    int p2_ptr = mid;
-    LoadReg(ra, &arr[p1_ptr]);
-    LoadReg(rb, &arr[p2_ptr]);
-    p1_ptr += UNIT_RUN_SIZE;
-    p2_ptr += UNIT_RUN_SIZE;
-
-    while (p1_ptr < mid && p2_ptr < end) {
-      MaskedBitonicMerge4(ra, rb);
-
-      StoreReg(ra, &buffer[buffer_offset]);
-      buffer_offset += UNIT_RUN_SIZE;
-
-      if (arr[p1_ptr] > arr[p2_ptr]) {
-        LoadReg(ra, &arr[p2_ptr]);
-        p2_ptr += UNIT_RUN_SIZE;
-      } else {
-        LoadReg(ra, &arr[p1_ptr]);
-        p1_ptr += UNIT_RUN_SIZE;
-      }
-    }
+void MergeRunPair4(InType *arr, InType *buffer, size_t start, size_t run_size,
+                   size_t segment, size_t segments) {
+  bool stream = StreamOutput(4 * run_size * sizeof(InType));
+  MergeRunPair<InType, RegType, 4, 1, MergeRegisters<RegType, BitonicMerge4<RegType>>,
+               WIDE_REGS_4<InType>, BitonicMergeRegisters<RegType, WIDE_REGS_4<InType>, Reverse4<RegType>, MinMax4, IntraRegisterSort4x4<RegType>>>(arr, buffer, start, run_size, segment, segments, stream);
+}
 
-    MaskedBitonicMerge4(ra, rb);
+template void MergeRunPair4<int64_t, __m256i>(int64_t *arr, int64_t *buffer, size_t start, size_t run_size,
+                                              size_t segment, size_t segments);
+template void MergeRunPair4<double, __m256d>(double *arr, double *buffer, size_t start, size_t run_size,
+                                             size_t segment, size_t segments);
 
-    StoreReg(ra, &buffer[buffer_offset]);
-    buffer_offset += UNIT_RUN_SIZE;
+template<typename InType, typename RegType>
+void MergeSegment4(InType *a, size_t na, InType *b, size_t nb, InType *out) {
+  MergeSegment<InType, RegType, 4, 1, MergeRegisters<RegType, BitonicMerge4<RegType>>,
+                WIDE_REGS_4<InType>, BitonicMergeRegisters<RegType, WIDE_REGS_4<InType>, Reverse4<RegType>, MinMax4, IntraRegisterSort4x4<RegType>>>(a, na, b, nb, out);
+}
 
-    while (p1_ptr < mid) {
-      LoadReg(ra, &arr[p1_ptr]);
-      p1_ptr += UNIT_RUN_SIZE;
-      MaskedBitonicMerge4(ra, rb);
-      StoreReg(ra, &buffer[buffer_offset]);
-      buffer_offset += UNIT_RUN_SIZE;
-    }
+template void MergeSegment4<int64_t, __m256i>(int64_t *a, size_t na, int64_t *b, size_t nb, int64_t *out);
+template void MergeSegment4<double, __m256d>(double *a, size_t na, double *b, size_t nb, double *out);
 
-    while (p2_ptr < end) {
-      LoadReg(ra, &arr[p2_ptr]);
-      p2_ptr += UNIT_RUN_SIZE;
-      MaskedBitonicMerge4(ra, rb);
-      StoreReg(ra, &buffer[buffer_offset]);
-      buffer_offset += UNIT_RUN_SIZE;
-    }
+void GatherMergeRunPair4(int64_t *arr, int64_t *buffer, size_t start, size_t run_size,
+                         size_t segment, size_t segments, const int64_t *records) {
+  bool stream = StreamOutput(4 * run_size * sizeof(int64_t));
+  MergeRunPair<int64_t, __m256i, 4, 1, MergeRegisters<__m256i, BitonicMerge4<__m256i>>,
+               WIDE_REGS_4<int64_t>, BitonicMergeRegisters<__m256i, WIDE_REGS_4<int64_t>, Reverse4<__m256i>, MinMax4, IntraRegisterSort4x4<__m256i>>,
+               GatherOutput>(arr, buffer, start, run_size, segment, segments, stream, {records});
+}
 
-    StoreReg(rb, &buffer[buffer_offset]);
-    buffer_offset += UNIT_RUN_SIZE;
-  }
+template<typename InType, typename RegType>
+void MaskedMergePass4(InType *&arr, InType *buffer, size_t N, unsigned int run_size) {
+  MergePass<InType, RegType, 4, 2, MergeRegisters<RegType, MaskedBitonicMerge4<RegType>>,
+            1, MergeRegisters<RegType, MaskedBitonicMerge4<RegType>>>(arr, buffer, N, run_size);
 }
+
 template void MaskedMergePass4<int64_t, __m256i>(int64_t *&arr, int64_t *buffer, size_t N, unsigned int run_size);
 template void MaskedMergePass4<double, __m256d>(double *&arr, double *buffer, size_t N, unsigned int run_size);
+
+template<typename InType, typename RegType>
+void MaskedMergeRunPair4(InType *arr, InType *buffer, size_t start, size_t run_size,
+                         size_t segment, size_t segments) {
+  bool stream = StreamOutput(4 * run_size * sizeof(InType));
+  MergeRunPair<InType, RegType, 4, 2, MergeRegisters<RegType, MaskedBitonicMerge4<RegType>>,
+               1, MergeRegisters<RegType, MaskedBitonicMerge4<RegType>>>(arr, buffer, start, run_size, segment, segments, stream);
+}
+
+template void MaskedMergeRunPair4<int64_t, __m256i>(int64_t *arr, int64_t *buffer, size_t start, size_t run_size,
+                                                    size_t segment, size_t segments);
+template void MaskedMergeRunPair4<double, __m256d>(double *arr, double *buffer, size_t start, size_t run_size,
+                                                   size_t segment, size_t segments);
+
+template<typename InType, typename RegType>
+void MaskedMergeSegment4(InType *a, size_t na, InType *b, size_t nb, InType *out) {
+  MergeSegment<InType, RegType, 4, 2, MergeRegisters<RegType, MaskedBitonicMerge4<RegType>>,
+                1, MergeRegisters<RegType, MaskedBitonicMerge4<RegType>>>(a, na, b, nb, out);
+}
+
+template void MaskedMergeSegment4<int64_t, __m256i>(int64_t *a, size_t na, int64_t *b, size_t nb, int64_t *out);
+template void MaskedMergeSegment4<double, __m256d>(double *a, size_t na, double *b, size_t nb, double *out);
 }
 
 #endif
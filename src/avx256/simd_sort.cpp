@@ -1,78 +1,695 @@
 #include "avx256/simd_sort.h"
+#include "numa_util.h"
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <sched.h>
+#include <stdexcept>
+#include <vector>
 
 #ifdef AVX2
 namespace avx2 {
+template<typename InType>
+struct SortTaskGraph {
+  InType *arr;
+  InType *buffer;
+  size_t N;
+  size_t block_size;
+  size_t unit_run_size;
+  size_t chunk_size;
+  int chunk_passes;
+  // Smallest output segment a merge task is split into
+  size_t grain;
+  void (*sort_block)(InType *&, size_t);
+  void (*merge_pass)(InType *&, InType *, size_t, unsigned int);
+  void (*merge_run_pair)(InType *, InType *, size_t, size_t, size_t, size_t);
+  // Optional layout transform: pack fills each chunk from the caller's records
+  // right before its block sort, and the final merge writes records through
+  // unpack_run_pair instead of merge_run_pair
+  void (*pack)(InType *, size_t, size_t, const InType *);
+  void (*unpack_run_pair)(InType *, InType *, size_t, size_t, size_t, size_t, const InType *);
+  const InType *records;
+
+  // Runs of the given size end up in arr or buffer depending on how many
+  // passes produced them
+  InType *Side(size_t run_size) const {
+    int passes = chunk_passes;
+    for (size_t size = chunk_size; size < run_size; size *= 2) {
+      passes++;
+    }
+    return passes % 2 == 0 ? arr : buffer;
+  }
+};
+
+/**
+ * Sorts [start, start + size) as a task. A chunk is sorted in cache by a single
+ * task (sorting network blocks plus the in-cache merge passes). Larger ranges
+ * sort both halves as child tasks and then merge them with one task per output
+ * segment, so a merge only waits for its own inputs and merges on different
+ * levels of the tree overlap instead of meeting at a barrier after every pass.
+ */
+template<typename InType>
+static void SortTask(const SortTaskGraph<InType> *g, size_t start, size_t size) {
+  if (size <= g->chunk_size) {
+    InType *chunk_arr = g->arr + start;
+    InType *chunk_buffer = g->buffer + start;
+    if (g->pack != nullptr) {
+      g->pack(chunk_arr, start, size, g->records);
+    }
+    for (size_t j = 0; j < size; j += g->block_size) {
+      g->sort_block(chunk_arr, j);
+    }
+    for (size_t run_size = g->unit_run_size; run_size < size; run_size *= 2) {
+      if (size == g->N && 2 * run_size == size && g->unpack_run_pair != nullptr) {
+        g->unpack_run_pair(chunk_arr, chunk_buffer, 0, run_size, 0, 1, g->records);
+      } else {
+        g->merge_pass(chunk_arr, chunk_buffer, size, run_size);
+      }
+      std::swap(chunk_arr, chunk_buffer);
+    }
+    return;
+  }
+
+  size_t half = size / 2;
+#pragma omp task
+  SortTask(g, start, half);
+#pragma omp task
+  SortTask(g, start + half, half);
+#pragma omp taskwait
+
+  InType *src = g->Side(half);
+  InType *dst = g->Side(size);
+  size_t segments = std::max(size / g->grain, (size_t) 1);
+  for (size_t s = 0; s < segments; s++) {
+    if (size == g->N && g->unpack_run_pair != nullptr) {
+#pragma omp task
+      g->unpack_run_pair(src, dst, start, half, s, segments, g->records);
+    } else {
+#pragma omp task
+      g->merge_run_pair(src, dst, start, half, s, segments);
+    }
+  }
+#pragma omp taskwait
+}
+
+/**
+ * Work items of the bulk synchronous schedule used under an executor or pinned
+ * threads: every chunk is one item, then every merge level is one batch of
+ * output segments
+ */
+template<typename InType>
+static void ChunkItem(void *arg, size_t c) {
+  const SortTaskGraph<InType> *g = (const SortTaskGraph<InType> *) arg;
+  SortTask(g, c * g->chunk_size, g->chunk_size);
+}
+
+template<typename InType>
+struct MergeLevel {
+  const SortTaskGraph<InType> *graph;
+  size_t size;
+  size_t segments;
+};
+
+template<typename InType>
+static void MergeLevelItem(void *arg, size_t i) {
+  const MergeLevel<InType> *level = (const MergeLevel<InType> *) arg;
+  const SortTaskGraph<InType> *g = level->graph;
+  size_t half = level->size / 2;
+  size_t start = i / level->segments * level->size;
+  size_t s = i % level->segments;
+  if (level->size == g->N && g->unpack_run_pair != nullptr) {
+    g->unpack_run_pair(g->Side(half), g->Side(level->size), start, half, s, level->segments, g->records);
+  } else {
+    g->merge_run_pair(g->Side(half), g->Side(level->size), start, half, s, level->segments);
+  }
+}
+
+/**
+ * Cache-blocked driver: every L2-sized chunk is fully sorted before it is
+ * merged with its neighbours, so only the remaining log(N/chunk) passes stream
+ * through DRAM. The work is expressed as a task graph executed by the OpenMP
+ * runtime, whose idle threads pick up ready tasks from the other threads. A
+ * layout transform of the caller's records (pack/unpack_run_pair) rides along
+ * with the first touch of each chunk and the stores of the final merge, so it
+ * costs no sweep of its own. Under an executor, whose tasks must not wait on
+ * each other, the same work runs level by level instead; so it does when the
+ * threads are pinned, where the static schedule of every level gives a thread
+ * the slice of the output whose runs it produced in the level before.
+ */
+template<typename InType>
+static bool CacheBlockedSort(size_t N, InType *arr, InType *buffer, size_t block_size, size_t unit_run_size,
+                             void (*sort_block)(InType *&, size_t),
+                             void (*merge_pass)(InType *&, InType *, size_t, unsigned int),
+                             void (*merge_run_pair)(InType *, InType *, size_t, size_t, size_t, size_t),
+                             void (*pack)(InType *, size_t, size_t, const InType *) = nullptr,
+                             void (*unpack_run_pair)(InType *, InType *, size_t, size_t, size_t, size_t,
+                                                     const InType *) = nullptr,
+                             const InType *records = nullptr) {
+  assert(N % block_size == 0);
+  size_t threads = ParallelThreads();
+
+  // Use smaller chunks when there are too few of them to keep every thread busy
+  size_t chunk_size = CacheBlockSize(N, sizeof(InType), block_size);
+  while (chunk_size > block_size && N / chunk_size < threads) {
+    chunk_size /= 2;
+  }
+  int chunk_passes = 0;
+  for (size_t run_size = unit_run_size; run_size < chunk_size; run_size *= 2) {
+    chunk_passes++;
+  }
+  size_t grain = chunk_size;
+  while (grain < N / (2 * threads)) {
+    grain *= 2;
+  }
+
+  SortTaskGraph<InType> graph = {arr, buffer, N, block_size, unit_run_size, chunk_size, chunk_passes, grain,
+                                 sort_block, merge_pass, merge_run_pair, pack, unpack_run_pair, records};
+  // Merges of runs that do not fit in the LLC together are bound by memory
+  // bandwidth, these levels run on as many threads as it takes to saturate it
+  size_t top_size = N;
+  while (top_size > chunk_size && 2 * top_size * sizeof(InType) > StreamingThreshold()) {
+    top_size /= 2;
+  }
+  if (CurrentExecutor().parallel_for != nullptr || ThreadsPinned()) {
+    ParallelFor(N / chunk_size, ChunkItem<InType>, &graph);
+    for (size_t size = 2 * chunk_size; size <= top_size; size *= 2) {
+      MergeLevel<InType> level = {&graph, size, std::max(size / grain, (size_t) 1)};
+      ParallelFor(N / size * level.segments, MergeLevelItem<InType>, &level);
+    }
+  } else {
+#pragma omp parallel
+#pragma omp single
+    for (size_t start = 0; start < N; start += top_size) {
+#pragma omp task
+      SortTask(&graph, start, top_size);
+    }
+  }
+  for (size_t size = 2 * top_size; size <= N; size *= 2) {
+    MergeLevel<InType> level = {&graph, size, std::max(size / grain, (size_t) 1)};
+    StreamingParallelFor(N / size * level.segments, MergeLevelItem<InType>, &level, 2 * N * sizeof(InType));
+  }
+
+  return graph.Side(N) == buffer;
+}
+
+template<typename InType>
+static void CacheBlockedSort(size_t N, InType *&arr, size_t block_size, size_t unit_run_size,
+                             void (*sort_block)(InType *&, size_t),
+                             void (*merge_pass)(InType *&, InType *, size_t, unsigned int),
+                             void (*merge_run_pair)(InType *, InType *, size_t, size_t, size_t, size_t),
+                             void (*pack)(InType *, size_t, size_t, const InType *) = nullptr,
+                             void (*unpack_run_pair)(InType *, InType *, size_t, size_t, size_t, size_t,
+                                                     const InType *) = nullptr,
+                             const InType *records = nullptr) {
+  ExecutionScope scope;
+  InType *buffer;
+  aligned_init(buffer, N);
+  if (CacheBlockedSort(N, arr, buffer, block_size, unit_run_size, sort_block, merge_pass, merge_run_pair,
+                       pack, unpack_run_pair, records)) {
+    std::swap(arr, buffer);
+  } else {
+    aligned_free(buffer, N);
+  }
+}
+
+/**
+ * NUMA-aware driver: the input is cut into one partition per node (a power of
+ * two of them), and each partition is sorted by a team of threads bound to its
+ * node, using scratch placed on that node. The sorted partitions are then
+ * combined by ordinary merge passes over all threads.
+ */
+template<typename InType>
+static void NumaSort(size_t N, InType *&arr, size_t block_size, size_t unit_run_size,
+                     void (*sort_block)(InType *&, size_t),
+                     void (*merge_pass)(InType *&, InType *, size_t, unsigned int),
+                     void (*merge_run_pair)(InType *, InType *, size_t, size_t, size_t, size_t)) {
+  ExecutionScope scope;
+  std::vector<int> nodes = NumaNodes();
+  size_t threads = omp_get_max_threads();
+  size_t parts = 1;
+  while (2 * parts <= std::min(nodes.size(), threads) && N / (2 * parts) >= block_size) {
+    parts *= 2;
+  }
+  // Placement is up to the executor's pool
+  if (parts == 1 || CurrentExecutor().parallel_for != nullptr) {
+    CacheBlockedSort(N, arr, block_size, unit_run_size, sort_block, merge_pass, merge_run_pair);
+    return;
+  }
+
+  // Scratch pages are only placed on first touch, so they can still be bound
+  InType *input = arr;
+  InType *buffer;
+  aligned_init(buffer, N);
+  size_t part_size = N / parts;
+  bool in_buffer = false;
+  int max_levels = omp_get_max_active_levels();
+  omp_set_max_active_levels(2);
+#pragma omp parallel num_threads(parts)
+  {
+    size_t p = omp_get_thread_num();
+    int node = nodes[p];
+    size_t team = threads / parts;
+    // Threads of the nested team are started from here and inherit the binding.
+    // A thread whose affinity cannot be saved or bound sorts its partition
+    // where it runs, with the scratch placed there by first touch.
+    cpu_set_t affinity;
+    bool bound = sched_getaffinity(0, sizeof(affinity), &affinity) == 0 && BindThreadToNode(node);
+    if (bound) {
+      // Scratch the kernel does not place still lands on the node at first touch
+      BindMemoryToNode(&buffer[p * part_size], part_size * sizeof(InType), node);
+      team = std::min(NumaNodeCpus(node).size(), team);
+    }
+    omp_set_num_threads(team);
+    bool part_in_buffer = CacheBlockedSort(part_size, &arr[p * part_size], &buffer[p * part_size], block_size,
+                                           unit_run_size, sort_block, merge_pass, merge_run_pair);
+    if (p == 0) {
+      in_buffer = part_in_buffer;
+    }
+    if (bound) {
+      sched_setaffinity(0, sizeof(affinity), &affinity);
+    }
+  }
+  omp_set_max_active_levels(max_levels);
+  if (in_buffer) {
+    std::swap(arr, buffer);
+  }
+
+  // Cross-node merge
+  for (size_t run_size = part_size; run_size < N; run_size *= 2) {
+    merge_pass(arr, buffer, N, run_size);
+    std::swap(arr, buffer);
+  }
+  if (buffer != input) {
+    aligned_free(buffer, N);
+  }
+}
+
+// Releases a work array the library allocated itself, after a sort that may
+// have swapped it for its scratch buffer
+template<typename InType>
+static void ReleaseWorkArray(InType *arr, InType *input, size_t N) {
+  if (arr != input) {
+    aligned_free(input, N);
+  }
+  aligned_free(arr, N);
+}
+
+// Cache-blocked sorts of a slice in arr or buffer, for the shared drivers
+static bool SortSlice(size_t N, int *arr, int *buffer) {
+  return CacheBlockedSort<int>(N, arr, buffer, 64, 8, SortBlock64<int, __m256i>, MergePass8<int, __m256i>,
+                               MergeRunPair8<int, __m256i>);
+}
+
+static bool SortSlice(size_t N, int64_t *arr, int64_t *buffer) {
+  return CacheBlockedSort<int64_t>(N, arr, buffer, 16, 4, SortBlock16<int64_t, __m256i>, MergePass4<int64_t, __m256i>,
+                                   MergeRunPair4<int64_t, __m256i>);
+}
+
+static bool SortSlice(size_t N, float *arr, float *buffer) {
+  return CacheBlockedSort<float>(N, arr, buffer, 64, 8, SortBlock64<float, __m256>, MergePass8<float, __m256>,
+                                 MergeRunPair8<float, __m256>);
+}
+
+static bool SortSlice(size_t N, double *arr, double *buffer) {
+  return CacheBlockedSort<double>(N, arr, buffer, 16, 4, SortBlock16<double, __m256d>, MergePass4<double, __m256d>,
+                                  MergeRunPair4<double, __m256d>);
+}
+
+// Scratch of the low-memory sort in values per square root of N, when the
+// caller does not set a budget
+const size_t LOW_MEMORY_SCRATCH_PER_ROOT = 64;
+// Rotations of at least this many records are reversed by parallel task loops
+const size_t PARALLEL_ROTATE_SIZE = 1 << 16;
+
+template<typename InType>
+struct InPlaceMergeGraph {
+  // One slice of leaf_size records per thread
+  InType *scratch;
+  size_t leaf_size;
+  void (*merge_segment)(InType *, size_t, InType *, size_t, InType *);
+};
+
+template<typename Record>
+static void ReverseTask(Record *first, size_t n) {
+#pragma omp taskloop grainsize(PARALLEL_ROTATE_SIZE / 2)
+  for (size_t i = 0; i < n / 2; i++) {
+    std::swap(first[i], first[n - 1 - i]);
+  }
+}
+
+// Moves [first + middle, first + n) in front of [first, first + middle)
+template<typename Record>
+static void RotateTask(Record *first, size_t middle, size_t n) {
+  if (n < PARALLEL_ROTATE_SIZE || omp_get_num_threads() == 1) {
+    std::rotate(first, first + middle, first + n);
+    return;
+  }
+  ReverseTask(first, middle);
+  ReverseTask(first + middle, n - middle);
+  ReverseTask(first, n);
+}
+
+/**
+ * Merges the adjacent sorted runs [a, a + na) and [a + na, a + na + nb) of
+ * records in place. Until a merge fits in a thread's scratch slice it is cut at
+ * the output midpoint with a co-rank search, and one rotation brings the inputs
+ * of each half together so the halves merge as independent tasks. Leaves are
+ * merged into scratch by the SIMD segment kernel and copied back.
+ */
+template<typename InType, typename Record>
+static void InPlaceMergeTask(const InPlaceMergeGraph<InType> *g, Record *a, size_t na, size_t nb) {
+  const size_t STRIDE = sizeof(Record) / sizeof(InType);
+  if (na == 0 || nb == 0) {
+    return;
+  }
+  InType *a_values = (InType *) a;
+  InType *b_values = (InType *) (a + na);
+  if (na + nb <= g->leaf_size) {
+    // A leaf has no task scheduling point, so no other task can use the slice
+    InType *scratch = g->scratch + omp_get_thread_num() * g->leaf_size * STRIDE;
+    g->merge_segment(a_values, na * STRIDE, b_values, nb * STRIDE, scratch);
+    std::copy(scratch, scratch + (na + nb) * STRIDE, a_values);
+    return;
+  }
+
+  size_t k = (na + nb) / 2;
+  size_t i = CoRank(k, a_values, na, b_values, nb, STRIDE);
+  size_t j = k - i;
+  RotateTask(a + i, na - i, na - i + j);
+#pragma omp task
+  InPlaceMergeTask(g, a, i, j);
+#pragma omp task
+  InPlaceMergeTask(g, a + k, na - i, nb - j);
+#pragma omp taskwait
+}
+
+/**
+ * One merge level of the low-memory driver under an executor: each worker
+ * merges every workers-th run pair in turn, using its own scratch slice
+ */
+template<typename InType, typename Record>
+struct InPlaceMergeLevel {
+  const InPlaceMergeGraph<InType> *graph;
+  Record *records;
+  size_t run_size;
+  size_t records_size;
+  size_t pairs;
+  size_t workers;
+};
+
+template<typename InType, typename Record>
+static void InPlaceMergeLevelItem(void *arg, size_t w) {
+  const size_t STRIDE = sizeof(Record) / sizeof(InType);
+  const InPlaceMergeLevel<InType, Record> *level = (const InPlaceMergeLevel<InType, Record> *) arg;
+  // Outside of OpenMP every leaf uses the first slice of the graph
+  InPlaceMergeGraph<InType> graph = *level->graph;
+  graph.scratch += w * graph.leaf_size * STRIDE;
+  for (size_t p = w; p < level->pairs; p += level->workers) {
+    size_t start = 2 * p * level->run_size;
+    size_t na = std::min(level->run_size, level->records_size - start);
+    InPlaceMergeTask(&graph, &level->records[start], na, std::min(level->run_size, level->records_size - start - na));
+  }
+}
+
+/**
+ * Low-memory driver: sorts in place with a scratch buffer of scratch_bytes, or
+ * O(sqrt(N)) when it is 0, instead of a second N-value array. Scratch-sized
+ * chunks are sorted by the cache-blocked driver and then merged in place by
+ * InPlaceMergeTask. A Record is one or more values, the first being the key.
+ * N may be any number of records: a partial last chunk is sorted in power of
+ * two pieces, and what is left under a block by std::sort.
+ */
+template<typename InType, typename Record>
+static void LowMemorySort(size_t N, InType *arr, size_t scratch_bytes, size_t block_size, size_t unit_run_size,
+                          void (*sort_block)(InType *&, size_t),
+                          void (*merge_pass)(InType *&, InType *, size_t, unsigned int),
+                          void (*merge_run_pair)(InType *, InType *, size_t, size_t, size_t, size_t),
+                          void (*merge_segment)(InType *, size_t, InType *, size_t, InType *)) {
+  const size_t STRIDE = sizeof(Record) / sizeof(InType);
+  assert(N % STRIDE == 0);
+  ExecutionScope scope;
+  size_t threads = ParallelThreads();
+  size_t budget = scratch_bytes > 0 ? scratch_bytes / sizeof(InType)
+                                    : LOW_MEMORY_SCRATCH_PER_ROOT * (size_t) std::sqrt((double) N);
+
+  // At least one sorting network block, both for the chunks and per thread
+  size_t chunk_size = block_size;
+  while (2 * chunk_size <= std::min(budget, N)) {
+    chunk_size *= 2;
+  }
+  size_t leaf_size = block_size;
+  while (2 * leaf_size * threads <= chunk_size) {
+    leaf_size *= 2;
+  }
+  size_t scratch_size = std::max(chunk_size, leaf_size * threads);
+  InType *scratch;
+  aligned_init(scratch, scratch_size);
+
+  // Whole chunks, then the tail in halving pieces
+  size_t offset = 0;
+  std::vector<size_t> tail;
+  for (size_t size = chunk_size; size >= block_size; size /= 2) {
+    for (; offset + size <= N; offset += size) {
+      if (CacheBlockedSort(size, &arr[offset], scratch, block_size, unit_run_size,
+                           sort_block, merge_pass, merge_run_pair)) {
+        std::copy(scratch, scratch + size, &arr[offset]);
+      }
+      if (size < chunk_size) {
+        tail.push_back(offset);
+      }
+    }
+  }
+  if (offset < N) {
+    std::sort((Record *) &arr[offset], (Record *) &arr[N], [](const Record &a, const Record &b) {
+      return *(const InType *) &a < *(const InType *) &b;
+    });
+    tail.push_back(offset);
+  }
+
+  InPlaceMergeGraph<InType> graph = {scratch, leaf_size / STRIDE, merge_segment};
+  Record *records = (Record *) arr;
+  size_t records_size = N / STRIDE;
+  // The tail pieces are merged into one run, smallest first
+  for (size_t i = tail.size(); i-- > 1;) {
+    InPlaceMergeTask(&graph, (Record *) &arr[tail[i - 1]], (tail[i] - tail[i - 1]) / STRIDE,
+                     (N - tail[i]) / STRIDE);
+  }
+  if (CurrentExecutor().parallel_for != nullptr) {
+    for (size_t run_size = chunk_size / STRIDE; run_size < records_size; run_size *= 2) {
+      size_t pairs = (records_size + 2 * run_size - 1) / (2 * run_size);
+      InPlaceMergeLevel<InType, Record> level = {&graph, records, run_size, records_size, pairs,
+                                                 std::min(pairs, threads)};
+      ParallelFor(level.workers, InPlaceMergeLevelItem<InType, Record>, &level);
+    }
+  } else {
+#pragma omp parallel
+#pragma omp single
+    for (size_t run_size = chunk_size / STRIDE; run_size < records_size; run_size *= 2) {
+      for (size_t start = 0; start < records_size; start += 2 * run_size) {
+        size_t na = std::min(run_size, records_size - start);
+#pragma omp task
+        InPlaceMergeTask(&graph, &records[start], na, std::min(run_size, records_size - start - na));
+      }
+#pragma omp taskwait
+    }
+  }
+  aligned_free(scratch, scratch_size);
+}
+
+// Packs std::pair<int, int> records into int64_t keys that order by one field
+// and keep the index of the record in the low half
+template<int FIELD>
+static void PackKeyIndex(int64_t *chunk, size_t start, size_t size, const int64_t *records) {
+  auto pairs = (const std::pair<int, int> *) records;
+  for (size_t i = 0; i < size; i++) {
+    int64_t key = FIELD == 0 ? pairs[start + i].first : pairs[start + i].second;
+    chunk[i] = (key << 32) | (start + i);
+  }
+}
+
+// Copies the caller's records into a chunk of the aligned array they are
+// sorted in, as the layout transform of records off a cache line
+template<typename InType>
+static void CopyRecords(InType *chunk, size_t start, size_t size, const InType *records) {
+  std::copy(records + start, records + start + size, chunk);
+}
+
+/**
+ * Sorts the caller's records in place. The kernels load and store whole
+ * registers at aligned addresses, so records off a cache line, as those of a
+ * std::vector, are sorted in an aligned array that the pack of the sort fills
+ * chunk by chunk. A result that does not end up in records is copied back.
+ * @param sort: sorts N values of records in arr, returns whether the result
+ * is in buffer rather than in arr
+ */
+template<typename InType>
+static void SortRecordsInPlace(size_t N, InType *records,
+                               bool (*sort)(size_t N, InType *arr, InType *buffer, const InType *records)) {
+  ExecutionScope scope;
+  InType *arr = records;
+  if ((uintptr_t) records % 64 != 0) {
+    aligned_init(arr, N);
+  }
+  InType *buffer;
+  aligned_init(buffer, N);
+  InType *sorted = sort(N, arr, buffer, records) ? buffer : arr;
+  if (sorted != records) {
+    ParallelCopy(records, sorted, N * sizeof(InType));
+  }
+  aligned_free(buffer, N);
+  if (arr != records) {
+    aligned_free(arr, N);
+  }
+}
+
 void SIMDSort(size_t N, int *&arr) {
   // Determine block size for the sorting network
   int BLOCK_SIZE = 64;
-  assert(N % BLOCK_SIZE == 0);
-  for (int i = 0; i < N; i += BLOCK_SIZE) {
-    SortBlock64<int, __m256i>(arr, i);
-  }
-  // Merge sorted runs
-  MergeRuns8<int, __m256i>(arr, N);
+  int UNIT_RUN_SIZE = 8;
+  CacheBlockedSort<int>(N, arr, BLOCK_SIZE, UNIT_RUN_SIZE,
+                        SortBlock64<int, __m256i>, MergePass8<int, __m256i>,
+                        MergeRunPair8<int, __m256i>);
 }
 
 void SIMDSort(size_t N, int64_t *&arr) {
   // Determine block size for the sorting network
   int BLOCK_SIZE = 16;
-  assert(N % BLOCK_SIZE == 0);
-  for (int i = 0; i < N; i += BLOCK_SIZE) {
-    SortBlock16<int64_t, __m256i>(arr, i);
-  }
-  // Merge sorted runs
-  MergeRuns4<int64_t, __m256i>(arr, N);
+  int UNIT_RUN_SIZE = 4;
+  CacheBlockedSort<int64_t>(N, arr, BLOCK_SIZE, UNIT_RUN_SIZE,
+                            SortBlock16<int64_t, __m256i>, MergePass4<int64_t, __m256i>,
+                            MergeRunPair4<int64_t, __m256i>);
 }
 
 void SIMDSort(size_t N, float *&arr) {
   // Determine block size for the sorting network
   int BLOCK_SIZE = 64;
-  assert(N % BLOCK_SIZE == 0);
-  for (int i = 0; i < N; i += BLOCK_SIZE) {
-    SortBlock64<float, __m256>(arr, i);
-  }
-  // Merge sorted runs
-  MergeRuns8<float, __m256>(arr, N);
+  int UNIT_RUN_SIZE = 8;
+  CacheBlockedSort<float>(N, arr, BLOCK_SIZE, UNIT_RUN_SIZE,
+                          SortBlock64<float, __m256>, MergePass8<float, __m256>,
+                          MergeRunPair8<float, __m256>);
 }
 
 void SIMDSort(size_t N, double *&arr) {
   // Determine block size for the sorting network
   int BLOCK_SIZE = 16;
-  assert(N % BLOCK_SIZE == 0);
-  for (int i = 0; i < N; i += BLOCK_SIZE) {
-    SortBlock16<double, __m256d>(arr, i);
-  }
-  // Merge sorted runs
-  MergeRuns4<double, __m256d>(arr, N);
+  int UNIT_RUN_SIZE = 4;
+  CacheBlockedSort<double>(N, arr, BLOCK_SIZE, UNIT_RUN_SIZE,
+                           SortBlock16<double, __m256d>, MergePass4<double, __m256d>,
+                           MergeRunPair4<double, __m256d>);
 }
 
-void SIMDSort(size_t N, std::pair<int, int> *&arr) {
-  int *kv_arr;
-  size_t Nkv = N * 2;
-  aligned_init(kv_arr, Nkv);
-  for (int i = 0; i < N; i++) {
-    kv_arr[2 * i] = arr[i].first;
-    kv_arr[2 * i + 1] = arr[i].second;
-  }
+void NumaSIMDSort(size_t N, int *&arr) {
+  // Determine block size for the sorting network
+  int BLOCK_SIZE = 64;
+  int UNIT_RUN_SIZE = 8;
+  NumaSort<int>(N, arr, BLOCK_SIZE, UNIT_RUN_SIZE,
+                SortBlock64<int, __m256i>, MergePass8<int, __m256i>,
+                MergeRunPair8<int, __m256i>);
+}
+
+void NumaSIMDSort(size_t N, int64_t *&arr) {
+  // Determine block size for the sorting network
+  int BLOCK_SIZE = 16;
+  int UNIT_RUN_SIZE = 4;
+  NumaSort<int64_t>(N, arr, BLOCK_SIZE, UNIT_RUN_SIZE,
+                    SortBlock16<int64_t, __m256i>, MergePass4<int64_t, __m256i>,
+                    MergeRunPair4<int64_t, __m256i>);
+}
+
+void NumaSIMDSort(size_t N, float *&arr) {
+  // Determine block size for the sorting network
+  int BLOCK_SIZE = 64;
+  int UNIT_RUN_SIZE = 8;
+  NumaSort<float>(N, arr, BLOCK_SIZE, UNIT_RUN_SIZE,
+                  SortBlock64<float, __m256>, MergePass8<float, __m256>,
+                  MergeRunPair8<float, __m256>);
+}
+
+void NumaSIMDSort(size_t N, double *&arr) {
+  // Determine block size for the sorting network
+  int BLOCK_SIZE = 16;
+  int UNIT_RUN_SIZE = 4;
+  NumaSort<double>(N, arr, BLOCK_SIZE, UNIT_RUN_SIZE,
+                   SortBlock16<double, __m256d>, MergePass4<double, __m256d>,
+                   MergeRunPair4<double, __m256d>);
+}
+
+void PartitionedSIMDSort(size_t N, int *&arr) {
+  // Determine block size for the sorting network
+  int BLOCK_SIZE = 64;
+  PartitionedSort<int>(N, arr, BLOCK_SIZE, SortSlice, MergeSegment8<int, __m256i>);
+}
+
+void PartitionedSIMDSort(size_t N, int64_t *&arr) {
+  // Determine block size for the sorting network
+  int BLOCK_SIZE = 16;
+  PartitionedSort<int64_t>(N, arr, BLOCK_SIZE, SortSlice, MergeSegment4<int64_t, __m256i>);
+}
+
+void PartitionedSIMDSort(size_t N, float *&arr) {
+  // Determine block size for the sorting network
+  int BLOCK_SIZE = 64;
+  PartitionedSort<float>(N, arr, BLOCK_SIZE, SortSlice, MergeSegment8<float, __m256>);
+}
+
+void PartitionedSIMDSort(size_t N, double *&arr) {
+  // Determine block size for the sorting network
+  int BLOCK_SIZE = 16;
+  PartitionedSort<double>(N, arr, BLOCK_SIZE, SortSlice, MergeSegment4<double, __m256d>);
+}
+
+// Sorts of std::pair records viewed as 2N interleaved keys and values
+static bool SortPairs(size_t Nkv, int *kv_arr, int *buffer, const int *records) {
   // 4 rows of 4 K-V(8 total) pairs = 32 values
   int BLOCK_SIZE = 32;
-  assert(Nkv % BLOCK_SIZE == 0);
-  for (int i = 0; i < Nkv; i += BLOCK_SIZE) {
-    MaskedSortBlock4x8<int, __m256i>(kv_arr, i);
-  }
+  int UNIT_RUN_SIZE = 8;
+  return CacheBlockedSort<int>(Nkv, kv_arr, buffer, BLOCK_SIZE, UNIT_RUN_SIZE,
+                               MaskedSortBlock4x8<int, __m256i>, MaskedMergePass8<int, __m256i>,
+                               MaskedMergeRunPair8<int, __m256i>, records != kv_arr ? CopyRecords<int> : nullptr,
+                               nullptr, records);
+}
 
-  // Merge sorted runs
-  MaskedMergeRuns8<int, __m256i>(kv_arr, Nkv);
-  for (int i = 0; i < N; i++) {
-    arr[i].first = kv_arr[2 * i];
-    arr[i].second = kv_arr[2 * i + 1];
-  }
+static bool SortPairs(size_t Nkv, float *kv_arr, float *buffer, const float *records) {
+  // 4 rows of 4 K-V(8 total) pairs = 32 values
+  int BLOCK_SIZE = 32;
+  int UNIT_RUN_SIZE = 8;
+  return CacheBlockedSort<float>(Nkv, kv_arr, buffer, BLOCK_SIZE, UNIT_RUN_SIZE,
+                                 MaskedSortBlock4x8<float, __m256>, MaskedMergePass8<float, __m256>,
+                                 MaskedMergeRunPair8<float, __m256>, records != kv_arr ? CopyRecords<float> : nullptr,
+                                 nullptr, records);
+}
+
+static bool SortPairs(size_t Nkv, int64_t *kv_arr, int64_t *buffer, const int64_t *records) {
+  // 2 rows of 2 K-V(4 total) pairs = 8 values
+  int BLOCK_SIZE = 8;
+  int UNIT_RUN_SIZE = 4;
+  return CacheBlockedSort<int64_t>(Nkv, kv_arr, buffer, BLOCK_SIZE, UNIT_RUN_SIZE,
+                                   MaskedSortBlock2x4<int64_t, __m256i>, MaskedMergePass4<int64_t, __m256i>,
+                                   MaskedMergeRunPair4<int64_t, __m256i>,
+                                   records != kv_arr ? CopyRecords<int64_t> : nullptr, nullptr, records);
+}
+
+static bool SortPairs(size_t Nkv, double *kv_arr, double *buffer, const double *records) {
+  // 2 rows of 2 K-V(4 total) pairs = 8 values
+  int BLOCK_SIZE = 8;
+  int UNIT_RUN_SIZE = 4;
+  return CacheBlockedSort<double>(Nkv, kv_arr, buffer, BLOCK_SIZE, UNIT_RUN_SIZE,
+                                  MaskedSortBlock2x4<double, __m256d>, MaskedMergePass4<double, __m256d>,
+                                  MaskedMergeRunPair4<double, __m256d>,
+                                  records != kv_arr ? CopyRecords<double> : nullptr, nullptr, records);
+}
+
+void SIMDSort(size_t N, std::pair<int, int> *&arr) {
+  // std::pair already interleaves key and value, so the pairs are sorted as 2N
+  // values where they are, and arr stays the sorted array
+  SortRecordsInPlace(N * 2, (int *) arr, SortPairs);
 }
 
 void SIMDOrderBy32(std::pair<int, int> *&result_arr, size_t N, std::pair<int, int> *arr, int order_by) {
-  int *kv_arr;
+  int *kv_arr, *kv_input;
   size_t Nkv = N * 2;
   aligned_init(kv_arr, Nkv);
+  kv_input = kv_arr;
   aligned_init<std::pair<int, int>>(result_arr, N);
   for (int i = 0; i < N; i++) {
     kv_arr[2 * i] = order_by == 0 ? arr[i].first : arr[i].second;
@@ -81,101 +698,277 @@ void SIMDOrderBy32(std::pair<int, int> *&result_arr, size_t N, std::pair<int, in
 
   // 4 rows of 4 K-V(8 total) pairs = 32 values
   int BLOCK_SIZE = 32;
-  assert(Nkv % BLOCK_SIZE == 0);
-  for (int i = 0; i < Nkv; i += BLOCK_SIZE) {
-    MaskedSortBlock4x8<int, __m256i>(kv_arr, i);
-  }
-
-  // Merge sorted runs
-  MaskedMergeRuns8<int, __m256i>(kv_arr, Nkv);
+  int UNIT_RUN_SIZE = 8;
+  CacheBlockedSort<int>(Nkv, kv_arr, BLOCK_SIZE, UNIT_RUN_SIZE,
+                        MaskedSortBlock4x8<int, __m256i>, MaskedMergePass8<int, __m256i>,
+                        MaskedMergeRunPair8<int, __m256i>);
 
   for (int j = 0; j < N; ++j) {
     auto index = 0x00000000ffffffff & kv_arr[2 * j + 1];
     result_arr[j] = arr[index];
   }
+  ReleaseWorkArray(kv_arr, kv_input, Nkv);
 }
 
 
 void SIMDOrderBy64(std::pair<int, int> *&result_arr, size_t N, std::pair<int, int> *arr, int order_by) {
-  int64_t *kv_arr;
-  aligned_init<int64_t>(kv_arr, N);
-  aligned_init<std::pair<int, int>>(result_arr, N);
-  for (int i = 0; i < N; ++i) {
-    auto value = (int64_t) (order_by == 0 ? arr[i].first : arr[i].second);
-    kv_arr[i] = (((value) << 32) | (0x00000000ffffffff & i));
-  }
-  SIMDSort(N, kv_arr);
-  for (int j = 0; j < N; ++j) {
-    auto index = 0x00000000ffffffff & kv_arr[j];
-    result_arr[j] = arr[index];
+  ExecutionScope scope;
+  // The final merge writes the records over the keys, into either buffer
+  int64_t *kv_arr, *buffer;
+  aligned_init(kv_arr, N);
+  aligned_init(buffer, N);
+  int BLOCK_SIZE = 16;
+  int UNIT_RUN_SIZE = 4;
+  if (CacheBlockedSort<int64_t>(N, kv_arr, buffer, BLOCK_SIZE, UNIT_RUN_SIZE,
+                                SortBlock16<int64_t, __m256i>, MergePass4<int64_t, __m256i>,
+                                MergeRunPair4<int64_t, __m256i>, order_by == 0 ? PackKeyIndex<0> : PackKeyIndex<1>,
+                                GatherMergeRunPair4, (const int64_t *) arr)) {
+    std::swap(kv_arr, buffer);
   }
+  result_arr = (std::pair<int, int> *) kv_arr;
+  aligned_free(buffer, N);
 }
 
 void SIMDSort(size_t N, std::pair<float, float> *&arr) {
-  float *kv_arr;
-  size_t Nkv = N * 2;
-  aligned_init(kv_arr, Nkv);
-  for (int i = 0; i < N; i++) {
-    kv_arr[2 * i] = arr[i].first;
-    kv_arr[2 * i + 1] = arr[i].second;
-  }
-  // 4 rows of 4 K-V(8 total) pairs = 32 values
+  SortRecordsInPlace(N * 2, (float *) arr, SortPairs);
+}
+
+void SIMDSort(size_t N, std::pair<int64_t, int64_t> *&arr) {
+  SortRecordsInPlace(N * 2, (int64_t *) arr, SortPairs);
+}
+
+void SIMDSort(size_t N, std::pair<double, double> *&arr) {
+  SortRecordsInPlace(N * 2, (double *) arr, SortPairs);
+}
+
+void LowMemorySIMDSort(size_t N, int *arr, size_t scratch_bytes) {
+  int BLOCK_SIZE = 64;
+  int UNIT_RUN_SIZE = 8;
+  LowMemorySort<int, int>(N, arr, scratch_bytes, BLOCK_SIZE, UNIT_RUN_SIZE,
+                          SortBlock64<int, __m256i>, MergePass8<int, __m256i>,
+                          MergeRunPair8<int, __m256i>, MergeSegment8<int, __m256i>);
+}
+
+void LowMemorySIMDSort(size_t N, int64_t *arr, size_t scratch_bytes) {
+  int BLOCK_SIZE = 16;
+  int UNIT_RUN_SIZE = 4;
+  LowMemorySort<int64_t, int64_t>(N, arr, scratch_bytes, BLOCK_SIZE, UNIT_RUN_SIZE,
+                                  SortBlock16<int64_t, __m256i>, MergePass4<int64_t, __m256i>,
+                                  MergeRunPair4<int64_t, __m256i>, MergeSegment4<int64_t, __m256i>);
+}
+
+void LowMemorySIMDSort(size_t N, float *arr, size_t scratch_bytes) {
+  int BLOCK_SIZE = 64;
+  int UNIT_RUN_SIZE = 8;
+  LowMemorySort<float, float>(N, arr, scratch_bytes, BLOCK_SIZE, UNIT_RUN_SIZE,
+                              SortBlock64<float, __m256>, MergePass8<float, __m256>,
+                              MergeRunPair8<float, __m256>, MergeSegment8<float, __m256>);
+}
+
+void LowMemorySIMDSort(size_t N, double *arr, size_t scratch_bytes) {
+  int BLOCK_SIZE = 16;
+  int UNIT_RUN_SIZE = 4;
+  LowMemorySort<double, double>(N, arr, scratch_bytes, BLOCK_SIZE, UNIT_RUN_SIZE,
+                                SortBlock16<double, __m256d>, MergePass4<double, __m256d>,
+                                MergeRunPair4<double, __m256d>, MergeSegment4<double, __m256d>);
+}
+
+// Pairs are sorted in place with the masked kernels, ordered by first
+void LowMemorySIMDSort(size_t N, std::pair<int, int> *arr, size_t scratch_bytes) {
   int BLOCK_SIZE = 32;
-  assert(Nkv % BLOCK_SIZE == 0);
-  for (int i = 0; i < Nkv; i += BLOCK_SIZE) {
-    MaskedSortBlock4x8<float, __m256>(kv_arr, i);
-  }
+  int UNIT_RUN_SIZE = 8;
+  LowMemorySort<int, std::pair<int, int>>(2 * N, (int *) arr, scratch_bytes, BLOCK_SIZE, UNIT_RUN_SIZE,
+                                          MaskedSortBlock4x8<int, __m256i>, MaskedMergePass8<int, __m256i>,
+                                          MaskedMergeRunPair8<int, __m256i>, MaskedMergeSegment8<int, __m256i>);
+}
 
-  // Merge sorted runs
-  MaskedMergeRuns8<float, __m256>(kv_arr, Nkv);
-  for (int i = 0; i < N; i++) {
-    arr[i].first = kv_arr[2 * i];
-    arr[i].second = kv_arr[2 * i + 1];
-  }
+void LowMemorySIMDSort(size_t N, std::pair<float, float> *arr, size_t scratch_bytes) {
+  int BLOCK_SIZE = 32;
+  int UNIT_RUN_SIZE = 8;
+  LowMemorySort<float, std::pair<float, float>>(2 * N, (float *) arr, scratch_bytes, BLOCK_SIZE, UNIT_RUN_SIZE,
+                                                MaskedSortBlock4x8<float, __m256>, MaskedMergePass8<float, __m256>,
+                                                MaskedMergeRunPair8<float, __m256>, MaskedMergeSegment8<float, __m256>);
 }
 
-void SIMDSort(size_t N, std::pair<int64_t, int64_t> *&arr) {
-  int64_t *kv_arr;
-  size_t Nkv = N * 2;
-  aligned_init(kv_arr, Nkv);
-  for (int i = 0; i < N; i++) {
-    kv_arr[2 * i] = arr[i].first;
-    kv_arr[2 * i + 1] = arr[i].second;
-  }
-  // 2 rows of 2 K-V(4 total) pairs = 8 values
+void LowMemorySIMDSort(size_t N, std::pair<int64_t, int64_t> *arr, size_t scratch_bytes) {
   int BLOCK_SIZE = 8;
-  assert(Nkv % BLOCK_SIZE == 0);
-  for (int i = 0; i < Nkv; i += BLOCK_SIZE) {
-    MaskedSortBlock2x4<int64_t, __m256i>(kv_arr, i);
-  }
-  // Merge sorted runs
-  MaskedMergeRuns4<int64_t, __m256i>(kv_arr, Nkv);
-  for (int i = 0; i < N; i++) {
-    arr[i].first = kv_arr[2 * i];
-    arr[i].second = kv_arr[2 * i + 1];
+  int UNIT_RUN_SIZE = 4;
+  LowMemorySort<int64_t, std::pair<int64_t, int64_t>>(2 * N, (int64_t *) arr, scratch_bytes, BLOCK_SIZE, UNIT_RUN_SIZE,
+                                                      MaskedSortBlock2x4<int64_t, __m256i>, MaskedMergePass4<int64_t, __m256i>,
+                                                      MaskedMergeRunPair4<int64_t, __m256i>, MaskedMergeSegment4<int64_t, __m256i>);
+}
+
+void LowMemorySIMDSort(size_t N, std::pair<double, double> *arr, size_t scratch_bytes) {
+  int BLOCK_SIZE = 8;
+  int UNIT_RUN_SIZE = 4;
+  LowMemorySort<double, std::pair<double, double>>(2 * N, (double *) arr, scratch_bytes, BLOCK_SIZE, UNIT_RUN_SIZE,
+                                                   MaskedSortBlock2x4<double, __m256d>, MaskedMergePass4<double, __m256d>,
+                                                   MaskedMergeRunPair4<double, __m256d>, MaskedMergeSegment4<double, __m256d>);
+}
+
+
+/**
+ * Queues SIMDSort on a pool. The future yields the sorted array, which is arr
+ * or a scratch buffer as with SIMDSort; arr must stay valid until then.
+ */
+template<typename T>
+static std::future<T *> SubmitSort(size_t N, T *arr, SortPool &pool) {
+  auto sort = std::make_shared<std::packaged_task<T *()>>([N, arr]() mutable {
+    SIMDSort(N, arr);
+    return arr;
+  });
+  pool.Submit([sort]() { (*sort)(); });
+  return sort->get_future();
+}
+
+std::future<int *> SortAsync(size_t N, int *arr, SortPool &pool) {
+  return SubmitSort(N, arr, pool);
+}
+
+std::future<int64_t *> SortAsync(size_t N, int64_t *arr, SortPool &pool) {
+  return SubmitSort(N, arr, pool);
+}
+
+std::future<float *> SortAsync(size_t N, float *arr, SortPool &pool) {
+  return SubmitSort(N, arr, pool);
+}
+
+std::future<double *> SortAsync(size_t N, double *arr, SortPool &pool) {
+  return SubmitSort(N, arr, pool);
+}
+
+std::future<std::pair<int, int> *> SortAsync(size_t N, std::pair<int, int> *arr, SortPool &pool) {
+  return SubmitSort(N, arr, pool);
+}
+
+std::future<std::pair<float, float> *> SortAsync(size_t N, std::pair<float, float> *arr, SortPool &pool) {
+  return SubmitSort(N, arr, pool);
+}
+
+std::future<std::pair<int64_t, int64_t> *> SortAsync(size_t N, std::pair<int64_t, int64_t> *arr, SortPool &pool) {
+  return SubmitSort(N, arr, pool);
+}
+
+std::future<std::pair<double, double> *> SortAsync(size_t N, std::pair<double, double> *arr, SortPool &pool) {
+  return SubmitSort(N, arr, pool);
+}
+
+int *DistributedSIMDSort(size_t N, int *arr, Transport &transport, size_t &result_N) {
+  return DistributedSort(N, arr, transport, result_N, SIMDSort, MergeSegment8<int, __m256i>);
+}
+
+int64_t *DistributedSIMDSort(size_t N, int64_t *arr, Transport &transport, size_t &result_N) {
+  return DistributedSort(N, arr, transport, result_N, SIMDSort, MergeSegment4<int64_t, __m256i>);
+}
+
+float *DistributedSIMDSort(size_t N, float *arr, Transport &transport, size_t &result_N) {
+  return DistributedSort(N, arr, transport, result_N, SIMDSort, MergeSegment8<float, __m256>);
+}
+
+double *DistributedSIMDSort(size_t N, double *arr, Transport &transport, size_t &result_N) {
+  return DistributedSort(N, arr, transport, result_N, SIMDSort, MergeSegment4<double, __m256d>);
+}
+
+template<>
+SlicedSort<int>::SlicedSort(size_t N, int *arr)
+    : SlicedSortDriver<int>(N, arr, 64, 8, SortBlock64<int, __m256i>, MergeRunPair8<int, __m256i>) {}
+
+template<>
+SlicedSort<int64_t>::SlicedSort(size_t N, int64_t *arr)
+    : SlicedSortDriver<int64_t>(N, arr, 16, 4, SortBlock16<int64_t, __m256i>, MergeRunPair4<int64_t, __m256i>) {}
+
+template<>
+SlicedSort<float>::SlicedSort(size_t N, float *arr)
+    : SlicedSortDriver<float>(N, arr, 64, 8, SortBlock64<float, __m256>, MergeRunPair8<float, __m256>) {}
+
+template<>
+SlicedSort<double>::SlicedSort(size_t N, double *arr)
+    : SlicedSortDriver<double>(N, arr, 16, 4, SortBlock16<double, __m256d>, MergeRunPair4<double, __m256d>) {}
+
+template class SlicedSort<int>;
+template class SlicedSort<int64_t>;
+template class SlicedSort<float>;
+template class SlicedSort<double>;
+
+template<>
+SortPipeline<int>::SortPipeline(size_t chunk_size, int workers, size_t queue_size)
+    : SortPipelineDriver<int>(chunk_size, workers, queue_size, 64, SortBlock64<int, __m256i>, MergeRuns8<int, __m256i>, MergeSegment8<int, __m256i>) {}
+
+template<>
+SortPipeline<int64_t>::SortPipeline(size_t chunk_size, int workers, size_t queue_size)
+    : SortPipelineDriver<int64_t>(chunk_size, workers, queue_size, 16, SortBlock16<int64_t, __m256i>, MergeRuns4<int64_t, __m256i>, MergeSegment4<int64_t, __m256i>) {}
+
+template<>
+SortPipeline<float>::SortPipeline(size_t chunk_size, int workers, size_t queue_size)
+    : SortPipelineDriver<float>(chunk_size, workers, queue_size, 64, SortBlock64<float, __m256>, MergeRuns8<float, __m256>, MergeSegment8<float, __m256>) {}
+
+template<>
+SortPipeline<double>::SortPipeline(size_t chunk_size, int workers, size_t queue_size)
+    : SortPipelineDriver<double>(chunk_size, workers, queue_size, 16, SortBlock16<double, __m256d>, MergeRuns4<double, __m256d>, MergeSegment4<double, __m256d>) {}
+
+template class SortPipeline<int>;
+template class SortPipeline<int64_t>;
+template class SortPipeline<float>;
+template class SortPipeline<double>;
+
+void ExternalSIMDSort(const std::string &input, const std::string &output, KeyType type,
+                      const ExternalSortOptions &options) {
+  switch (type) {
+    case KEY_INT32:
+      ExternalSort<int>(input, output, options, SIMDSort, MergeSegment8<int, __m256i>);
+      break;
+    case KEY_INT64:
+      ExternalSort<int64_t>(input, output, options, SIMDSort, MergeSegment4<int64_t, __m256i>);
+      break;
+    case KEY_FLOAT:
+      ExternalSort<float>(input, output, options, SIMDSort, MergeSegment8<float, __m256>);
+      break;
+    case KEY_DOUBLE:
+      ExternalSort<double>(input, output, options, SIMDSort, MergeSegment4<double, __m256d>);
+      break;
+    default:
+      throw std::invalid_argument("ExternalSIMDSort: key-value records are not supported");
   }
 }
 
-void SIMDSort(size_t N, std::pair<double, double> *&arr) {
-  double *kv_arr;
-  size_t Nkv = N * 2;
-  aligned_init(kv_arr, Nkv);
-  for (int i = 0; i < N; i++) {
-    kv_arr[2 * i] = arr[i].first;
-    kv_arr[2 * i + 1] = arr[i].second;
+void SortFile(const std::string &path, KeyType type, size_t scratch_bytes) {
+  MappedFile file(path);
+  if (file.Size() % RecordBytes(type) != 0) {
+    throw std::invalid_argument("SortFile: " + path + " is not a whole number of records");
   }
-  // 2 rows of 2 K-V(4 total) pairs = 8 values
-  int BLOCK_SIZE = 8;
-  assert(Nkv % BLOCK_SIZE == 0);
-  for (int i = 0; i < Nkv; i += BLOCK_SIZE) {
-    MaskedSortBlock2x4<double, __m256d>(kv_arr, i);
+  if (file.Size() == 0) {
+    return;
   }
-  // Merge sorted runs
-  MaskedMergeRuns4<double, __m256d>(kv_arr, Nkv);
-  for (int i = 0; i < N; i++) {
-    arr[i].first = kv_arr[2 * i];
-    arr[i].second = kv_arr[2 * i + 1];
+  file.Prefault();
+  size_t N = file.Size() / RecordBytes(type);
+  switch (type) {
+    case KEY_INT32:
+      LowMemorySIMDSort(N, (int *) file.Data(), scratch_bytes);
+      break;
+    case KEY_INT64:
+      LowMemorySIMDSort(N, (int64_t *) file.Data(), scratch_bytes);
+      break;
+    case KEY_FLOAT:
+      LowMemorySIMDSort(N, (float *) file.Data(), scratch_bytes);
+      break;
+    case KEY_DOUBLE:
+      LowMemorySIMDSort(N, (double *) file.Data(), scratch_bytes);
+      break;
+    case KEY_INT32_KV:
+      LowMemorySIMDSort(N, (std::pair<int, int> *) file.Data(), scratch_bytes);
+      break;
+    case KEY_INT64_KV:
+      LowMemorySIMDSort(N, (std::pair<int64_t, int64_t> *) file.Data(), scratch_bytes);
+      break;
+    case KEY_FLOAT_KV:
+      LowMemorySIMDSort(N, (std::pair<float, float> *) file.Data(), scratch_bytes);
+      break;
+    case KEY_DOUBLE_KV:
+      LowMemorySIMDSort(N, (std::pair<double, double> *) file.Data(), scratch_bytes);
+      break;
   }
+  file.WriteBack();
 }
+
 }
 #endif
\ No newline at end of file
@@ -1,5 +1,6 @@
 #include "avx256/utils.h"
 #include "common.h"
+#include <cstring>
 
 #ifdef AVX2
 namespace avx2 {
@@ -27,6 +28,36 @@ template void StoreReg<int64_t, __m256i>(const __m256i &r, int64_t *arr);
 template void StoreReg<float, __m256>(const __m256 &r, float *arr);
 template void StoreReg<double, __m256d>(const __m256d &r, double *arr);
 
+template<typename InType, typename RegType>
+void LoadUnalignedReg(RegType &r, InType *arr) {
+  std::memcpy(&r, arr, sizeof(RegType));
+}
+
+template void LoadUnalignedReg<int, __m256i>(__m256i &r, int *arr);
+template void LoadUnalignedReg<int64_t, __m256i>(__m256i &r, int64_t *arr);
+template void LoadUnalignedReg<float, __m256>(__m256 &r, float *arr);
+template void LoadUnalignedReg<double, __m256d>(__m256d &r, double *arr);
+
+template<typename InType, typename RegType>
+void StoreUnalignedReg(const RegType &r, InType *arr) {
+  std::memcpy(arr, &r, sizeof(RegType));
+}
+
+template void StoreUnalignedReg<int, __m256i>(const __m256i &r, int *arr);
+template void StoreUnalignedReg<int64_t, __m256i>(const __m256i &r, int64_t *arr);
+template void StoreUnalignedReg<float, __m256>(const __m256 &r, float *arr);
+template void StoreUnalignedReg<double, __m256d>(const __m256d &r, double *arr);
+
+template<typename InType, typename RegType>
+void StreamReg(const RegType &r, InType *arr) {
+  _mm256_stream_si256((__m256i *) arr, (__m256i) r);
+}
+
+template void StreamReg<int, __m256i>(const __m256i &r, int *arr);
+template void StreamReg<int64_t, __m256i>(const __m256i &r, int64_t *arr);
+template void StreamReg<float, __m256>(const __m256 &r, float *arr);
+template void StreamReg<double, __m256d>(const __m256d &r, double *arr);
+
 /**
  * Converter Utilities
  * Int => Double
@@ -34,15 +65,13 @@ template void StoreReg<double, __m256d>(const __m256d &r, double *arr);
  */
 
 __m256d Int64ToDoubleReg(const __m256i &repi64) {
-  int64_t *temp;
-  aligned_init(temp, 4);
+  alignas(32) int64_t temp[4];
   StoreReg(repi64, temp);
   return _mm256_setr_pd(temp[0], temp[1], temp[2], temp[3]);
 }
 
 __m256i DoubleToInt64Reg(const __m256d &rd) {
-  double *temp;
-  aligned_init(temp, 4);
+  alignas(32) double temp[4];
   StoreReg(rd, temp);
   return _mm256_setr_epi64x((int64_t) temp[0], (int64_t) temp[1], (int64_t) temp[2], (int64_t) temp[3]);
 }
@@ -1,5 +1,6 @@
 #include "avx512/utils.h"
 #include "common.h"
+#include <cstring>
 
 #ifdef AVX512
 namespace avx512 {
@@ -27,6 +28,36 @@ template void StoreReg<int64_t, __m512i>(const __m512i &r, int64_t *arr);
 template void StoreReg<float, __m512>(const __m512 &r, float *arr);
 template void StoreReg<double, __m512d>(const __m512d &r, double *arr);
 
+template<typename InType, typename RegType>
+void LoadUnalignedReg(RegType &r, InType *arr) {
+  std::memcpy(&r, arr, sizeof(RegType));
+}
+
+template void LoadUnalignedReg<int, __m512i>(__m512i &r, int *arr);
+template void LoadUnalignedReg<int64_t, __m512i>(__m512i &r, int64_t *arr);
+template void LoadUnalignedReg<float, __m512>(__m512 &r, float *arr);
+template void LoadUnalignedReg<double, __m512d>(__m512d &r, double *arr);
+
+template<typename InType, typename RegType>
+void StoreUnalignedReg(const RegType &r, InType *arr) {
+  std::memcpy(arr, &r, sizeof(RegType));
+}
+
+template void StoreUnalignedReg<int, __m512i>(const __m512i &r, int *arr);
+template void StoreUnalignedReg<int64_t, __m512i>(const __m512i &r, int64_t *arr);
+template void StoreUnalignedReg<float, __m512>(const __m512 &r, float *arr);
+template void StoreUnalignedReg<double, __m512d>(const __m512d &r, double *arr);
+
+template<typename InType, typename RegType>
+void StreamReg(const RegType &r, InType *arr) {
+  _mm512_stream_si512((__m512i *) arr, (__m512i) r);
+}
+
+template void StreamReg<int, __m512i>(const __m512i &r, int *arr);
+template void StreamReg<int64_t, __m512i>(const __m512i &r, int64_t *arr);
+template void StreamReg<float, __m512>(const __m512 &r, float *arr);
+template void StreamReg<double, __m512d>(const __m512d &r, double *arr);
+
 // Weird Converter
 
 
@@ -96,8 +127,13 @@ void MaskedMinMax16(const __m512i &a, const __m512i &b,
   auto temp_cmp_mask = _mm512_mask_cmpgt_epi32_mask((__mmask16) (0x5555), a, b);
   auto cmp_mask = (temp_cmp_mask << 1) | temp_cmp_mask;
 
+  // b is a lane permutation of a here: on equal keys both lanes keep their own
+  // record, otherwise the record would be duplicated into both lanes
+  auto temp_max_mask = _mm512_mask_cmpgt_epi32_mask((__mmask16) (0x5555), b, a);
+  auto max_mask = (temp_max_mask << 1) | temp_max_mask;
+
   minab = _mm512_mask_blend_epi32(cmp_mask, a, b);
-  maxab = _mm512_mask_blend_epi32(cmp_mask, b, a);
+  maxab = _mm512_mask_blend_epi32(max_mask, a, b);
 }
 
 void MaskedMinMax16(__m512 &a, __m512 &b) {
@@ -114,8 +150,11 @@ void MaskedMinMax16(const __m512 &a, const __m512 &b,
   auto temp_cmp_mask = _mm512_mask_cmp_ps_mask((__mmask16) (0x5555), a, b, _CMP_GT_OQ);
   auto cmp_mask = (temp_cmp_mask << 1) | temp_cmp_mask;
 
+  auto temp_max_mask = _mm512_mask_cmp_ps_mask((__mmask16) (0x5555), b, a, _CMP_GT_OQ);
+  auto max_mask = (temp_max_mask << 1) | temp_max_mask;
+
   minab = _mm512_mask_blend_ps(cmp_mask, a, b);
-  maxab = _mm512_mask_blend_ps(cmp_mask, b, a);
+  maxab = _mm512_mask_blend_ps(max_mask, a, b);
 }
 
 // 64-bit Key-Value pairs
@@ -134,8 +173,11 @@ void MaskedMinMax8(const __m512i &a, const __m512i &b,
   auto temp_cmp_mask = _mm512_mask_cmpgt_epi64_mask((__mmask8) (0x55), a, b);
   auto cmp_mask = (temp_cmp_mask << 1) | temp_cmp_mask;
 
+  auto temp_max_mask = _mm512_mask_cmpgt_epi64_mask((__mmask8) (0x55), b, a);
+  auto max_mask = (temp_max_mask << 1) | temp_max_mask;
+
   minab = _mm512_mask_blend_epi64(cmp_mask, a, b);
-  maxab = _mm512_mask_blend_epi64(cmp_mask, b, a);
+  maxab = _mm512_mask_blend_epi64(max_mask, a, b);
 }
 
 void MaskedMinMax8(__m512d &a, __m512d &b) {
@@ -152,8 +194,11 @@ void MaskedMinMax8(const __m512d &a, const __m512d &b,
   auto temp_cmp_mask = _mm512_mask_cmp_pd_mask((__mmask8) (0x55), a, b, _CMP_GT_OQ);
   auto cmp_mask = (temp_cmp_mask << 1) | temp_cmp_mask;
 
+  auto temp_max_mask = _mm512_mask_cmp_pd_mask((__mmask8) (0x55), b, a, _CMP_GT_OQ);
+  auto max_mask = (temp_max_mask << 1) | temp_max_mask;
+
   minab = _mm512_mask_blend_pd(cmp_mask, a, b);
-  maxab = _mm512_mask_blend_pd(cmp_mask, b, a);
+  maxab = _mm512_mask_blend_pd(max_mask, a, b);
 }
 
 /**
@@ -3,14 +3,110 @@
 //
 
 #include "common.h"
+#include <algorithm>
+#include <atomic>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <vector>
+
+const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+static std::atomic<bool> huge_pages(false);
+static std::atomic<size_t> streaming_threshold(0);
+
+void SetHugePages(bool enabled) {
+  huge_pages = enabled;
+}
+
+bool HugePagesEnabled() {
+  return huge_pages;
+}
+
+static void *PosixAllocate(size_t bytes, size_t alignment, void *context) {
+  bool huge = huge_pages && bytes >= HUGE_PAGE_SIZE;
+  if (huge) {
+    alignment = std::max(alignment, HUGE_PAGE_SIZE);
+  }
+  void *ptr;
+  if (posix_memalign(&ptr, alignment, bytes) != 0) {
+    return nullptr;
+  }
+  if (huge) {
+    // Advice only: the range is left on 4 KiB pages when THP is unavailable
+    madvise(ptr, bytes / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE, MADV_HUGEPAGE);
+  }
+  return ptr;
+}
+
+static void PosixDeallocate(void *ptr, size_t bytes, void *context) {
+  free(ptr);
+}
+
+static Allocator global_allocator = {PosixAllocate, PosixDeallocate, nullptr};
+static thread_local const Allocator *scoped_allocator = nullptr;
+
+Allocator DefaultAllocator() {
+  return {PosixAllocate, PosixDeallocate, nullptr};
+}
+
+void SetAllocator(const Allocator &allocator) {
+  global_allocator = allocator;
+}
+
+Allocator CurrentAllocator() {
+  return scoped_allocator != nullptr ? *scoped_allocator : global_allocator;
+}
+
+ScopedAllocator::ScopedAllocator(const Allocator &allocator) : allocator_(allocator), previous_(scoped_allocator) {
+  scoped_allocator = &allocator_;
+}
+
+ScopedAllocator::~ScopedAllocator() {
+  scoped_allocator = previous_;
+}
+
+BumpArena::BumpArena(void *region, size_t size) : region_((char *) region), size_(size), offset_(0) {}
+
+Allocator BumpArena::GetAllocator() {
+  return {Allocate, Deallocate, this};
+}
+
+void BumpArena::Reset() {
+  offset_ = 0;
+}
+
+size_t BumpArena::Used() const {
+  return offset_;
+}
+
+void *BumpArena::Allocate(size_t bytes, size_t alignment, void *context) {
+  auto arena = (BumpArena *) context;
+  uintptr_t base = (uintptr_t) arena->region_;
+  uintptr_t start = (base + arena->offset_ + alignment - 1) / alignment * alignment;
+  if (start + bytes > base + arena->size_) {
+    return nullptr;
+  }
+  arena->offset_ = start + bytes - base;
+  return (void *) start;
+}
+
+void BumpArena::Deallocate(void *ptr, size_t bytes, void *context) {}
 
 template <typename T>
 void aligned_init(T* &ptr, size_t N, size_t alignment_size) {
-  if (posix_memalign((void **)&ptr, alignment_size, N*sizeof(T)) != 0) {
+  Allocator allocator = CurrentAllocator();
+  ptr = (T *) allocator.allocate(N * sizeof(T), alignment_size, allocator.context);
+  if (ptr == nullptr) {
     throw std::bad_alloc();
   }
 }
 
+template <typename T>
+void aligned_free(T* ptr, size_t N) {
+  Allocator allocator = CurrentAllocator();
+  allocator.deallocate(ptr, N * sizeof(T), allocator.context);
+}
+
+template void aligned_init<char>(char* &ptr, size_t N, size_t alignment_size);
 template void aligned_init<int>(int* &ptr, size_t N, size_t alignment_size);
 template void aligned_init<int64_t>(int64_t* &ptr, size_t N, size_t alignment_size);
 template void aligned_init<double>(double* &ptr, size_t N, size_t alignment_size);
@@ -20,6 +116,141 @@ template void aligned_init<std::pair<int64_t,int64_t>>(std::pair<int64_t,int64_t
 template void aligned_init<std::pair<float,float>>(std::pair<float,float>* &ptr, size_t N, size_t alignment_size);
 template void aligned_init<std::pair<double,double>>(std::pair<double,double>* &ptr, size_t N, size_t alignment_size);
 
+template void aligned_free<char>(char* ptr, size_t N);
+template void aligned_free<int>(int* ptr, size_t N);
+template void aligned_free<int64_t>(int64_t* ptr, size_t N);
+template void aligned_free<double>(double* ptr, size_t N);
+template void aligned_free<float>(float* ptr, size_t N);
+template void aligned_free<std::pair<int,int>>(std::pair<int,int>* ptr, size_t N);
+template void aligned_free<std::pair<int64_t,int64_t>>(std::pair<int64_t,int64_t>* ptr, size_t N);
+template void aligned_free<std::pair<float,float>>(std::pair<float,float>* ptr, size_t N);
+template void aligned_free<std::pair<double,double>>(std::pair<double,double>* ptr, size_t N);
+
+size_t CacheSize(int level) {
+  long size = -1;
+  size_t fallback = 0;
+  switch (level) {
+    case 1:
+      size = sysconf(_SC_LEVEL1_DCACHE_SIZE);
+      fallback = 32 * 1024;
+      break;
+    case 2:
+      size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+      fallback = 1024 * 1024;
+      break;
+    default:
+      size = sysconf(_SC_LEVEL3_CACHE_SIZE);
+      fallback = 8 * 1024 * 1024;
+      break;
+  }
+  return size > 0 ? (size_t) size : fallback;
+}
+
+void SetStreamingThreshold(size_t bytes) {
+  streaming_threshold = bytes;
+}
+
+size_t StreamingThreshold() {
+  static const size_t llc_size = CacheSize(3);
+  size_t bytes = streaming_threshold;
+  return bytes > 0 ? bytes : llc_size;
+}
+
+size_t CacheBlockSize(size_t N, size_t elem_size, size_t min_size) {
+  size_t budget = CacheSize(2) / (2 * elem_size);
+  size_t chunk_size = min_size;
+  while (chunk_size * 2 <= budget && chunk_size * 2 <= N) {
+    chunk_size *= 2;
+  }
+  return std::min(chunk_size, N);
+}
+
+template <typename T>
+size_t CoRank(size_t k, const T *a, size_t na, const T *b, size_t nb, size_t stride) {
+  size_t lo = k > nb ? k - nb : 0;
+  size_t hi = std::min(k, na);
+  while (lo < hi) {
+    size_t i = lo + (hi - lo) / 2;
+    size_t j = k - i;
+    if (b[(j - 1) * stride] >= a[i * stride]) {
+      lo = i + 1;
+    } else {
+      hi = i;
+    }
+  }
+  return lo;
+}
+
+template size_t CoRank<int>(size_t k, const int *a, size_t na, const int *b, size_t nb, size_t stride);
+template size_t CoRank<int64_t>(size_t k, const int64_t *a, size_t na, const int64_t *b, size_t nb, size_t stride);
+template size_t CoRank<float>(size_t k, const float *a, size_t na, const float *b, size_t nb, size_t stride);
+template size_t CoRank<double>(size_t k, const double *a, size_t na, const double *b, size_t nb, size_t stride);
+
+template <typename T>
+void MultiCoRank(size_t k, const T *const *runs, const size_t *sizes, size_t P, size_t *ranks) {
+  // The splits lie in [lo, hi): every key before lo is taken, none from hi on
+  std::vector<size_t> lo(P, 0);
+  std::vector<size_t> hi(sizes, sizes + P);
+  std::vector<size_t> below(P);
+  while (true) {
+    size_t w = P;
+    for (size_t p = 0; p < P; p++) {
+      if (hi[p] > lo[p] && (w == P || hi[p] - lo[p] > hi[w] - lo[w])) {
+        w = p;
+      }
+    }
+    if (w == P) {
+      break;
+    }
+    // Keys of each run ordered before the pivot, counted within the bounds
+    size_t m = lo[w] + (hi[w] - lo[w]) / 2;
+    T pivot = runs[w][m];
+    size_t total = 0;
+    for (size_t p = 0; p < P; p++) {
+      if (p == w) {
+        below[p] = m;
+      } else if (p < w) {
+        below[p] = std::upper_bound(runs[p] + lo[p], runs[p] + hi[p], pivot) - runs[p];
+      } else {
+        below[p] = std::lower_bound(runs[p] + lo[p], runs[p] + hi[p], pivot) - runs[p];
+      }
+      total += below[p];
+    }
+    if (total < k) {
+      std::copy(below.begin(), below.end(), lo.begin());
+      lo[w] = m + 1;
+    } else {
+      std::copy(below.begin(), below.end(), hi.begin());
+    }
+  }
+  std::copy(lo.begin(), lo.end(), ranks);
+}
+
+template void MultiCoRank<int>(size_t k, const int *const *runs, const size_t *sizes, size_t P, size_t *ranks);
+template void MultiCoRank<int64_t>(size_t k, const int64_t *const *runs, const size_t *sizes, size_t P, size_t *ranks);
+template void MultiCoRank<float>(size_t k, const float *const *runs, const size_t *sizes, size_t P, size_t *ranks);
+template void MultiCoRank<double>(size_t k, const double *const *runs, const size_t *sizes, size_t P, size_t *ranks);
+
+template <typename T>
+void ScalarMerge(const T *a, size_t na, const T *b, size_t nb, T *out, size_t stride) {
+  const T *a_end = a + na * stride;
+  const T *b_end = b + nb * stride;
+  while (a < a_end && b < b_end) {
+    const T *&src = *b < *a ? b : a;
+    for (size_t s = 0; s < stride; s++) {
+      *out++ = src[s];
+    }
+    src += stride;
+  }
+  out = std::copy(a, a_end, out);
+  std::copy(b, b_end, out);
+}
+
+template void ScalarMerge<int>(const int *a, size_t na, const int *b, size_t nb, int *out, size_t stride);
+template void ScalarMerge<int64_t>(const int64_t *a, size_t na, const int64_t *b, size_t nb, int64_t *out, size_t stride);
+template void ScalarMerge<float>(const float *a, size_t na, const float *b, size_t nb, float *out, size_t stride);
+template void ScalarMerge<double>(const double *a, size_t na, const double *b, size_t nb, double *out, size_t stride);
+
 template <typename T>
 void print_arr(T *arr, int i, int j, const std::string &tag) {
   std::cout << tag.c_str() << std::endl;
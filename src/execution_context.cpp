@@ -0,0 +1,400 @@
+#include "execution_context.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <string>
+#include <tuple>
+#include <mutex>
+#include <omp.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static thread_local const ExecutionContext *scoped_context = nullptr;
+static thread_local int scope_depth = 0;
+static thread_local bool in_task = false;
+static thread_local bool pinned_team = false;
+static Executor global_executor = {nullptr, 0, nullptr};
+
+static std::mutex budget_mutex;
+static size_t budget_threads = 0;
+static size_t budget_in_use = 0;
+
+void SetExecutor(const Executor &executor) {
+  global_executor = executor;
+}
+
+Executor CurrentExecutor() {
+  if (scoped_context != nullptr && scoped_context->executor.parallel_for != nullptr) {
+    return scoped_context->executor;
+  }
+  return global_executor;
+}
+
+ExecutionContext CurrentExecutionContext() {
+  return scoped_context != nullptr ? *scoped_context : ExecutionContext();
+}
+
+ScopedExecutionContext::ScopedExecutionContext(const ExecutionContext &context)
+    : context_(context), previous_(scoped_context) {
+  scoped_context = &context_;
+}
+
+ScopedExecutionContext::~ScopedExecutionContext() {
+  scoped_context = previous_;
+}
+
+void SetThreadBudget(size_t threads) {
+  std::lock_guard<std::mutex> lock(budget_mutex);
+  budget_threads = threads;
+}
+
+size_t ThreadBudgetInUse() {
+  std::lock_guard<std::mutex> lock(budget_mutex);
+  return budget_in_use;
+}
+
+static size_t AcquireHelpers(size_t wanted) {
+  std::lock_guard<std::mutex> lock(budget_mutex);
+  if (budget_threads > 0) {
+    wanted = std::min(wanted, budget_threads > budget_in_use ? budget_threads - budget_in_use : 0);
+  }
+  budget_in_use += wanted;
+  return wanted;
+}
+
+static void ReleaseHelpers(size_t helpers) {
+  std::lock_guard<std::mutex> lock(budget_mutex);
+  budget_in_use -= helpers;
+}
+
+int ParallelThreads() {
+  if (InParallelTask()) {
+    return 1;
+  }
+  Executor executor = CurrentExecutor();
+  return executor.parallel_for != nullptr ? std::max(executor.threads, 1) : omp_get_max_threads();
+}
+
+bool InParallelTask() {
+  return in_task || omp_get_level() >= omp_get_max_active_levels();
+}
+
+bool ThreadsPinned() {
+  return pinned_team && !InParallelTask();
+}
+
+struct TaskCall {
+  void (*task)(void *, size_t);
+  void *arg;
+};
+
+static void RunTask(void *arg, size_t i) {
+  TaskCall *call = (TaskCall *) arg;
+  bool outer = in_task;
+  in_task = true;
+  call->task(call->arg, i);
+  in_task = outer;
+}
+
+// Contiguous groups of items, one per thread, for a pool that cannot be told
+// to use fewer threads
+struct GroupCall {
+  void (*task)(void *, size_t);
+  void *arg;
+  size_t n;
+  size_t groups;
+};
+
+static void RunGroup(void *arg, size_t g) {
+  GroupCall *call = (GroupCall *) arg;
+  for (size_t i = g * call->n / call->groups; i < (g + 1) * call->n / call->groups; i++) {
+    call->task(call->arg, i);
+  }
+}
+
+void ParallelFor(size_t n, void (*task)(void *arg, size_t i), void *arg, int threads) {
+  Executor executor;
+  if (n <= 1 || InParallelTask() || threads == 1) {
+    for (size_t i = 0; i < n; i++) {
+      task(arg, i);
+    }
+  } else if ((executor = CurrentExecutor()).parallel_for != nullptr) {
+    GroupCall group = {task, arg, n, threads > 0 ? std::min(n, (size_t) threads) : n};
+    TaskCall call = group.groups < n ? TaskCall{RunGroup, &group} : TaskCall{task, arg};
+    executor.parallel_for(group.groups, RunTask, &call, executor.context);
+  } else {
+    TaskCall call = {task, arg};
+#pragma omp parallel for schedule(static) num_threads(threads > 0 ? threads : omp_get_max_threads())
+    for (size_t i = 0; i < n; i++) {
+      RunTask(&call, i);
+    }
+  }
+}
+
+// A pass with fewer threads has to keep this share of the bandwidth
+const double STREAMING_KEEP = 0.9;
+
+static std::mutex streaming_mutex;
+static bool streaming_adaptive = true;
+// Thread count the search settled on, 0 while it is still probing
+static int streaming_threads = 0;
+// Best bandwidth seen per thread count, in bytes per second
+static std::map<int, double> streaming_bandwidth;
+
+void SetAdaptiveStreamingThreads(bool enabled) {
+  std::lock_guard<std::mutex> lock(streaming_mutex);
+  streaming_adaptive = enabled;
+  streaming_threads = 0;
+  streaming_bandwidth.clear();
+}
+
+int StreamingThreads(int threads) {
+  std::lock_guard<std::mutex> lock(streaming_mutex);
+  if (!streaming_adaptive || threads <= 1) {
+    return std::max(threads, 1);
+  }
+  if (streaming_threads > 0) {
+    return std::min(streaming_threads, threads);
+  }
+  // Probe half of the fewest threads measured so far
+  return streaming_bandwidth.empty() ? threads : std::min(std::max(streaming_bandwidth.begin()->first / 2, 1), threads);
+}
+
+void ReportStreamingPass(int threads, size_t bytes, double seconds) {
+  std::lock_guard<std::mutex> lock(streaming_mutex);
+  if (!streaming_adaptive || streaming_threads > 0 || seconds <= 0) {
+    return;
+  }
+  double &bandwidth = streaming_bandwidth[threads];
+  bandwidth = std::max(bandwidth, bytes / seconds);
+  auto fewest = streaming_bandwidth.begin();
+  auto next = std::next(fewest);
+  if (next != streaming_bandwidth.end() && fewest->second < STREAMING_KEEP * next->second) {
+    streaming_threads = next->first;
+  } else if (fewest->first == 1) {
+    streaming_threads = 1;
+  }
+}
+
+void StreamingParallelFor(size_t n, void (*task)(void *arg, size_t i), void *arg, size_t bytes) {
+  if (InParallelTask()) {
+    ParallelFor(n, task, arg);
+    return;
+  }
+  int threads = StreamingThreads(ParallelThreads());
+  double start = omp_get_wtime();
+  ParallelFor(n, task, arg, threads);
+  ReportStreamingPass(std::min((size_t) threads, n), bytes, omp_get_wtime() - start);
+}
+
+struct CopyItems {
+  char *dst;
+  const char *src;
+  size_t bytes;
+  size_t segments;
+
+  size_t Boundary(size_t s) const {
+    return s == segments ? bytes : s * (bytes / segments) / 64 * 64;
+  }
+};
+
+static void CopyItem(void *arg, size_t s) {
+  const CopyItems *items = (const CopyItems *) arg;
+  size_t begin = items->Boundary(s);
+  std::memcpy(items->dst + begin, items->src + begin, items->Boundary(s + 1) - begin);
+}
+
+void ParallelCopy(void *dst, const void *src, size_t bytes) {
+  CopyItems items = {(char *) dst, (const char *) src, bytes, (size_t) ParallelThreads()};
+  StreamingParallelFor(items.segments, CopyItem, &items, 2 * bytes);
+}
+
+static pid_t ThreadId() {
+  return syscall(SYS_gettid);
+}
+
+static int ReadTopology(int cpu, const char *name, int fallback) {
+  std::ifstream file("/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/" + name);
+  int id;
+  return file >> id ? id : fallback;
+}
+
+struct CpuLocation {
+  int cpu;
+  int package;
+  int core;
+  // Rank among the SMT siblings of the core, of the core in its package and
+  // of the package
+  int sibling;
+  int core_rank;
+  int package_rank;
+};
+
+/**
+ * CPUs the threads of a team are pinned to, thread t on the t-th modulo the
+ * size; empty when the policy does not pin
+ */
+static std::vector<int> PinOrder(const ExecutionContext &context) {
+  if (context.affinity == AFFINITY_NONE) {
+    return {};
+  }
+  std::vector<int> cpus = context.cpus;
+  if (cpus.empty()) {
+    cpu_set_t set;
+    sched_getaffinity(0, sizeof(set), &set);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &set)) {
+        cpus.push_back(cpu);
+      }
+    }
+  }
+
+  std::vector<CpuLocation> locations;
+  for (int cpu : cpus) {
+    locations.push_back({cpu, ReadTopology(cpu, "physical_package_id", 0), ReadTopology(cpu, "core_id", cpu), 0, 0, 0});
+  }
+  // Ranks are counted in topology order, the list itself keeps the caller's
+  std::vector<size_t> index(locations.size());
+  for (size_t k = 0; k < index.size(); k++) {
+    index[k] = k;
+  }
+  std::sort(index.begin(), index.end(), [&](size_t a, size_t b) {
+    return std::make_tuple(locations[a].package, locations[a].core, locations[a].cpu) <
+           std::make_tuple(locations[b].package, locations[b].core, locations[b].cpu);
+  });
+  std::map<int, int> package_ranks, package_cores;
+  for (size_t k = 0; k < index.size(); k++) {
+    CpuLocation &location = locations[index[k]];
+    const CpuLocation *previous = k > 0 ? &locations[index[k - 1]] : nullptr;
+    bool same_core = previous != nullptr && previous->package == location.package && previous->core == location.core;
+    int packages = package_ranks.size();
+    package_ranks.emplace(location.package, packages);
+    location.package_rank = package_ranks[location.package];
+    location.sibling = same_core ? previous->sibling + 1 : 0;
+    location.core_rank = same_core ? previous->core_rank : package_cores[location.package]++;
+  }
+
+  if (context.skip_smt_siblings) {
+    locations.erase(std::remove_if(locations.begin(), locations.end(), [](const CpuLocation &location) {
+      return location.sibling > 0;
+    }), locations.end());
+  }
+  if (context.affinity == AFFINITY_COMPACT) {
+    std::stable_sort(locations.begin(), locations.end(), [](const CpuLocation &a, const CpuLocation &b) {
+      return std::make_tuple(a.package_rank, a.core_rank, a.sibling) <
+             std::make_tuple(b.package_rank, b.core_rank, b.sibling);
+    });
+  } else if (context.affinity == AFFINITY_SCATTER) {
+    std::stable_sort(locations.begin(), locations.end(), [](const CpuLocation &a, const CpuLocation &b) {
+      return std::make_tuple(a.sibling, a.core_rank, a.package_rank) <
+             std::make_tuple(b.sibling, b.core_rank, b.package_rank);
+    });
+  }
+  std::vector<int> order;
+  for (const CpuLocation &location : locations) {
+    order.push_back(location.cpu);
+  }
+  return order;
+}
+
+ExecutionScope::ExecutionScope() : outermost_(scope_depth++ == 0), helpers_(0), threads_(0), previous_threads_(0) {
+  if (!outermost_ || CurrentExecutor().parallel_for != nullptr) {
+    return;
+  }
+  ExecutionContext context = CurrentExecutionContext();
+  previous_threads_ = omp_get_max_threads();
+  std::vector<int> pins = PinOrder(context);
+  int wanted = context.threads;
+  if (wanted <= 0) {
+    wanted = context.cpus.empty() ? previous_threads_ : (int) context.cpus.size();
+    if (!pins.empty()) {
+      wanted = std::min(wanted, (int) pins.size());
+    }
+  }
+  helpers_ = AcquireHelpers(std::max(wanted, 1) - 1);
+  threads_ = helpers_ + 1;
+  omp_set_num_threads(threads_);
+  if (context.cpus.empty() && pins.empty() && context.priority == 0) {
+    return;
+  }
+
+  // Pooled OpenMP threads are reused by the following teams of this thread,
+  // so the settings hold for the whole sort and are undone on exit
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : context.cpus) {
+    CPU_SET(cpu, &set);
+  }
+  bool confine = !context.cpus.empty() || !pins.empty();
+  std::atomic<bool> pin_failed(false);
+  saved_.assign(threads_, SavedThread());
+#pragma omp parallel num_threads(threads_)
+  {
+    SavedThread &saved = saved_[omp_get_thread_num()];
+    saved.tid = ThreadId();
+    if (confine) {
+      cpu_set_t pin;
+      CPU_ZERO(&pin);
+      if (!pins.empty()) {
+        CPU_SET(pins[omp_get_thread_num() % pins.size()], &pin);
+      }
+      // A CPU outside the cpuset of the process leaves the thread as it was
+      saved.affinity_saved = sched_getaffinity(saved.tid, sizeof(cpu_set_t), &saved.affinity) == 0 &&
+                             sched_setaffinity(saved.tid, sizeof(cpu_set_t), pins.empty() ? &set : &pin) == 0;
+      if (!saved.affinity_saved) {
+        pin_failed = true;
+      }
+    }
+    if (context.priority != 0) {
+      // Raising the priority needs CAP_SYS_NICE, the team then keeps its own
+      errno = 0;
+      saved.priority = getpriority(PRIO_PROCESS, saved.tid);
+      saved.priority_saved = errno == 0 && setpriority(PRIO_PROCESS, saved.tid, context.priority) == 0;
+    }
+  }
+  // The drivers only use the pinned schedules if every thread is on its CPU
+  pinned_team = !pins.empty() && !pin_failed;
+}
+
+ExecutionScope::~ExecutionScope() {
+  scope_depth--;
+  if (threads_ == 0) {
+    return;
+  }
+  if (!saved_.empty()) {
+    // Works from any thread, as the settings are addressed by thread id;
+    // clears what was restored
+    auto restore = [](SavedThread &saved) {
+      if (saved.affinity_saved && sched_setaffinity(saved.tid, sizeof(cpu_set_t), &saved.affinity) == 0) {
+        saved.affinity_saved = false;
+      }
+      if (saved.priority_saved && setpriority(PRIO_PROCESS, saved.tid, saved.priority) == 0) {
+        saved.priority_saved = false;
+      }
+    };
+    // Every thread of the team restores its own settings. Threads of the
+    // scope that this team did not reuse are restored by id afterwards; a
+    // thread that has exited (ESRCH), or a priority that RLIMIT_NICE does
+    // not allow raising back (EACCES), is left as it is
+#pragma omp parallel num_threads(threads_)
+    {
+      pid_t tid = ThreadId();
+      for (SavedThread &saved : saved_) {
+        if (saved.tid == tid) {
+          restore(saved);
+        }
+      }
+    }
+    for (SavedThread &saved : saved_) {
+      restore(saved);
+    }
+    saved_.clear();
+  }
+  pinned_team = false;
+  omp_set_num_threads(previous_threads_);
+  ReleaseHelpers(helpers_);
+}
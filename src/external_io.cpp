@@ -0,0 +1,462 @@
+#include "external_io.h"
+#include "common.h"
+#include "execution_context.h"
+#include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <unistd.h>
+
+static void Fail(int error, const char *call) {
+  throw std::system_error(error, std::generic_category(), call);
+}
+
+void ReadFully(int fd, void *data, size_t bytes, size_t offset) {
+  char *p = (char *) data;
+  while (bytes > 0) {
+    ssize_t n = pread(fd, p, bytes, offset);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      Fail(n < 0 ? errno : EIO, "pread");
+    }
+    p += n;
+    offset += n;
+    bytes -= n;
+  }
+}
+
+void WriteFully(int fd, const void *data, size_t bytes, size_t offset) {
+  const char *p = (const char *) data;
+  while (bytes > 0) {
+    ssize_t n = pwrite(fd, p, bytes, offset);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      Fail(errno, "pwrite");
+    }
+    p += n;
+    offset += n;
+    bytes -= n;
+  }
+}
+
+int OpenFile(const std::string &path, int flags) {
+  int fd = open(path.c_str(), flags, 0644);
+  if (fd < 0) {
+    Fail(errno, "open");
+  }
+  return fd;
+}
+
+ScopedFd::ScopedFd(int fd) : fd_(fd) {}
+
+ScopedFd::~ScopedFd() {
+  if (fd_ >= 0) {
+    close(fd_);
+  }
+}
+
+int ScopedFd::Get() const {
+  return fd_;
+}
+
+size_t FileSize(int fd) {
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    Fail(errno, "fstat");
+  }
+  return st.st_size;
+}
+
+size_t RecordBytes(KeyType type) {
+  switch (type) {
+    case KEY_INT32:
+    case KEY_FLOAT:
+      return 4;
+    case KEY_INT64:
+    case KEY_DOUBLE:
+    case KEY_INT32_KV:
+    case KEY_FLOAT_KV:
+      return 8;
+    case KEY_INT64_KV:
+    case KEY_DOUBLE_KV:
+      return 16;
+  }
+  return 0;
+}
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+// Bytes of a mapping one thread prefaults or writes back at a time
+const size_t MAPPED_SLICE = size_t(16) << 20;
+
+MappedFile::MappedFile(const std::string &path) : fd_(OpenFile(path, O_RDWR)), data_(nullptr), size_(0) {
+  try {
+    size_ = FileSize(fd_);
+  } catch (...) {
+    close(fd_);
+    throw;
+  }
+  if (size_ == 0) {
+    return;
+  }
+  void *data = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+  if (data == MAP_FAILED) {
+    int error = errno;
+    close(fd_);
+    Fail(error, "mmap");
+  }
+  data_ = (char *) data;
+#ifdef MADV_HUGEPAGE
+  madvise(data_, size_, MADV_HUGEPAGE);
+#endif
+}
+
+MappedFile::~MappedFile() {
+  if (data_ != nullptr) {
+    munmap(data_, size_);
+  }
+  close(fd_);
+}
+
+char *MappedFile::Data() {
+  return data_;
+}
+
+size_t MappedFile::Size() const {
+  return size_;
+}
+
+static void PrefaultItem(void *arg, size_t i) {
+  MappedFile *file = (MappedFile *) arg;
+  char *begin = file->Data() + i * MAPPED_SLICE;
+  size_t bytes = std::min(MAPPED_SLICE, file->Size() - i * MAPPED_SLICE);
+  if (madvise(begin, bytes, MADV_POPULATE_WRITE) == 0) {
+    return;
+  }
+  // Kernels before 5.14: a write to every page
+  size_t page = sysconf(_SC_PAGESIZE);
+  for (size_t offset = 0; offset < bytes; offset += page) {
+    volatile char *p = begin + offset;
+    *p = *p;
+  }
+}
+
+void MappedFile::Prefault() {
+  if (size_ == 0) {
+    return;
+  }
+  madvise(data_, size_, MADV_SEQUENTIAL);
+  madvise(data_, size_, MADV_WILLNEED);
+  ParallelFor((size_ + MAPPED_SLICE - 1) / MAPPED_SLICE, PrefaultItem, this);
+  // The sort itself reads back and forth
+  madvise(data_, size_, MADV_NORMAL);
+}
+
+static void WriteBackItem(void *arg, size_t i) {
+  int fd = *(int *) arg;
+  // Errors show up again on fsync or close, this only starts the writes
+  sync_file_range(fd, i * MAPPED_SLICE, MAPPED_SLICE, SYNC_FILE_RANGE_WRITE);
+}
+
+void MappedFile::WriteBack() {
+  ParallelFor((size_ + MAPPED_SLICE - 1) / MAPPED_SLICE, WriteBackItem, &fd_);
+}
+
+PrefetchReader::PrefetchReader(int fd, size_t offset, size_t bytes, size_t buffer_bytes)
+    : fd_(fd), offset_(offset), end_(offset + bytes), buffer_bytes_(buffer_bytes), filled_{0, 0}, current_(1),
+      ready_(false), stopping_(false), error_(0) {
+  aligned_init(buffers_[0], buffer_bytes);
+  aligned_init(buffers_[1], buffer_bytes);
+  reader_ = std::thread(&PrefetchReader::Work, this);
+}
+
+PrefetchReader::~PrefetchReader() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  wake_.notify_all();
+  reader_.join();
+  aligned_free(buffers_[0], buffer_bytes_);
+  aligned_free(buffers_[1], buffer_bytes_);
+}
+
+const char *PrefetchReader::Next(size_t &bytes) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  wake_.wait(lock, [this]() { return ready_ || error_ != 0; });
+  if (error_ != 0) {
+    Fail(error_, "pread");
+  }
+  current_ = 1 - current_;
+  ready_ = false;
+  wake_.notify_all();
+  bytes = filled_[current_];
+  return buffers_[current_];
+}
+
+void PrefetchReader::Work() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    wake_.wait(lock, [this]() { return !ready_ || stopping_; });
+    if (stopping_) {
+      return;
+    }
+    int fill = 1 - current_;
+    size_t bytes = std::min(buffer_bytes_, end_ - offset_);
+    lock.unlock();
+    try {
+      ReadFully(fd_, buffers_[fill], bytes, offset_);
+    } catch (const std::system_error &e) {
+      lock.lock();
+      error_ = e.code().value();
+      wake_.notify_all();
+      return;
+    }
+    lock.lock();
+    offset_ += bytes;
+    filled_[fill] = bytes;
+    ready_ = true;
+    wake_.notify_all();
+  }
+}
+
+StreamWriter::StreamWriter(int fd, size_t buffer_bytes)
+    : fd_(fd), buffer_bytes_(buffer_bytes), current_(0), pending_(0), stopping_(false), error_(0) {
+  off_t offset = lseek(fd, 0, SEEK_CUR);
+  offset_ = offset < 0 ? 0 : offset;
+  aligned_init(buffers_[0], buffer_bytes);
+  aligned_init(buffers_[1], buffer_bytes);
+  writer_ = std::thread(&StreamWriter::Work, this);
+}
+
+StreamWriter::~StreamWriter() {
+  if (writer_.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    wake_.notify_all();
+    writer_.join();
+  }
+  aligned_free(buffers_[0], buffer_bytes_);
+  aligned_free(buffers_[1], buffer_bytes_);
+}
+
+char *StreamWriter::Buffer() {
+  return buffers_[current_];
+}
+
+void StreamWriter::Commit(size_t bytes) {
+  if (bytes == 0) {
+    return;
+  }
+  std::unique_lock<std::mutex> lock(mutex_);
+  wake_.wait(lock, [this]() { return pending_ == 0 || error_ != 0; });
+  if (error_ != 0) {
+    Fail(error_, "pwrite");
+  }
+  pending_ = bytes;
+  current_ = 1 - current_;
+  wake_.notify_all();
+}
+
+void StreamWriter::Close() {
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    wake_.wait(lock, [this]() { return pending_ == 0 || error_ != 0; });
+    stopping_ = true;
+  }
+  wake_.notify_all();
+  writer_.join();
+  if (error_ != 0) {
+    Fail(error_, "pwrite");
+  }
+}
+
+void StreamWriter::Work() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    wake_.wait(lock, [this]() { return pending_ > 0 || stopping_; });
+    if (pending_ == 0) {
+      return;
+    }
+    const char *data = buffers_[1 - current_];
+    size_t bytes = pending_;
+    lock.unlock();
+    try {
+      WriteFully(fd_, data, bytes, offset_);
+    } catch (const std::system_error &e) {
+      lock.lock();
+      error_ = e.code().value();
+      wake_.notify_all();
+      return;
+    }
+    lock.lock();
+    offset_ += bytes;
+    pending_ = 0;
+    wake_.notify_all();
+  }
+}
+
+template<>
+KeyType RunKeyType<int>() {
+  return KEY_INT32;
+}
+
+template<>
+KeyType RunKeyType<int64_t>() {
+  return KEY_INT64;
+}
+
+template<>
+KeyType RunKeyType<float>() {
+  return KEY_FLOAT;
+}
+
+template<>
+KeyType RunKeyType<double>() {
+  return KEY_DOUBLE;
+}
+
+template<typename T>
+RunIndexWriter<T>::RunIndexWriter(size_t block_bytes) : block_keys_(block_bytes / sizeof(T)), records_(0) {
+  assert(block_keys_ > 0 && block_bytes % sizeof(T) == 0);
+}
+
+template<typename T>
+void RunIndexWriter<T>::Add(const T *keys, size_t n) {
+  for (size_t i = 0; i < n;) {
+    size_t offset = (records_ + i) % block_keys_;
+    size_t take = std::min(n - i, block_keys_ - offset);
+    if (offset == 0) {
+      index_.push_back(keys[i]);
+      index_.push_back(keys[i + take - 1]);
+    } else {
+      index_.back() = keys[i + take - 1];
+    }
+    i += take;
+  }
+  records_ += n;
+}
+
+template<typename T>
+void RunIndexWriter<T>::Finish(int fd) {
+  RunFooter footer;
+  footer.records = records_;
+  footer.block_bytes = block_keys_ * sizeof(T);
+  footer.blocks = index_.size() / 2;
+  footer.index_offset = records_ * sizeof(T);
+  footer.key_type = RunKeyType<T>();
+  footer.version = RUN_VERSION;
+  footer.magic = RUN_MAGIC;
+  WriteFully(fd, index_.data(), index_.size() * sizeof(T), footer.index_offset);
+  WriteFully(fd, &footer, sizeof(footer), footer.index_offset + index_.size() * sizeof(T));
+}
+
+template<typename T>
+RunFileReader<T>::RunFileReader(const std::string &path) : fd_(OpenFile(path, O_RDONLY)) {
+  try {
+    size_t bytes = FileSize(fd_);
+    if (bytes < sizeof(footer_)) {
+      throw std::invalid_argument(path + " is not a run file");
+    }
+    ReadFully(fd_, &footer_, sizeof(footer_), bytes - sizeof(footer_));
+    if (footer_.magic != RUN_MAGIC || footer_.version != RUN_VERSION) {
+      throw std::invalid_argument(path + " is not a run file");
+    }
+    size_t block_keys = footer_.block_bytes / sizeof(T);
+    if (footer_.key_type != (uint32_t) RunKeyType<T>() || block_keys == 0 ||
+        footer_.blocks != (footer_.records + block_keys - 1) / block_keys ||
+        footer_.index_offset != footer_.records * sizeof(T) ||
+        footer_.index_offset + footer_.blocks * 2 * sizeof(T) + sizeof(footer_) != bytes) {
+      throw std::invalid_argument(path + " is not a run file of this key type");
+    }
+    index_.resize(2 * footer_.blocks);
+    ReadFully(fd_, index_.data(), index_.size() * sizeof(T), footer_.index_offset);
+  } catch (...) {
+    close(fd_);
+    throw;
+  }
+}
+
+template<typename T>
+RunFileReader<T>::~RunFileReader() {
+  close(fd_);
+}
+
+template<typename T>
+const RunFooter &RunFileReader<T>::Footer() const {
+  return footer_;
+}
+
+template<typename T>
+size_t RunFileReader<T>::Size() const {
+  return footer_.records;
+}
+
+template<typename T>
+size_t RunFileReader<T>::Blocks() const {
+  return footer_.blocks;
+}
+
+template<typename T>
+T RunFileReader<T>::BlockMin(size_t block) const {
+  return index_[2 * block];
+}
+
+template<typename T>
+T RunFileReader<T>::BlockMax(size_t block) const {
+  return index_[2 * block + 1];
+}
+
+template<typename T>
+size_t RunFileReader<T>::FindBlock(T key) const {
+  size_t lo = 0;
+  size_t hi = footer_.blocks;
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (BlockMax(mid) < key) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+template<typename T>
+size_t RunFileReader<T>::ReadBlock(size_t block, T *keys) const {
+  size_t block_keys = footer_.block_bytes / sizeof(T);
+  size_t n = std::min(block_keys, footer_.records - block * block_keys);
+  ReadFully(fd_, keys, n * sizeof(T), block * footer_.block_bytes);
+  return n;
+}
+
+template<typename T>
+void RunFileReader<T>::Range(T lo, T hi, std::vector<T> &result) const {
+  std::vector<T> keys(footer_.block_bytes / sizeof(T));
+  for (size_t block = FindBlock(lo); block < footer_.blocks && !(hi < BlockMin(block)); block++) {
+    size_t n = ReadBlock(block, keys.data());
+    const T *first = std::lower_bound(keys.data(), keys.data() + n, lo);
+    const T *last = std::upper_bound(first, (const T *) keys.data() + n, hi);
+    result.insert(result.end(), first, last);
+  }
+}
+
+template class RunIndexWriter<int>;
+template class RunIndexWriter<int64_t>;
+template class RunIndexWriter<float>;
+template class RunIndexWriter<double>;
+template class RunFileReader<int>;
+template class RunFileReader<int64_t>;
+template class RunFileReader<float>;
+template class RunFileReader<double>;
@@ -17,11 +17,34 @@ namespace avx2 {
   template <typename InType, typename RegType>
   void MergePass8(InType *&arr, InType *buffer, size_t N, unsigned int run_size);
   template <typename InType, typename RegType>
+  void MergeRunPair8(InType *arr, InType *buffer, size_t start, size_t run_size,
+                     size_t segment, size_t segments);
+  template <typename InType, typename RegType>
+  void MergeSegment8(InType *a, size_t na, InType *b, size_t nb, InType *out);
+  template <typename InType, typename RegType>
   void MaskedMergePass8(InType *&arr, InType *buffer, size_t N, unsigned int run_size);
   template <typename InType, typename RegType>
+  void MaskedMergeRunPair8(InType *arr, InType *buffer, size_t start, size_t run_size,
+                           size_t segment, size_t segments);
+  template <typename InType, typename RegType>
+  void MaskedMergeSegment8(InType *a, size_t na, InType *b, size_t nb, InType *out);
+  template <typename InType, typename RegType>
   void MergePass4(InType *&arr, InType *buffer, size_t N, unsigned int run_size);
   template <typename InType, typename RegType>
+  void MergeRunPair4(InType *arr, InType *buffer, size_t start, size_t run_size,
+                     size_t segment, size_t segments);
+  template <typename InType, typename RegType>
+  void MergeSegment4(InType *a, size_t na, InType *b, size_t nb, InType *out);
+  template <typename InType, typename RegType>
   void MaskedMergePass4(InType *&arr, InType *buffer, size_t N, unsigned int run_size);
+  template <typename InType, typename RegType>
+  void MaskedMergeRunPair4(InType *arr, InType *buffer, size_t start, size_t run_size,
+                           size_t segment, size_t segments);
+  template <typename InType, typename RegType>
+  void MaskedMergeSegment4(InType *a, size_t na, InType *b, size_t nb, InType *out);
+  // MergeRunPair4 for (key << 32 | index) values, writing records[index]
+  void GatherMergeRunPair4(int64_t *arr, int64_t *buffer, size_t start, size_t run_size,
+                           size_t segment, size_t segments, const int64_t *records);
 };
 
 #endif
\ No newline at end of file
@@ -4,6 +4,12 @@
 #include "avx256/merge_util.h"
 #include "avx256/utils.h"
 #include "common.h"
+#include "execution_context.h"
+#include "external_io.h"
+#include "sort_drivers.h"
+#include "sort_pool.h"
+#include "transport.h"
+#include <future>
 
 #ifdef AVX2
 namespace avx2{
@@ -11,11 +17,90 @@ namespace avx2{
   void SIMDSort(size_t N, int64_t *&arr);
   void SIMDSort(size_t N, float *&arr);
   void SIMDSort(size_t N, double *&arr);
+  void NumaSIMDSort(size_t N, int *&arr);
+  void NumaSIMDSort(size_t N, int64_t *&arr);
+  void NumaSIMDSort(size_t N, float *&arr);
+  void NumaSIMDSort(size_t N, double *&arr);
+  void PartitionedSIMDSort(size_t N, int *&arr);
+  void PartitionedSIMDSort(size_t N, int64_t *&arr);
+  void PartitionedSIMDSort(size_t N, float *&arr);
+  void PartitionedSIMDSort(size_t N, double *&arr);
   void SIMDSort(size_t N, std::pair<int,int> *&arr);
   void SIMDOrderBy32(std::pair<int, int> *&result_arr, size_t N, std::pair<int, int> *arr, int order_by=0);
   void SIMDOrderBy64(std::pair<int, int> *&result_arr, size_t N, std::pair<int, int> *arr, int order_by=0);
   void SIMDSort(size_t N, std::pair<float, float> *&arr);
   void SIMDSort(size_t N, std::pair<int64_t ,int64_t> *&arr);
   void SIMDSort(size_t N, std::pair<double, double> *&arr);
+  void LowMemorySIMDSort(size_t N, int *arr, size_t scratch_bytes=0);
+  void LowMemorySIMDSort(size_t N, int64_t *arr, size_t scratch_bytes=0);
+  void LowMemorySIMDSort(size_t N, float *arr, size_t scratch_bytes=0);
+  void LowMemorySIMDSort(size_t N, double *arr, size_t scratch_bytes=0);
+  void LowMemorySIMDSort(size_t N, std::pair<int, int> *arr, size_t scratch_bytes=0);
+  void LowMemorySIMDSort(size_t N, std::pair<float, float> *arr, size_t scratch_bytes=0);
+  void LowMemorySIMDSort(size_t N, std::pair<int64_t, int64_t> *arr, size_t scratch_bytes=0);
+  void LowMemorySIMDSort(size_t N, std::pair<double, double> *arr, size_t scratch_bytes=0);
+  std::future<int *> SortAsync(size_t N, int *arr, SortPool &pool=SortPool::Shared());
+  std::future<int64_t *> SortAsync(size_t N, int64_t *arr, SortPool &pool=SortPool::Shared());
+  std::future<float *> SortAsync(size_t N, float *arr, SortPool &pool=SortPool::Shared());
+  std::future<double *> SortAsync(size_t N, double *arr, SortPool &pool=SortPool::Shared());
+  std::future<std::pair<int, int> *> SortAsync(size_t N, std::pair<int, int> *arr, SortPool &pool=SortPool::Shared());
+  std::future<std::pair<float, float> *> SortAsync(size_t N, std::pair<float, float> *arr, SortPool &pool=SortPool::Shared());
+  std::future<std::pair<int64_t, int64_t> *> SortAsync(size_t N, std::pair<int64_t, int64_t> *arr, SortPool &pool=SortPool::Shared());
+  std::future<std::pair<double, double> *> SortAsync(size_t N, std::pair<double, double> *arr, SortPool &pool=SortPool::Shared());
+
+  /**
+   * Sorts keys spread over the processes of a transport (sample sort)
+   * @param N: keys of this rank's shard, a power of 2 as for SIMDSort, or 0
+   * @param arr: the shard, used as scratch
+   * @param result_N: set to the keys this rank ends up with
+   * @return this rank's range of the global order, rank 0 holding the
+   * smallest keys; released with aligned_free(ptr, result_N), nullptr if empty
+   */
+  int *DistributedSIMDSort(size_t N, int *arr, Transport &transport, size_t &result_N);
+  int64_t *DistributedSIMDSort(size_t N, int64_t *arr, Transport &transport, size_t &result_N);
+  float *DistributedSIMDSort(size_t N, float *arr, Transport &transport, size_t &result_N);
+  double *DistributedSIMDSort(size_t N, double *arr, Transport &transport, size_t &result_N);
+
+  /**
+   * Sorts a binary file of keys that may be larger than memory. Runs of up to
+   * half of memory_bytes are sorted with SIMDSort and spilled to temp_dir as
+   * run files (RunFooter), then merged with reads ahead of the merge and
+   * writes behind it. Throws std::system_error on I/O errors.
+   * @param input, output: paths of the unsorted and the sorted file
+   */
+  void ExternalSIMDSort(const std::string &input, const std::string &output, KeyType type,
+                        const ExternalSortOptions &options=ExternalSortOptions());
+
+  /**
+   * Sorts a binary file of records in place through a shared mapping, with
+   * LowMemorySIMDSort. The pages are faulted in by all threads with read-ahead
+   * before the sort, and their write-back is started after it without waiting.
+   * Throws std::system_error on I/O errors and std::invalid_argument if the
+   * size is not a multiple of the record size.
+   * @param type: record type, KV types are sorted by key; float keys must not
+   * be NaN
+   * @param scratch_bytes: as for LowMemorySIMDSort
+   */
+  void SortFile(const std::string &path, KeyType type, size_t scratch_bytes=0);
+
+  // SlicedSortDriver with the kernels of this instruction set
+  template<typename T>
+  class SlicedSort : public SlicedSortDriver<T> {
+   public:
+    SlicedSort(size_t N, T *arr);
+  };
+
+  // SortPipelineDriver with the kernels of this instruction set
+  template<typename T>
+  class SortPipeline : public SortPipelineDriver<T> {
+   public:
+    /**
+     * @param chunk_size: keys per chunk, a power of two of at least one block
+     * @param workers: threads sorting chunks
+     * @param queue_size: full chunks that may wait for a worker before Push
+     * blocks, 0 for two per worker
+     */
+    explicit SortPipeline(size_t chunk_size=1 << 20, int workers=omp_get_max_threads(), size_t queue_size=0);
+  };
 };
 #endif
\ No newline at end of file
@@ -16,6 +16,13 @@ template <typename InType, typename RegType>
 void LoadReg(RegType &r, InType* arr);
 template <typename InType, typename RegType>
 void StoreReg(const RegType &r, InType* arr);
+template <typename InType, typename RegType>
+void LoadUnalignedReg(RegType &r, InType* arr);
+template <typename InType, typename RegType>
+void StoreUnalignedReg(const RegType &r, InType* arr);
+// Non-temporal store, arr must be aligned to the register size
+template <typename InType, typename RegType>
+void StreamReg(const RegType &r, InType* arr);
 
 // Converters
 __m256d Int64ToDoubleReg(const __m256i &repi64);
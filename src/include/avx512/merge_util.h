@@ -17,11 +17,37 @@ namespace avx512{
   template <typename InType, typename RegType>
   void MergePass16(InType *&arr, InType *buffer, size_t N, int run_size);
   template <typename InType, typename RegType>
+  void MergeRunPair16(InType *arr, InType *buffer, size_t start, size_t run_size,
+                      size_t segment, size_t segments);
+  template <typename InType, typename RegType>
+  void MergeSegment16(InType *a, size_t na, InType *b, size_t nb, InType *out);
+  template <typename InType, typename RegType>
   void MaskedMergePass16(InType *&arr, InType *buffer, size_t N, int run_size);
   template <typename InType, typename RegType>
+  void MaskedMergeRunPair16(InType *arr, InType *buffer, size_t start, size_t run_size,
+                            size_t segment, size_t segments);
+  template <typename InType, typename RegType>
+  void MaskedMergeSegment16(InType *a, size_t na, InType *b, size_t nb, InType *out);
+  template <typename InType, typename RegType>
   void MergePass8(InType *&arr, InType *buffer, size_t N, int run_size);
   template <typename InType, typename RegType>
+  void MergeRunPair8(InType *arr, InType *buffer, size_t start, size_t run_size,
+                     size_t segment, size_t segments);
+  template <typename InType, typename RegType>
+  void MergeSegment8(InType *a, size_t na, InType *b, size_t nb, InType *out);
+  template <typename InType, typename RegType>
   void MaskedMergePass8(InType *&arr, InType *buffer, size_t N, int run_size);
+  template <typename InType, typename RegType>
+  void MaskedMergeRunPair8(InType *arr, InType *buffer, size_t start, size_t run_size,
+                           size_t segment, size_t segments);
+  template <typename InType, typename RegType>
+  void MaskedMergeSegment8(InType *a, size_t na, InType *b, size_t nb, InType *out);
+  // MergeRunPair8 for packed std::pair<int, int> keys, writing pairs
+  void SwapHalvesMergeRunPair8(int64_t *arr, int64_t *buffer, size_t start, size_t run_size,
+                               size_t segment, size_t segments, const int64_t *records);
+  // MergeRunPair8 for (key << 32 | index) values, writing records[index]
+  void GatherMergeRunPair8(int64_t *arr, int64_t *buffer, size_t start, size_t run_size,
+                           size_t segment, size_t segments, const int64_t *records);
 };
 
 #endif
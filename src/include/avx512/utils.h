@@ -34,6 +34,13 @@ namespace avx512{
   void LoadReg(RegType &r, InType* arr);
   template <typename InType, typename RegType>
   void StoreReg(const RegType &r, InType* arr);
+  template <typename InType, typename RegType>
+  void LoadUnalignedReg(RegType &r, InType* arr);
+  template <typename InType, typename RegType>
+  void StoreUnalignedReg(const RegType &r, InType* arr);
+  // Non-temporal store, arr must be aligned to the register size
+  template <typename InType, typename RegType>
+  void StreamReg(const RegType &r, InType* arr);
 
 //  // Converters
 //  __m512d Int64ToDoubleReg(const __m512i &repi64);
@@ -25,7 +25,77 @@
  */
 
 /**
- * Templated function for memory aligned initialization
+ * Allocator behind every buffer the library allocates. Memory that is handed
+ * back to the caller (the scratch buffer a sort may return through arr, the
+ * SIMDOrderBy result) comes from the allocator active during the call and has
+ * to be released through it.
+ */
+struct Allocator {
+  // Memory aligned to alignment (a power of 2), or nullptr on failure
+  void *(*allocate)(size_t bytes, size_t alignment, void *context);
+  void (*deallocate)(void *ptr, size_t bytes, void *context);
+  void *context;
+};
+
+/**
+ * posix_memalign/free allocator, the initial global allocator
+ */
+Allocator DefaultAllocator();
+
+/**
+ * Replaces the allocator used by all threads; not synchronized with sorts that
+ * are already running
+ */
+void SetAllocator(const Allocator &allocator);
+
+/**
+ * Allocator for allocations made by the calling thread: the innermost
+ * ScopedAllocator if there is one, the global allocator otherwise
+ */
+Allocator CurrentAllocator();
+
+/**
+ * Per call allocator: overrides the allocator for the calling thread while in
+ * scope, e.g. around a single SIMDSort
+ */
+class ScopedAllocator {
+ public:
+  explicit ScopedAllocator(const Allocator &allocator);
+  ~ScopedAllocator();
+  ScopedAllocator(const ScopedAllocator &) = delete;
+  ScopedAllocator &operator=(const ScopedAllocator &) = delete;
+
+ private:
+  Allocator allocator_;
+  const Allocator *previous_;
+};
+
+/**
+ * Bump allocator over a caller supplied region, such as preallocated pinned or
+ * huge page memory. Frees are no-ops; Reset makes the whole region available
+ * again once nothing allocated from it is in use. Not thread safe: the sorts
+ * allocate from the calling thread, except SortPipeline, whose threads take
+ * turns on the allocator, so an arena serves one sort or pipeline at a time.
+ */
+class BumpArena {
+ public:
+  BumpArena(void *region, size_t size);
+  Allocator GetAllocator();
+  void Reset();
+  size_t Used() const;
+
+ private:
+  static void *Allocate(size_t bytes, size_t alignment, void *context);
+  static void Deallocate(void *ptr, size_t bytes, void *context);
+
+  char *region_;
+  size_t size_;
+  size_t offset_;
+};
+
+/**
+ * Templated function for memory aligned initialization, through the current
+ * allocator
  * @tparam T: data type
  * @param ptr: reference to pointer needing init
  * @param N: size of data
@@ -34,6 +104,84 @@
 template <typename T>
 void aligned_init(T* &ptr, size_t N, size_t alignment_size=64);
 
+/**
+ * Releases memory from aligned_init through the current allocator
+ * @param ptr: pointer from aligned_init
+ * @param N: size of data it was initialized with
+ */
+template <typename T>
+void aligned_free(T* ptr, size_t N);
+
+/**
+ * Backs allocations of at least one 2 MiB page made by the default allocator
+ * with transparent huge pages, which cuts dTLB misses in the merge passes. The
+ * memory stays releasable with free(); if the kernel has THP disabled the
+ * allocation silently keeps 4 KiB pages.
+ * @param enabled: whether to request huge pages (off by default)
+ */
+void SetHugePages(bool enabled);
+bool HugePagesEnabled();
+
+/**
+ * Size of a data cache level as reported by the OS
+ * @param level: cache level (1, 2 or 3)
+ * @return size in bytes, or a typical default if the OS does not report it
+ */
+size_t CacheSize(int level);
+
+/**
+ * Bytes of data above which a merge pass is treated as out of cache: its
+ * output is written with streaming stores and its input prefetched, and it
+ * runs on the streaming team. The LLC size unless set, e.g. by tests that
+ * exercise those paths on small inputs.
+ * @param bytes: new threshold, 0 to go back to the LLC size
+ */
+void SetStreamingThreshold(size_t bytes);
+size_t StreamingThreshold();
+
+/**
+ * Number of elements in a cache-resident chunk: the largest power of 2 for which
+ * the chunk and its merge buffer fit in L2 together
+ * @param N: size of data (power of 2)
+ * @param elem_size: size of a single element in bytes
+ * @param min_size: smallest chunk allowed (sorting network block size)
+ */
+size_t CacheBlockSize(size_t N, size_t elem_size, size_t min_size);
+
+/**
+ * Merge path co-rank: number of records taken from a when the first k records
+ * of merge(a, b) are produced (ties are taken from a first)
+ * @tparam T: data type
+ * @param k: output rank
+ * @param a, na: first sorted run and its size in records
+ * @param b, nb: second sorted run and its size in records
+ * @param stride: values per record, the key being the first value (2 for key-value arrays)
+ */
+template <typename T>
+size_t CoRank(size_t k, const T *a, size_t na, const T *b, size_t nb, size_t stride=1);
+
+/**
+ * Co-rank over several runs: how many keys of each run are among the first k
+ * of their merge (ties are taken from the lower numbered run first), so the
+ * splits of increasing k never move backwards
+ * @param k: output rank
+ * @param runs, sizes: sorted runs and their sizes
+ * @param P: number of runs
+ * @param ranks: set to the keys taken from each run, they sum to k
+ */
+template <typename T>
+void MultiCoRank(size_t k, const T *const *runs, const size_t *sizes, size_t P, size_t *ranks);
+
+/**
+ * Scalar merge of two sorted runs, used for run heads/tails the SIMD kernels cannot cover
+ * @param a, na: first sorted run and its size in records
+ * @param b, nb: second sorted run and its size in records
+ * @param out: destination for na + nb records
+ * @param stride: values per record
+ */
+template <typename T>
+void ScalarMerge(const T *a, size_t na, const T *b, size_t nb, T *out, size_t stride=1);
+
 template <typename T>
 void print_arr(T *arr, int i, int j, const std::string &tag="");
 
@@ -0,0 +1,199 @@
+#pragma once
+
+#include <cstddef>
+#include <sched.h>
+#include <vector>
+
+/**
+ * Thread pool the sorts submit their work to instead of OpenMP, e.g. an adapter
+ * over a TBB arena or a folly executor. parallel_for runs task(arg, i) for
+ * every i in [0, n) on any of its threads and returns once all have finished.
+ * It is only called from the thread that issued the sort, never from a task,
+ * so the pool does not need to support nested waits.
+ */
+struct Executor {
+  void (*parallel_for)(size_t n, void (*task)(void *arg, size_t i), void *arg, void *context);
+  // Threads of the pool, sizes the work items
+  int threads;
+  void *context;
+};
+
+/**
+ * Replaces OpenMP by an executor for all sorts whose context does not name one
+ * @param executor: pool adapter, {nullptr, 0, nullptr} to go back to OpenMP
+ */
+void SetExecutor(const Executor &executor);
+
+/**
+ * Executor of the calling thread's context if it has one, the global one
+ * otherwise; parallel_for is nullptr when the sorts run on OpenMP
+ */
+Executor CurrentExecutor();
+
+/**
+ * How the threads of a team are placed on the CPUs they may run on (the
+ * context's cpus, or the caller's affinity). Except for AFFINITY_NONE every
+ * thread is pinned to one CPU for the whole sort, and the drivers then hand each
+ * thread the same slice of the output in every merge pass, so the runs a core
+ * produced are still in its L2 when it merges them.
+ */
+enum AffinityPolicy {
+  // Threads float over all of the CPUs
+  AFFINITY_NONE,
+  // Neighbouring threads share a core, then a package
+  AFFINITY_COMPACT,
+  // Threads go round robin over packages, then cores, and only then SMT siblings
+  AFFINITY_SCATTER,
+  // Thread t runs on cpus[t], which must not be empty
+  AFFINITY_LIST,
+};
+
+/**
+ * Resources a sort may use. Defaults leave the calling thread's OpenMP
+ * settings, affinity and priority as they are.
+ */
+struct ExecutionContext {
+  // Team size, 0 for the size of cpus if given, omp_get_max_threads() otherwise
+  int threads = 0;
+  // CPUs the team may run on, empty to keep the inherited affinity
+  std::vector<int> cpus;
+  // Nice value for the team while it sorts, 0 to keep it. Threads keep a
+  // lowered priority afterwards if RLIMIT_NICE does not allow raising it back
+  int priority = 0;
+  AffinityPolicy affinity = AFFINITY_NONE;
+  // Use one CPU per core when pinning, a team of 0 threads then has one per core
+  bool skip_smt_siblings = false;
+  // Pool to run on, parallel_for nullptr for the global executor. threads,
+  // cpus, priority and the thread budget only apply to OpenMP teams
+  Executor executor = {nullptr, 0, nullptr};
+};
+
+/**
+ * Execution context of the calling thread: the innermost
+ * ScopedExecutionContext if there is one, the defaults otherwise
+ */
+ExecutionContext CurrentExecutionContext();
+
+/**
+ * Per call execution context: applies to the sorts issued by the calling
+ * thread while in scope, e.g. one request of a server thread
+ */
+class ScopedExecutionContext {
+ public:
+  explicit ScopedExecutionContext(const ExecutionContext &context);
+  ~ScopedExecutionContext();
+  ScopedExecutionContext(const ScopedExecutionContext &) = delete;
+  ScopedExecutionContext &operator=(const ScopedExecutionContext &) = delete;
+
+ private:
+  ExecutionContext context_;
+  const ExecutionContext *previous_;
+};
+
+/**
+ * Bounds the helper threads of all sorts running at the same time. Every sort
+ * runs on its calling thread and takes as many helpers as it asks for and are
+ * still free, possibly none, so concurrent sorts from different threads split
+ * the budget instead of each starting a full team.
+ * @param threads: helper threads shared by all sorts, 0 for no bound (default)
+ */
+void SetThreadBudget(size_t threads);
+
+/**
+ * Helper threads currently taken out of the budget by running sorts
+ */
+size_t ThreadBudgetInUse();
+
+/**
+ * Threads the sort drivers size their work for: the executor's, or the OpenMP
+ * team size of the calling thread; 1 within a task of ParallelFor
+ */
+int ParallelThreads();
+
+/**
+ * Whether the calling thread runs a task of ParallelFor, or is inside an
+ * OpenMP parallel region that may not nest another active one, so that work
+ * it issues must stay on this thread
+ */
+bool InParallelTask();
+
+/**
+ * Whether the team the calling thread starts has its threads pinned by an
+ * affinity policy
+ */
+bool ThreadsPinned();
+
+/**
+ * Runs task(arg, i) for every i in [0, n) on the current executor, or on an
+ * OpenMP team of the calling thread, and returns once all have finished.
+ * Called from within a task it runs the items in order on the calling thread.
+ * @param threads: at most this many threads work on the items, 0 for all
+ */
+void ParallelFor(size_t n, void (*task)(void *arg, size_t i), void *arg, int threads = 0);
+
+/**
+ * Memory-bound passes, whose data do not fit in the LLC, saturate DRAM with
+ * fewer threads than a full team. Their thread count is learned from the
+ * bandwidth the passes report: starting from the full team it is halved as
+ * long as the fewer threads keep 90% of the bandwidth, and the threads left
+ * over are free for other work.
+ * @param enabled: whether to adapt (on by default); also restarts the search
+ */
+void SetAdaptiveStreamingThreads(bool enabled);
+
+/**
+ * Threads for the next memory-bound pass of a team
+ * @param threads: size of the team
+ */
+int StreamingThreads(int threads);
+
+/**
+ * Reports the bandwidth a memory-bound pass reached
+ * @param threads: threads that ran it
+ * @param bytes: bytes read and written
+ * @param seconds: duration of the pass
+ */
+void ReportStreamingPass(int threads, size_t bytes, double seconds);
+
+/**
+ * ParallelFor for a memory-bound pass that reads and writes bytes: runs on
+ * StreamingThreads() of the current team and reports the bandwidth reached
+ */
+void StreamingParallelFor(size_t n, void (*task)(void *arg, size_t i), void *arg, size_t bytes);
+
+/**
+ * Copies bytes from src to dst as a memory-bound pass, one segment of whole
+ * cache lines per thread
+ */
+void ParallelCopy(void *dst, const void *src, size_t bytes);
+
+/**
+ * Entered by the sort drivers for the duration of a sort: sizes the OpenMP
+ * team of the calling thread from the current context and the budget, and
+ * applies the context's CPU set, affinity policy and priority to the team's
+ * threads. Nested
+ * scopes on the same thread, and scopes under an executor, are no-ops.
+ */
+class ExecutionScope {
+ public:
+  ExecutionScope();
+  ~ExecutionScope();
+  ExecutionScope(const ExecutionScope &) = delete;
+  ExecutionScope &operator=(const ExecutionScope &) = delete;
+
+ private:
+  bool outermost_;
+  size_t helpers_;
+  int threads_;
+  int previous_threads_;
+  // Settings of a team thread before the scope, by kernel thread id: OpenMP
+  // may run a later region of the caller on other pooled threads
+  struct SavedThread {
+    pid_t tid;
+    bool affinity_saved;
+    cpu_set_t affinity;
+    bool priority_saved;
+    int priority;
+  };
+  std::vector<SavedThread> saved_;
+};
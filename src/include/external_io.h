@@ -0,0 +1,271 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * Type of the records in a binary file: a key, or a key and a value of the
+ * same type (std::pair layout)
+ */
+enum KeyType {
+  KEY_INT32,
+  KEY_INT64,
+  KEY_FLOAT,
+  KEY_DOUBLE,
+  KEY_INT32_KV,
+  KEY_INT64_KV,
+  KEY_FLOAT_KV,
+  KEY_DOUBLE_KV,
+};
+
+// Bytes of one record of the type
+size_t RecordBytes(KeyType type);
+
+/**
+ * Settings of the external sort of a file larger than memory
+ */
+struct ExternalSortOptions {
+  // Memory for keys in flight: the sort of a run, or the buffers of a merge
+  size_t memory_bytes = size_t(1) << 30;
+  // Directory for the run files, empty for the directory of the output
+  std::string temp_dir;
+  // Runs merged at once, more runs are merged in several passes. Capped at
+  // memory_bytes / 4 MiB, and at least 2
+  size_t max_fan_in = 256;
+  // Bytes per block of the run files
+  size_t run_block_bytes = size_t(64) << 10;
+  // Whether the output is a run file too, instead of just the keys
+  bool indexed_output = false;
+};
+
+/**
+ * Sorted run file: the keys in order, cut into fixed-size blocks of
+ * block_bytes (the last one partial), then the index of the blocks, the
+ * smallest and the largest key of each, then this footer, all little-endian.
+ * Block b starts at byte b * block_bytes, so the index of maxima fences the
+ * blocks: a lookup reads the index and then only the blocks it names.
+ */
+struct RunFooter {
+  uint64_t records;
+  uint64_t block_bytes;
+  uint64_t blocks;
+  // Byte offset of the index, the end of the keys
+  uint64_t index_offset;
+  uint32_t key_type;
+  uint32_t version;
+  // RUN_MAGIC, the last bytes of the file
+  uint64_t magic;
+};
+
+// "USRTRUN1"
+const uint64_t RUN_MAGIC = 0x314e555254525355;
+const uint32_t RUN_VERSION = 1;
+
+/**
+ * Builds the index of a run file while its keys are written
+ */
+template<typename T>
+class RunIndexWriter {
+ public:
+  // block_bytes: a multiple of the key size
+  explicit RunIndexWriter(size_t block_bytes);
+
+  // Takes the next keys of the run, in order
+  void Add(const T *keys, size_t n);
+  // Writes the index and the footer after the keys
+  void Finish(int fd);
+
+ private:
+  size_t block_keys_;
+  size_t records_;
+  std::vector<T> index_;
+};
+
+/**
+ * Range lookups in a run file, reading its index once and then single blocks
+ * with pread. A file of another key type or not a run file throws
+ * std::invalid_argument; I/O errors throw std::system_error.
+ */
+template<typename T>
+class RunFileReader {
+ public:
+  explicit RunFileReader(const std::string &path);
+  ~RunFileReader();
+  RunFileReader(const RunFileReader &) = delete;
+  RunFileReader &operator=(const RunFileReader &) = delete;
+
+  const RunFooter &Footer() const;
+  size_t Size() const;
+  size_t Blocks() const;
+  T BlockMin(size_t block) const;
+  T BlockMax(size_t block) const;
+
+  // First block with keys no smaller than key, Blocks() if there is none
+  size_t FindBlock(T key) const;
+  // Reads a block into keys, which has room for block_bytes; returns its keys
+  size_t ReadBlock(size_t block, T *keys) const;
+  // Appends the keys in [lo, hi] to result, in order
+  void Range(T lo, T hi, std::vector<T> &result) const;
+
+ private:
+  int fd_;
+  RunFooter footer_;
+  // Smallest and largest key of each block, interleaved
+  std::vector<T> index_;
+};
+
+// Key type of the run files of T
+template<typename T>
+KeyType RunKeyType();
+template<> KeyType RunKeyType<int>();
+template<> KeyType RunKeyType<int64_t>();
+template<> KeyType RunKeyType<float>();
+template<> KeyType RunKeyType<double>();
+
+/**
+ * Reads a byte range of a file ahead of its consumer: a background thread
+ * fills one buffer with pread while the consumer works on the other. I/O
+ * errors throw std::system_error from Next.
+ */
+class PrefetchReader {
+ public:
+  /**
+   * @param fd: open file, not owned
+   * @param offset, bytes: range to read
+   * @param buffer_bytes: size of each of the two buffers
+   */
+  PrefetchReader(int fd, size_t offset, size_t bytes, size_t buffer_bytes);
+  ~PrefetchReader();
+  PrefetchReader(const PrefetchReader &) = delete;
+  PrefetchReader &operator=(const PrefetchReader &) = delete;
+
+  /**
+   * Hands over the next buffer of the range, and the previous one back for
+   * reading ahead
+   * @param bytes: set to the bytes in the buffer, 0 at the end of the range
+   */
+  const char *Next(size_t &bytes);
+
+ private:
+  void Work();
+
+  int fd_;
+  size_t offset_;
+  size_t end_;
+  size_t buffer_bytes_;
+  char *buffers_[2];
+  size_t filled_[2];
+  // Buffer the consumer holds, the other one is being filled
+  int current_;
+  // Whether the other buffer is filled
+  bool ready_;
+  bool stopping_;
+  int error_;
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::thread reader_;
+};
+
+/**
+ * Appends to a file from a background thread: the producer fills one buffer
+ * while the other is written. Write errors throw std::system_error from
+ * Commit or Close.
+ */
+class StreamWriter {
+ public:
+  /**
+   * @param fd: open file, not owned
+   * @param buffer_bytes: size of each of the two buffers
+   */
+  StreamWriter(int fd, size_t buffer_bytes);
+  // Flushes if Close was not called, dropping any error
+  ~StreamWriter();
+  StreamWriter(const StreamWriter &) = delete;
+  StreamWriter &operator=(const StreamWriter &) = delete;
+
+  // Buffer to fill next, buffer_bytes large and 64-byte aligned
+  char *Buffer();
+  // Queues bytes of Buffer() for writing, waiting for the previous write
+  void Commit(size_t bytes);
+  // Waits for all writes
+  void Close();
+
+ private:
+  void Work();
+
+  int fd_;
+  size_t buffer_bytes_;
+  char *buffers_[2];
+  // Buffer the producer fills, the other one may be being written
+  int current_;
+  size_t offset_;
+  // Bytes of the other buffer still to write
+  size_t pending_;
+  bool stopping_;
+  int error_;
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::thread writer_;
+};
+
+/**
+ * Shared read-write mapping of a whole file, for sorting it in place. Failed
+ * calls throw std::system_error; madvise hints the kernel does not take, such
+ * as huge pages on file systems without them, are ignored.
+ */
+class MappedFile {
+ public:
+  explicit MappedFile(const std::string &path);
+  ~MappedFile();
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  // Page-aligned, nullptr for an empty file
+  char *Data();
+  size_t Size() const;
+  // Faults in every page for writing with read-ahead, a slice per thread
+  void Prefault();
+  // Starts write-back of the dirty pages, a slice per thread, without waiting
+  void WriteBack();
+
+ private:
+  int fd_;
+  char *data_;
+  size_t size_;
+};
+
+/**
+ * pread/pwrite until all bytes are transferred, throwing std::system_error
+ * on errors and on reads past the end of the file
+ */
+void ReadFully(int fd, void *data, size_t bytes, size_t offset);
+void WriteFully(int fd, const void *data, size_t bytes, size_t offset);
+
+/**
+ * Opens a file with open(2) flags, throwing std::system_error on failure
+ */
+int OpenFile(const std::string &path, int flags);
+size_t FileSize(int fd);
+
+/**
+ * Owns a file descriptor, such as one from OpenFile, and closes it when it
+ * goes out of scope, so that errors thrown while the file is open do not
+ * leak it
+ */
+class ScopedFd {
+ public:
+  explicit ScopedFd(int fd);
+  ~ScopedFd();
+  ScopedFd(const ScopedFd &) = delete;
+  ScopedFd &operator=(const ScopedFd &) = delete;
+
+  int Get() const;
+
+ private:
+  int fd_;
+};
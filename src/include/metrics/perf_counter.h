@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdint>
+#include <linux/perf_event.h>
+#include <vector>
+
+// dTLB load misses, for PERF_TYPE_HW_CACHE
+const uint64_t PERF_DTLB_LOAD_MISSES = PERF_COUNT_HW_CACHE_DTLB |
+                                       (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                       (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+
+/**
+ * User space hardware event counter for the whole process, read through
+ * perf_event_open. One counter is opened per thread that exists when it is
+ * constructed (e.g. the OpenMP pool) and threads created later are inherited.
+ */
+class PerfCounter {
+ public:
+  PerfCounter(uint32_t type, uint64_t config);
+  ~PerfCounter();
+  PerfCounter(const PerfCounter &) = delete;
+  PerfCounter &operator=(const PerfCounter &) = delete;
+
+  // false when perf events are not permitted or the event is not supported
+  bool Available() const;
+  void Start();
+  // Events counted since Start, -1 if the counter is not available
+  int64_t Stop();
+
+ private:
+  std::vector<int> fds_;
+};
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+/**
+ * NUMA topology and placement helpers. libnuma is used when the build found it
+ * (HAVE_LIBNUMA), otherwise the topology is read from sysfs and memory is
+ * placed with the raw mbind system call.
+ */
+
+/**
+ * Replaces the topology reported by the system, e.g. so tests can run the
+ * NUMA paths with several nodes on any machine. Node i then has the CPUs
+ * node_cpus[i]; memory is still placed by the kernel, which fails for node
+ * ids the system does not have.
+ * @param node_cpus: CPUs of every node, empty to go back to the system's
+ */
+void SetNumaTopology(const std::vector<std::vector<int>> &node_cpus);
+
+/**
+ * NUMA nodes that have CPUs attached
+ * @return node ids in ascending order, {0} if the system does not report any
+ */
+std::vector<int> NumaNodes();
+
+/**
+ * CPUs that belong to a NUMA node
+ * @param node: node id
+ * @return cpu ids in ascending order
+ */
+std::vector<int> NumaNodeCpus(int node);
+
+/**
+ * Restricts the calling thread to the CPUs of a NUMA node
+ * @param node: node id
+ * @return false if the affinity could not be changed
+ */
+bool BindThreadToNode(int node);
+
+/**
+ * Asks the kernel to place the pages of a range on a NUMA node. Only pages that
+ * lie completely inside the range are affected, and pages that were already
+ * touched keep their placement, so untouched scratch should be bound.
+ * @param ptr: start of the range
+ * @param bytes: length of the range
+ * @param node: node id
+ * @return false if the placement policy could not be set; first touch by a
+ * thread running on the node still places the pages there
+ */
+bool BindMemoryToNode(void *ptr, size_t bytes, int node);
@@ -0,0 +1,205 @@
+#pragma once
+
+#include "common.h"
+#include "external_io.h"
+#include "transport.h"
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * Sort drivers that only schedule work and move data: the block sorts and
+ * merges are the kernels they are given, so avx512 and avx2 share them and
+ * pass their own. Instantiated for int, int64_t, float and double.
+ */
+
+/**
+ * Merges sorted runs into out on the team of the calling thread, as one pass
+ * cut into a segment per thread by multi-way co-rank
+ * @param merge_segment: two-way merge kernel of the instruction set
+ */
+template<typename InType>
+void KWayMergeRuns(std::vector<const InType *> runs, std::vector<size_t> sizes, InType *out,
+                   void (*merge_segment)(InType *, size_t, InType *, size_t, InType *));
+
+/**
+ * Shared-nothing driver: every thread sorts a contiguous slice of its own with
+ * the cache-blocked sort, without synchronizing with the others, and a single
+ * P-way merge then writes the output. The output is cut into one segment per
+ * thread at splitters found by a multi-way co-rank. A segment is merged in
+ * L2-sized tiles, each cut again by co-rank, whose pieces are merged pairwise
+ * in cache with the segment kernel, so the slices are read and the output is
+ * written in one pass instead of log(P) passes with a barrier after each.
+ * @param sort_slice: cache-blocked sort of N keys from arr, returns whether
+ * the result is in buffer rather than in arr
+ */
+template<typename InType>
+void PartitionedSort(size_t N, InType *&arr, size_t block_size,
+                     bool (*sort_slice)(size_t N, InType *arr, InType *buffer),
+                     void (*merge_segment)(InType *, size_t, InType *, size_t, InType *));
+
+/**
+ * Distributed sample sort: every rank sorts its shard and contributes regular
+ * samples, which all ranks gather and sort the same way to pick P - 1
+ * splitters. A sample weighs as many keys as it stands for on its rank, and
+ * the splitters cut the cumulative weight into P equal parts, so ranks with
+ * larger shards pull the splitters towards their keys. Each rank then sends the keys between splitters q and q + 1 to
+ * rank q, and merges the sorted pieces it receives with the P-way merge, so
+ * rank q ends up with the q-th range of the global order.
+ * @param sort: SIMDSort of the instruction set
+ */
+template<typename InType>
+InType *DistributedSort(size_t N, InType *arr, Transport &transport, size_t &result_N,
+                        void (*sort)(size_t N, InType *&arr),
+                        void (*merge_segment)(InType *, size_t, InType *, size_t, InType *));
+
+/**
+ * External sort: chunks of the input that fit in memory with the scratch of
+ * the sort are sorted and spilled as run files, which are then merged with
+ * reads ahead of and writes behind the merge, max_fan_in runs at a time, or
+ * fewer if their read buffers would not fit in memory_bytes.
+ * @param sort: SIMDSort of the instruction set
+ */
+template<typename InType>
+void ExternalSort(const std::string &input, const std::string &output, const ExternalSortOptions &options,
+                  void (*sort)(size_t N, InType *&arr),
+                  void (*merge_segment)(InType *, size_t, InType *, size_t, InType *));
+
+/**
+ * SIMDSort cut into slices for single threaded event loops. Each Step sorts
+ * blocks and merges segments of a few thousand values until the next unit
+ * would overrun its budget, and keeps its position for the next call. The
+ * order of the work is that of the cache-blocked SIMDSort; the result is arr
+ * or a scratch buffer that the caller then owns, as with SIMDSort.
+ */
+template<typename T>
+class SlicedSortDriver {
+ public:
+  ~SlicedSortDriver();
+  SlicedSortDriver(const SlicedSortDriver &) = delete;
+  SlicedSortDriver &operator=(const SlicedSortDriver &) = delete;
+
+  /**
+   * Advances the sort by at least one unit of work
+   * @param budget_us: time the call may take, in microseconds
+   * @param max_values: also stop once this many values were sorted or
+   * merged, 0 for no limit
+   * @return whether the sort is finished
+   */
+  bool Step(int64_t budget_us, size_t max_values=0);
+  bool Done() const;
+  // Sorted array once Done
+  T *Result();
+
+ protected:
+  SlicedSortDriver(size_t N, T *arr, size_t block_size, size_t unit_run_size, void (*sort_block)(T *&, size_t),
+                   void (*merge_run_pair)(T *, T *, size_t, size_t, size_t, size_t));
+
+ private:
+  void RunUnit();
+  T *Side(size_t run_size) const;
+
+  T *arr_;
+  T *buffer_;
+  size_t N_;
+  size_t unit_run_size_;
+  size_t block_size_;
+  size_t chunk_size_;
+  size_t unit_size_;
+  void (*sort_block_)(T *&, size_t);
+  void (*merge_run_pair_)(T *, T *, size_t, size_t, size_t, size_t);
+  // Position: chunk being sorted, N / chunk_size_ for the levels above the
+  // chunks; run size being merged, 0 while sorting blocks; next unit
+  size_t chunk_;
+  size_t run_size_;
+  size_t offset_;
+  // Recent cost of a unit in microseconds
+  double unit_us_;
+  bool result_taken_;
+};
+
+/**
+ * Sorts keys while they arrive. Producers Push keys from any thread; every
+ * full chunk goes through a bounded queue to a worker that sorts it with the
+ * sorting network and merge passes, and a merger thread merges sorted runs
+ * of equal size as soon as both exist. Finish merges what is left over on
+ * the team of the calling thread. Every buffer, on any of the threads, comes
+ * from the allocator that was current when the pipeline was constructed. The
+ * pipeline serializes its calls, so that allocator need not be thread safe.
+ */
+template<typename T>
+class SortPipelineDriver {
+ public:
+  // Finishes and drops the result if Finish was not called
+  ~SortPipelineDriver();
+  SortPipelineDriver(const SortPipelineDriver &) = delete;
+  SortPipelineDriver &operator=(const SortPipelineDriver &) = delete;
+
+  void Push(const T *keys, size_t n);
+
+  /**
+   * Waits for the chunks in flight and merges all runs
+   * @param N: set to the number of keys pushed
+   * @return the sorted keys, released with aligned_free(ptr, N) under the
+   * pipeline's allocator; nullptr if nothing was pushed
+   */
+  T *Finish(size_t &N);
+
+ protected:
+  // Sizes as for the SortPipeline of each instruction set, and its kernels
+  SortPipelineDriver(size_t chunk_size, int workers, size_t queue_size, size_t block_size,
+                     void (*sort_block)(T *&, size_t), void (*merge_runs)(T *&, size_t),
+                     void (*merge_segment)(T *, size_t, T *, size_t, T *));
+
+ private:
+  struct Run {
+    T *keys;
+    size_t n;
+  };
+
+  void Work();
+  void MergeWork();
+  void Enqueue(T *chunk);
+  // Sorts keys in place, or into a buffer that then replaces them
+  void SortChunk(T *&keys, size_t n);
+  Run Merge(const Run &a, const Run &b, int threads);
+  // allocator_ behind allocator_mutex_
+  Allocator SerializedAllocator();
+  static void *SerializedAllocate(size_t bytes, size_t alignment, void *context);
+  static void SerializedDeallocate(void *ptr, size_t bytes, void *context);
+
+  size_t chunk_size_;
+  size_t queue_size_;
+  size_t block_size_;
+  void (*sort_block_)(T *&, size_t);
+  void (*merge_runs_)(T *&, size_t);
+  void (*merge_segment_)(T *, size_t, T *, size_t, T *);
+  // Installed on the producers, workers and merger alike, serialized
+  Allocator allocator_;
+  std::mutex allocator_mutex_;
+
+  // Chunk being filled by the producers
+  std::mutex fill_mutex_;
+  T *fill_;
+  size_t filled_;
+  size_t pushed_;
+
+  std::mutex mutex_;
+  std::condition_variable queued_;
+  std::condition_variable dequeued_;
+  std::condition_variable sorted_;
+  std::deque<T *> chunks_;
+  std::deque<Run> runs_;
+  bool closed_;
+  bool workers_done_;
+  // Runs the merger holds back until one of equal size arrives, by level
+  std::vector<Run> pending_;
+  std::vector<std::thread> workers_;
+  std::thread merger_;
+  bool finished_;
+};
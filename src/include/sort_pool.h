@@ -0,0 +1,61 @@
+#pragma once
+
+#include "execution_context.h"
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Worker pool behind the asynchronous sorts. Whole sorts are queued as jobs,
+ * and a worker that takes one drives it with the pool as its executor, so the
+ * block sorts and merge segments of every sort in flight are queued as items
+ * on the same workers and interleave. A thread waiting for its items runs
+ * queued items in the meantime, so the pool never blocks on itself.
+ */
+class SortPool {
+ public:
+  explicit SortPool(int threads);
+  // Finishes the queued jobs first
+  ~SortPool();
+  SortPool(const SortPool &) = delete;
+  SortPool &operator=(const SortPool &) = delete;
+
+  /**
+   * Queues a job; it runs with the allocator of the submitting thread and
+   * with the pool as executor
+   */
+  void Submit(std::function<void()> job);
+  Executor GetExecutor();
+  int Threads() const;
+
+  /**
+   * Pool of omp_get_max_threads() workers, started on first use
+   */
+  static SortPool &Shared();
+
+ private:
+  struct Batch {
+    void (*task)(void *, size_t);
+    void *arg;
+    size_t remaining;
+  };
+  struct Item {
+    Batch *batch;
+    size_t i;
+  };
+
+  static void ParallelFor(size_t n, void (*task)(void *, size_t), void *arg, void *context);
+  void Work();
+  // Runs one queued item, lock held on entry and on return
+  void RunItem(std::unique_lock<std::mutex> &lock);
+
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::deque<Item> items_;
+  std::deque<std::function<void()>> jobs_;
+  std::vector<std::thread> workers_;
+  bool stopping_;
+};
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * Point-to-point byte channels between the ranks of a distributed sort. Bytes
+ * sent from one rank to another arrive in order. Send and Recv may be called
+ * at the same time from two threads, one sending and one receiving.
+ */
+class Transport {
+ public:
+  virtual ~Transport() {}
+  virtual int Rank() const = 0;
+  virtual int Size() const = 0;
+  // Blocks until all bytes are handed to the channel to peer
+  virtual void Send(int peer, const void *data, size_t bytes) = 0;
+  // Blocks until bytes from peer have arrived
+  virtual void Recv(int peer, void *data, size_t bytes) = 0;
+};
+
+/**
+ * Transport over one stream socket per pair of ranks: Unix domain sockets on
+ * one host, TCP between hosts. Failed socket calls throw std::system_error.
+ */
+class SocketTransport : public Transport {
+ public:
+  /**
+   * @param rank: rank of this process
+   * @param fds: connected socket to every rank, -1 for this one; the transport
+   * closes them
+   */
+  SocketTransport(int rank, std::vector<int> fds);
+  ~SocketTransport() override;
+  SocketTransport(const SocketTransport &) = delete;
+  SocketTransport &operator=(const SocketTransport &) = delete;
+
+  int Rank() const override;
+  int Size() const override;
+  void Send(int peer, const void *data, size_t bytes) override;
+  void Recv(int peer, void *data, size_t bytes) override;
+
+  /**
+   * Socket pairs between P ranks, created before forking the ranks: row r holds
+   * the sockets of rank r. A rank keeps its row and closes the others.
+   */
+  static std::vector<std::vector<int>> Mesh(int P);
+
+  /**
+   * Connects to all other ranks. Every rank listens on its own endpoint, takes
+   * connections from the ranks above it and connects to the ones below it,
+   * retrying until they listen or timeout_ms has passed.
+   * @param endpoints: "host:port" for TCP or "unix:/path" per rank
+   */
+  static std::unique_ptr<SocketTransport> Connect(int rank, const std::vector<std::string> &endpoints,
+                                                  int timeout_ms=30000);
+
+ private:
+  int rank_;
+  std::vector<int> fds_;
+};
+
+/**
+ * Personalized all-to-all: every rank sends send_bytes[q] bytes from send[q]
+ * to rank q and receives from all ranks, itself included, in a shifted
+ * schedule of pairwise exchanges
+ * @param recv: set to the received bytes, concatenated in rank order
+ * @return bytes received from each rank
+ */
+std::vector<size_t> AllToAll(Transport &transport, const std::vector<const void *> &send,
+                             const std::vector<size_t> &send_bytes, std::unique_ptr<char[]> &recv);
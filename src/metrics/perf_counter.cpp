@@ -0,0 +1,75 @@
+#include "metrics/perf_counter.h"
+#include <cstring>
+#include <dirent.h>
+#include <string>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+PerfCounter::PerfCounter(uint32_t type, uint64_t config) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.disabled = 1;
+  attr.inherit = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+
+  DIR *tasks = opendir("/proc/self/task");
+  if (tasks == nullptr) {
+    return;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(tasks)) != nullptr) {
+    if (entry->d_name[0] == '.') {
+      continue;
+    }
+    pid_t tid = std::stoi(entry->d_name);
+    int fd = syscall(SYS_perf_event_open, &attr, tid, -1, -1, 0);
+    if (fd < 0) {
+      // All or nothing, a partial count would be misleading
+      for (int open_fd : fds_) {
+        close(open_fd);
+      }
+      fds_.clear();
+      break;
+    }
+    fds_.push_back(fd);
+  }
+  closedir(tasks);
+}
+
+PerfCounter::~PerfCounter() {
+  for (int fd : fds_) {
+    close(fd);
+  }
+}
+
+bool PerfCounter::Available() const {
+  return !fds_.empty();
+}
+
+void PerfCounter::Start() {
+  for (int fd : fds_) {
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+  }
+}
+
+int64_t PerfCounter::Stop() {
+  if (fds_.empty()) {
+    return -1;
+  }
+  int64_t total = 0;
+  for (int fd : fds_) {
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    uint64_t count = 0;
+    if (read(fd, &count, sizeof(count)) != sizeof(count)) {
+      return -1;
+    }
+    total += count;
+  }
+  return total;
+}
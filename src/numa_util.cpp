@@ -0,0 +1,158 @@
+#include "numa_util.h"
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <sched.h>
+#include <string>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifdef HAVE_LIBNUMA
+#include <numa.h>
+#endif
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
+static std::mutex topology_mutex;
+static std::vector<std::vector<int>> topology_override;
+
+#ifndef HAVE_LIBNUMA
+/**
+ * Parses a kernel list such as "0-3,8,10-11"
+ */
+static std::vector<int> ParseList(const std::string &list) {
+  std::vector<int> ids;
+  size_t pos = 0;
+  while (pos < list.size()) {
+    size_t end = list.find(',', pos);
+    if (end == std::string::npos) {
+      end = list.size();
+    }
+    std::string range = list.substr(pos, end - pos);
+    size_t dash = range.find('-');
+    if (!range.empty()) {
+      int lo = std::stoi(range);
+      int hi = dash == std::string::npos ? lo : std::stoi(range.substr(dash + 1));
+      for (int id = lo; id <= hi; id++) {
+        ids.push_back(id);
+      }
+    }
+    pos = end + 1;
+  }
+  return ids;
+}
+
+static std::vector<int> ReadList(const std::string &path) {
+  std::ifstream file(path);
+  std::string list;
+  if (!std::getline(file, list)) {
+    return {};
+  }
+  return ParseList(list);
+}
+#endif
+
+void SetNumaTopology(const std::vector<std::vector<int>> &node_cpus) {
+  std::lock_guard<std::mutex> lock(topology_mutex);
+  topology_override = node_cpus;
+}
+
+std::vector<int> NumaNodes() {
+  std::vector<int> nodes;
+  std::unique_lock<std::mutex> lock(topology_mutex);
+  bool overridden = !topology_override.empty();
+  for (size_t node = 0; node < topology_override.size(); node++) {
+    if (!topology_override[node].empty()) {
+      nodes.push_back(node);
+    }
+  }
+  lock.unlock();
+  if (!overridden) {
+#ifdef HAVE_LIBNUMA
+    if (numa_available() >= 0) {
+      for (int node = 0; node <= numa_max_node(); node++) {
+        if (numa_bitmask_isbitset(numa_nodes_ptr, node) && !NumaNodeCpus(node).empty()) {
+          nodes.push_back(node);
+        }
+      }
+    }
+#else
+    nodes = ReadList("/sys/devices/system/node/has_cpu");
+#endif
+  }
+  if (nodes.empty()) {
+    nodes.push_back(0);
+  }
+  return nodes;
+}
+
+std::vector<int> NumaNodeCpus(int node) {
+  {
+    std::lock_guard<std::mutex> lock(topology_mutex);
+    if (!topology_override.empty()) {
+      if (node < 0 || (size_t) node >= topology_override.size()) {
+        return {};
+      }
+      return topology_override[node];
+    }
+  }
+#ifdef HAVE_LIBNUMA
+  std::vector<int> cpus;
+  if (numa_available() < 0) {
+    return cpus;
+  }
+  struct bitmask *mask = numa_allocate_cpumask();
+  if (numa_node_to_cpus(node, mask) == 0) {
+    for (unsigned int cpu = 0; cpu < mask->size; cpu++) {
+      if (numa_bitmask_isbitset(mask, cpu)) {
+        cpus.push_back(cpu);
+      }
+    }
+  }
+  numa_free_cpumask(mask);
+  return cpus;
+#else
+  return ReadList("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+#endif
+}
+
+bool BindThreadToNode(int node) {
+  std::vector<int> cpus = NumaNodeCpus(node);
+  if (cpus.empty()) {
+    return false;
+  }
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : cpus) {
+    CPU_SET(cpu, &set);
+  }
+  return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+bool BindMemoryToNode(void *ptr, size_t bytes, int node) {
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  uintptr_t begin = ((uintptr_t) ptr + page_size - 1) / page_size * page_size;
+  uintptr_t end = ((uintptr_t) ptr + bytes) / page_size * page_size;
+  if (end <= begin) {
+    return true;
+  }
+#ifdef HAVE_LIBNUMA
+  // libnuma only reports a node it cannot bind to on stderr
+  if (numa_available() < 0 || node < 0 || node > numa_max_node() ||
+      !numa_bitmask_isbitset(numa_all_nodes_ptr, node)) {
+    return false;
+  }
+  numa_tonode_memory((void *) begin, end - begin, node);
+  return true;
+#else
+  // The kernel reads one bit less than maxnode
+  const int NODEMASK_BITS = 8 * sizeof(unsigned long);
+  if (node < 0 || node >= NODEMASK_BITS - 1) {
+    return false;
+  }
+  unsigned long nodemask = 1UL << node;
+  return syscall(SYS_mbind, begin, end - begin, MPOL_PREFERRED, &nodemask, NODEMASK_BITS, 0) == 0;
+#endif
+}
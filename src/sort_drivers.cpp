@@ -0,0 +1,831 @@
+#include "sort_drivers.h"
+#include "common.h"
+#include "execution_context.h"
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <fcntl.h>
+#include <limits>
+#include <memory>
+#include <unistd.h>
+
+template<typename InType>
+struct KWayMerge {
+  std::vector<const InType *> runs;
+  std::vector<size_t> sizes;
+  InType *out;
+  size_t N;
+  size_t segments;
+  size_t tile;
+  // Two levels of scratch per segment, allocated on the calling thread
+  InType *scratch;
+  size_t scratch_size;
+  void (*merge_segment)(InType *, size_t, InType *, size_t, InType *);
+
+  size_t Boundary(size_t s) const {
+    const size_t ALIGN = 64 / sizeof(InType);
+    return s == segments ? N : s * (N / segments) / ALIGN * ALIGN;
+  }
+};
+
+template<typename InType>
+static void KWayMergeItem(void *arg, size_t s) {
+  const KWayMerge<InType> *m = (const KWayMerge<InType> *) arg;
+  const size_t ALIGN = 64 / sizeof(InType);
+  size_t parts = m->runs.size();
+  size_t end = m->Boundary(s + 1);
+  std::vector<size_t> lo(parts);
+  std::vector<size_t> take(parts);
+  std::vector<const InType *> rest(parts);
+  std::vector<size_t> rest_sizes(parts);
+  MultiCoRank(m->Boundary(s), m->runs.data(), m->sizes.data(), parts, lo.data());
+
+  // Pieces of a level are stored at aligned offsets, two levels at a time
+  InType *scratch[2] = {&m->scratch[2 * s * m->scratch_size], &m->scratch[(2 * s + 1) * m->scratch_size]};
+  std::vector<std::pair<InType *, size_t>> pieces(parts);
+  for (size_t k = m->Boundary(s); k < end; k += m->tile) {
+    size_t n = std::min(m->tile, end - k);
+    // Past lo, a run contributes at most n keys to the tile
+    for (size_t p = 0; p < parts; p++) {
+      rest[p] = m->runs[p] + lo[p];
+      rest_sizes[p] = std::min(n, m->sizes[p] - lo[p]);
+    }
+    MultiCoRank(n, rest.data(), rest_sizes.data(), parts, take.data());
+    for (size_t p = 0; p < parts; p++) {
+      pieces[p] = {(InType *) rest[p], take[p]};
+      lo[p] += take[p];
+    }
+    // Empty pieces are kept so the levels always pair up
+    for (int side = 0; pieces.size() > 2; side ^= 1) {
+      size_t offset = 0;
+      for (size_t i = 0; i < pieces.size() / 2; i++) {
+        std::pair<InType *, size_t> a = pieces[2 * i];
+        std::pair<InType *, size_t> b = pieces[2 * i + 1];
+        m->merge_segment(a.first, a.second, b.first, b.second, &scratch[side][offset]);
+        pieces[i] = {&scratch[side][offset], a.second + b.second};
+        offset += (a.second + b.second + ALIGN - 1) / ALIGN * ALIGN;
+      }
+      pieces.resize(pieces.size() / 2);
+    }
+    if (pieces.size() == 2) {
+      m->merge_segment(pieces[0].first, pieces[0].second, pieces[1].first, pieces[1].second, &m->out[k]);
+    } else {
+      std::copy(pieces[0].first, pieces[0].first + pieces[0].second, &m->out[k]);
+    }
+    pieces.resize(parts);
+  }
+}
+
+template<typename InType>
+void KWayMergeRuns(std::vector<const InType *> runs, std::vector<size_t> sizes, InType *out,
+                   void (*merge_segment)(InType *, size_t, InType *, size_t, InType *)) {
+  const size_t ALIGN = 64 / sizeof(InType);
+  // Empty runs make up a power of two, so the pieces of a tile always pair up
+  while ((runs.size() & (runs.size() - 1)) != 0) {
+    runs.push_back(nullptr);
+    sizes.push_back(0);
+  }
+  KWayMerge<InType> merge;
+  merge.runs = runs;
+  merge.sizes = sizes;
+  merge.out = out;
+  merge.N = 0;
+  for (size_t size : sizes) {
+    merge.N += size;
+  }
+  merge.segments = ParallelThreads();
+  merge.tile = std::max(CacheSize(2) / (4 * sizeof(InType)) / ALIGN * ALIGN, runs.size() * ALIGN);
+  merge.scratch_size = merge.tile + runs.size() * ALIGN;
+  merge.merge_segment = merge_segment;
+  aligned_init(merge.scratch, 2 * merge.segments * merge.scratch_size);
+  if (2 * merge.N * sizeof(InType) > StreamingThreshold()) {
+    StreamingParallelFor(merge.segments, KWayMergeItem<InType>, &merge, 2 * merge.N * sizeof(InType));
+  } else {
+    ParallelFor(merge.segments, KWayMergeItem<InType>, &merge);
+  }
+  aligned_free(merge.scratch, 2 * merge.segments * merge.scratch_size);
+}
+
+template<typename InType>
+struct PartitionGraph {
+  InType *arr;
+  InType *buffer;
+  size_t slice_size;
+  bool (*sort_slice)(size_t N, InType *arr, InType *buffer);
+  bool in_buffer;
+};
+
+template<typename InType>
+static void PartitionItem(void *arg, size_t p) {
+  PartitionGraph<InType> *g = (PartitionGraph<InType> *) arg;
+  size_t start = p * g->slice_size;
+  bool in_buffer = g->sort_slice(g->slice_size, &g->arr[start], &g->buffer[start]);
+  // Equal slices take the same passes, so all end up on the same side
+  if (p == 0) {
+    g->in_buffer = in_buffer;
+  }
+}
+
+template<typename InType>
+void PartitionedSort(size_t N, InType *&arr, size_t block_size,
+                     bool (*sort_slice)(size_t N, InType *arr, InType *buffer),
+                     void (*merge_segment)(InType *, size_t, InType *, size_t, InType *)) {
+  ExecutionScope scope;
+  size_t threads = ParallelThreads();
+  size_t parts = 1;
+  while (2 * parts <= threads && N / (2 * parts) >= block_size) {
+    parts *= 2;
+  }
+  InType *buffer;
+  aligned_init(buffer, N);
+  if (parts == 1) {
+    if (sort_slice(N, arr, buffer)) {
+      arr = buffer;
+    } else {
+      aligned_free(buffer, N);
+    }
+    return;
+  }
+
+  PartitionGraph<InType> graph = {arr, buffer, N / parts, sort_slice, false};
+  ParallelFor(parts, PartitionItem<InType>, &graph, parts);
+
+  InType *sorted = graph.in_buffer ? buffer : arr;
+  std::vector<const InType *> runs;
+  for (size_t p = 0; p < parts; p++) {
+    runs.push_back(&sorted[p * graph.slice_size]);
+  }
+  KWayMergeRuns(runs, std::vector<size_t>(parts, graph.slice_size), graph.in_buffer ? arr : buffer, merge_segment);
+  if (graph.in_buffer) {
+    aligned_free(buffer, N);
+  } else {
+    arr = buffer;
+  }
+}
+
+// Regular samples a rank contributes per rank of a distributed sort
+const size_t DISTRIBUTED_SAMPLES_PER_RANK = 16;
+
+// Keys are ordered by value, then rank and position, so splitters cut runs of
+// equal keys between ranks as well. A sample stands for weight keys of its rank
+template<typename InType>
+struct Sample {
+  InType key;
+  uint32_t rank;
+  uint64_t position;
+  uint64_t weight;
+
+  bool operator<(const Sample &other) const {
+    if (key != other.key) {
+      return key < other.key;
+    }
+    return rank != other.rank ? rank < other.rank : position < other.position;
+  }
+};
+
+// Keys of the sorted shard of rank that are ordered before the splitter
+template<typename InType>
+static size_t SplitterRank(const InType *keys, size_t N, uint32_t rank, const Sample<InType> &splitter) {
+  if (rank < splitter.rank) {
+    return std::upper_bound(keys, keys + N, splitter.key) - keys;
+  } else if (rank > splitter.rank) {
+    return std::lower_bound(keys, keys + N, splitter.key) - keys;
+  }
+  return splitter.position;
+}
+
+template<typename InType>
+InType *DistributedSort(size_t N, InType *arr, Transport &transport, size_t &result_N,
+                        void (*sort)(size_t N, InType *&arr),
+                        void (*merge_segment)(InType *, size_t, InType *, size_t, InType *)) {
+  ExecutionScope scope;
+  int P = transport.Size();
+  uint32_t rank = transport.Rank();
+  InType *sorted = arr;
+  if (N > 0) {
+    sort(N, sorted);
+  }
+
+  size_t samples = std::min(N, DISTRIBUTED_SAMPLES_PER_RANK * P);
+  std::vector<Sample<InType>> local(samples);
+  for (size_t i = 0; i < samples; i++) {
+    uint64_t position = (2 * i + 1) * N / (2 * samples);
+    uint64_t weight = (i + 1) * N / samples - i * N / samples;
+    local[i] = {sorted[position], rank, position, weight};
+  }
+  std::unique_ptr<char[]> received;
+  std::vector<size_t> bytes = AllToAll(transport, std::vector<const void *>(P, local.data()),
+                                       std::vector<size_t>(P, samples * sizeof(Sample<InType>)), received);
+  Sample<InType> *all = (Sample<InType> *) received.get();
+  size_t total = 0;
+  for (size_t b : bytes) {
+    total += b / sizeof(Sample<InType>);
+  }
+  // No rank has keys: there are no splitters to pick, and all ranks agree
+  if (total == 0) {
+    result_N = 0;
+    return nullptr;
+  }
+  std::sort(all, all + total);
+
+  // Splitter q is the first sample whose midpoint in the cumulative weight,
+  // half of its own weight past the samples before it, reaches q / P of it all
+  uint64_t weight = 0;
+  for (size_t i = 0; i < total; i++) {
+    weight += all[i].weight;
+  }
+  std::vector<size_t> splitters(P);
+  uint64_t before = 0;
+  size_t i = 0;
+  for (int q = 1; q < P; q++) {
+    uint64_t target = q * weight / P;
+    while (i + 1 < total && 2 * before + all[i].weight < 2 * target) {
+      before += all[i].weight;
+      i++;
+    }
+    splitters[q] = i;
+  }
+
+  std::vector<const void *> pieces(P);
+  std::vector<size_t> piece_bytes(P);
+  size_t begin = 0;
+  for (int q = 0; q < P; q++) {
+    size_t end = q == P - 1 ? N : SplitterRank(sorted, N, rank, all[splitters[q + 1]]);
+    pieces[q] = &sorted[begin];
+    piece_bytes[q] = (end - begin) * sizeof(InType);
+    begin = end;
+  }
+  bytes = AllToAll(transport, pieces, piece_bytes, received);
+  if (sorted != arr) {
+    aligned_free(sorted, N);
+  }
+
+  std::vector<const InType *> runs;
+  std::vector<size_t> sizes;
+  result_N = 0;
+  for (int q = 0; q < P; q++) {
+    runs.push_back((const InType *) &received[result_N * sizeof(InType)]);
+    sizes.push_back(bytes[q] / sizeof(InType));
+    result_N += sizes.back();
+  }
+  if (result_N == 0) {
+    return nullptr;
+  }
+  InType *result;
+  aligned_init(result, result_N);
+  KWayMergeRuns(runs, sizes, result, merge_segment);
+  return result;
+}
+
+// Values per unit of work of a SlicedSort, a few microseconds of merging
+const size_t SLICED_SORT_UNIT = 1 << 14;
+
+template<typename T>
+SlicedSortDriver<T>::SlicedSortDriver(size_t N, T *arr, size_t block_size, size_t unit_run_size,
+                                      void (*sort_block)(T *&, size_t),
+                                      void (*merge_run_pair)(T *, T *, size_t, size_t, size_t, size_t))
+    : arr_(arr), N_(N), unit_run_size_(unit_run_size), block_size_(block_size),
+      chunk_size_(CacheBlockSize(N, sizeof(T), block_size)), sort_block_(sort_block),
+      merge_run_pair_(merge_run_pair), chunk_(0), run_size_(0), offset_(0), unit_us_(0), result_taken_(false) {
+  assert(N % block_size == 0);
+  unit_size_ = std::min(SLICED_SORT_UNIT, chunk_size_);
+  aligned_init(buffer_, N);
+}
+
+template<typename T>
+SlicedSortDriver<T>::~SlicedSortDriver() {
+  if (!result_taken_) {
+    aligned_free(buffer_, N_);
+  }
+}
+
+template<typename T>
+bool SlicedSortDriver<T>::Done() const {
+  return chunk_ == N_ / chunk_size_ && run_size_ == N_;
+}
+
+template<typename T>
+T *SlicedSortDriver<T>::Result() {
+  assert(Done());
+  T *result = Side(N_);
+  result_taken_ = result_taken_ || result == buffer_;
+  return result;
+}
+
+template<typename T>
+T *SlicedSortDriver<T>::Side(size_t run_size) const {
+  int passes = 0;
+  for (size_t size = unit_run_size_; size < run_size; size *= 2) {
+    passes++;
+  }
+  return passes % 2 == 0 ? arr_ : buffer_;
+}
+
+template<typename T>
+void SlicedSortDriver<T>::RunUnit() {
+  bool in_chunk = chunk_ < N_ / chunk_size_;
+  size_t base = in_chunk ? chunk_ * chunk_size_ : 0;
+  size_t span = in_chunk ? chunk_size_ : N_;
+  size_t window = base + offset_;
+  if (run_size_ == 0) {
+    T *arr = arr_;
+    for (size_t j = window; j < window + unit_size_; j += block_size_) {
+      sort_block_(arr, j);
+    }
+  } else if (2 * run_size_ <= unit_size_) {
+    for (size_t start = window; start < window + unit_size_; start += 2 * run_size_) {
+      merge_run_pair_(Side(run_size_), Side(2 * run_size_), start, run_size_, 0, 1);
+    }
+  } else {
+    size_t start = window / (2 * run_size_) * (2 * run_size_);
+    merge_run_pair_(Side(run_size_), Side(2 * run_size_), start, run_size_, (window - start) / unit_size_,
+                    2 * run_size_ / unit_size_);
+  }
+
+  offset_ += unit_size_;
+  if (offset_ < span) {
+    return;
+  }
+  offset_ = 0;
+  run_size_ = run_size_ == 0 ? unit_run_size_ : 2 * run_size_;
+  if (in_chunk && run_size_ == chunk_size_) {
+    chunk_++;
+    run_size_ = chunk_ < N_ / chunk_size_ ? 0 : chunk_size_;
+  }
+}
+
+template<typename T>
+bool SlicedSortDriver<T>::Step(int64_t budget_us, size_t max_values) {
+  auto start = std::chrono::steady_clock::now();
+  size_t values = 0;
+  while (!Done()) {
+    auto unit_start = std::chrono::steady_clock::now();
+    RunUnit();
+    auto now = std::chrono::steady_clock::now();
+    // Decaying maximum, so one slow unit does not end every later step early
+    double unit_us = std::chrono::duration<double, std::micro>(now - unit_start).count();
+    unit_us_ = std::max(unit_us, unit_us_ * 0.875);
+    values += unit_size_;
+    double elapsed_us = std::chrono::duration<double, std::micro>(now - start).count();
+    if ((max_values > 0 && values >= max_values) || elapsed_us + unit_us_ > budget_us) {
+      break;
+    }
+  }
+  return Done();
+}
+
+// Merge segments of the pipeline start on a cache line, so that the vector
+// stores of the merge stay aligned
+const size_t PIPELINE_MERGE_GRAIN = 1 << 16;
+
+template<typename T>
+static T PadKey() {
+  return std::numeric_limits<T>::has_infinity ? std::numeric_limits<T>::infinity() : std::numeric_limits<T>::max();
+}
+
+template<typename T>
+struct MergeTwoItems {
+  T *a;
+  size_t na;
+  T *b;
+  size_t nb;
+  T *out;
+  size_t segments;
+  void (*merge_segment)(T *, size_t, T *, size_t, T *);
+
+  size_t Boundary(size_t s) const {
+    const size_t ALIGN = 64 / sizeof(T);
+    return s == segments ? na + nb : s * ((na + nb) / segments) / ALIGN * ALIGN;
+  }
+};
+
+template<typename T>
+static void MergeTwoItem(void *arg, size_t s) {
+  const MergeTwoItems<T> *items = (const MergeTwoItems<T> *) arg;
+  size_t k0 = items->Boundary(s);
+  size_t k1 = items->Boundary(s + 1);
+  size_t i0 = CoRank(k0, items->a, items->na, items->b, items->nb, 1);
+  size_t i1 = CoRank(k1, items->a, items->na, items->b, items->nb, 1);
+  items->merge_segment(&items->a[i0], i1 - i0, &items->b[k0 - i0], (k1 - i1) - (k0 - i0), &items->out[k0]);
+}
+
+template<typename T>
+SortPipelineDriver<T>::SortPipelineDriver(size_t chunk_size, int workers, size_t queue_size, size_t block_size,
+                                          void (*sort_block)(T *&, size_t), void (*merge_runs)(T *&, size_t),
+                                          void (*merge_segment)(T *, size_t, T *, size_t, T *))
+    : chunk_size_(chunk_size), queue_size_(queue_size > 0 ? queue_size : 2 * std::max(workers, 1)),
+      block_size_(block_size), sort_block_(sort_block), merge_runs_(merge_runs), merge_segment_(merge_segment),
+      allocator_(CurrentAllocator()), fill_(nullptr), filled_(0), pushed_(0), closed_(false), workers_done_(false),
+      pending_(64, Run{nullptr, 0}), finished_(false) {
+  assert(chunk_size >= block_size && (chunk_size & (chunk_size - 1)) == 0);
+  for (int w = 0; w < std::max(workers, 1); w++) {
+    workers_.emplace_back(&SortPipelineDriver<T>::Work, this);
+  }
+  merger_ = std::thread(&SortPipelineDriver<T>::MergeWork, this);
+}
+
+template<typename T>
+SortPipelineDriver<T>::~SortPipelineDriver() {
+  if (!finished_) {
+    size_t N;
+    T *result = Finish(N);
+    if (result != nullptr) {
+      ScopedAllocator scoped_allocator(allocator_);
+      aligned_free(result, N);
+    }
+  }
+}
+
+template<typename T>
+Allocator SortPipelineDriver<T>::SerializedAllocator() {
+  return {SerializedAllocate, SerializedDeallocate, this};
+}
+
+template<typename T>
+void *SortPipelineDriver<T>::SerializedAllocate(size_t bytes, size_t alignment, void *context) {
+  auto pipeline = (SortPipelineDriver<T> *) context;
+  std::lock_guard<std::mutex> lock(pipeline->allocator_mutex_);
+  return pipeline->allocator_.allocate(bytes, alignment, pipeline->allocator_.context);
+}
+
+template<typename T>
+void SortPipelineDriver<T>::SerializedDeallocate(void *ptr, size_t bytes, void *context) {
+  auto pipeline = (SortPipelineDriver<T> *) context;
+  std::lock_guard<std::mutex> lock(pipeline->allocator_mutex_);
+  pipeline->allocator_.deallocate(ptr, bytes, pipeline->allocator_.context);
+}
+
+template<typename T>
+void SortPipelineDriver<T>::Push(const T *keys, size_t n) {
+  ScopedAllocator scoped_allocator(SerializedAllocator());
+  std::lock_guard<std::mutex> lock(fill_mutex_);
+  pushed_ += n;
+  while (n > 0) {
+    if (fill_ == nullptr) {
+      aligned_init(fill_, chunk_size_);
+      filled_ = 0;
+    }
+    size_t take = std::min(n, chunk_size_ - filled_);
+    std::copy(keys, keys + take, fill_ + filled_);
+    filled_ += take;
+    keys += take;
+    n -= take;
+    if (filled_ == chunk_size_) {
+      // Producers wait here while the queue is full
+      Enqueue(fill_);
+      fill_ = nullptr;
+    }
+  }
+}
+
+template<typename T>
+void SortPipelineDriver<T>::Enqueue(T *chunk) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  dequeued_.wait(lock, [this]() { return chunks_.size() < queue_size_; });
+  chunks_.push_back(chunk);
+  queued_.notify_one();
+}
+
+template<typename T>
+void SortPipelineDriver<T>::SortChunk(T *&keys, size_t n) {
+  T *input = keys;
+  for (size_t j = 0; j < n; j += block_size_) {
+    sort_block_(keys, j);
+  }
+  merge_runs_(keys, n);
+  if (keys != input) {
+    aligned_free(input, n);
+  }
+}
+
+template<typename T>
+void SortPipelineDriver<T>::Work() {
+  ScopedAllocator scoped_allocator(SerializedAllocator());
+  // One thread per chunk, the workers are the parallelism
+  ExecutionContext context;
+  context.threads = 1;
+  ScopedExecutionContext scoped(context);
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    queued_.wait(lock, [this]() { return !chunks_.empty() || closed_; });
+    if (chunks_.empty()) {
+      return;
+    }
+    T *chunk = chunks_.front();
+    chunks_.pop_front();
+    dequeued_.notify_one();
+    lock.unlock();
+    SortChunk(chunk, chunk_size_);
+    lock.lock();
+    runs_.push_back({chunk, chunk_size_});
+    sorted_.notify_one();
+  }
+}
+
+template<typename T>
+void SortPipelineDriver<T>::MergeWork() {
+  ScopedAllocator scoped_allocator(SerializedAllocator());
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    sorted_.wait(lock, [this]() { return !runs_.empty() || workers_done_; });
+    if (runs_.empty()) {
+      return;
+    }
+    Run run = runs_.front();
+    runs_.pop_front();
+    lock.unlock();
+    // Binary counter over the chunks: merges stay balanced whatever order the
+    // chunks finish in
+    size_t level = 0;
+    while (pending_[level].keys != nullptr) {
+      run = Merge(pending_[level], run, 1);
+      pending_[level] = {nullptr, 0};
+      level++;
+    }
+    pending_[level] = run;
+    lock.lock();
+  }
+}
+
+template<typename T>
+typename SortPipelineDriver<T>::Run SortPipelineDriver<T>::Merge(const Run &a, const Run &b, int threads) {
+  Run out = {nullptr, a.n + b.n};
+  aligned_init(out.keys, out.n);
+  MergeTwoItems<T> items = {a.keys, a.n, b.keys, b.n, out.keys, std::max(out.n / PIPELINE_MERGE_GRAIN, (size_t) 1),
+                            merge_segment_};
+  ParallelFor(items.segments, MergeTwoItem<T>, &items, threads);
+  aligned_free(a.keys, a.n);
+  aligned_free(b.keys, b.n);
+  return out;
+}
+
+template<typename T>
+T *SortPipelineDriver<T>::Finish(size_t &N) {
+  ScopedAllocator scoped_allocator(SerializedAllocator());
+  finished_ = true;
+  std::vector<Run> left;
+  {
+    std::lock_guard<std::mutex> lock(fill_mutex_);
+    N = pushed_;
+    if (fill_ != nullptr) {
+      // The last chunk is sorted padded to a power of two and kept at its size
+      size_t size = block_size_;
+      while (size < filled_) {
+        size *= 2;
+      }
+      T *padded;
+      aligned_init(padded, size);
+      std::copy(fill_, fill_ + filled_, padded);
+      std::fill(padded + filled_, padded + size, PadKey<T>());
+      SortChunk(padded, size);
+      Run last = {nullptr, filled_};
+      aligned_init(last.keys, last.n);
+      std::copy(padded, padded + filled_, last.keys);
+      aligned_free(padded, size);
+      aligned_free(fill_, chunk_size_);
+      fill_ = nullptr;
+      left.push_back(last);
+    }
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closed_ = true;
+    queued_.notify_all();
+  }
+  for (std::thread &worker : workers_) {
+    worker.join();
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    workers_done_ = true;
+    sorted_.notify_all();
+  }
+  merger_.join();
+
+  for (const Run &run : pending_) {
+    if (run.keys != nullptr) {
+      left.push_back(run);
+    }
+  }
+  if (left.empty()) {
+    return nullptr;
+  }
+  // Smallest runs first
+  while (left.size() > 1) {
+    std::sort(left.begin(), left.end(), [](const Run &a, const Run &b) { return a.n > b.n; });
+    Run b = left.back();
+    left.pop_back();
+    Run a = left.back();
+    left.pop_back();
+    left.push_back(Merge(a, b, 0));
+  }
+  return left[0].keys;
+}
+
+// Runs are sorted in memory in chunks of at least this many keys
+const size_t EXTERNAL_MIN_RUN = 1 << 10;
+// Smallest read buffer of a run in an external merge, in bytes
+const size_t EXTERNAL_MIN_BUFFER = 1 << 20;
+
+struct RunFile {
+  std::string path;
+  size_t n;
+};
+
+static std::string RunPath(const std::string &dir, size_t id) {
+  return dir + "/ultrasort-" + std::to_string(getpid()) + "-" + std::to_string(id) + ".run";
+}
+
+/**
+ * Merges sorted run files into path. Each run is read ahead into two buffers,
+ * and every round merges, from all runs, the keys up to the smallest last key
+ * of the buffered windows: the later keys of each run are no smaller than its
+ * window's last key, so none of them can precede the keys merged. The round's
+ * output goes to a writer thread while the next round merges.
+ * @param index: builds the index after the keys, nullptr for just the keys
+ */
+template<typename InType>
+static void MergeRunFiles(const std::vector<RunFile> &runs, const std::string &path, size_t memory_bytes,
+                          RunIndexWriter<InType> *index,
+                          void (*merge_segment)(InType *, size_t, InType *, size_t, InType *)) {
+  size_t k = runs.size();
+  // Two read buffers per run, two output buffers as large as all windows
+  size_t buffer_bytes = std::max(EXTERNAL_MIN_BUFFER, memory_bytes / (4 * k)) / 4096 * 4096;
+  // Declared before the readers, so their threads stop before the files close
+  std::vector<std::unique_ptr<ScopedFd>> fds;
+  std::vector<std::unique_ptr<PrefetchReader>> readers;
+  std::vector<const InType *> windows(k);
+  std::vector<size_t> sizes(k);
+  for (size_t r = 0; r < k; r++) {
+    fds.emplace_back(new ScopedFd(OpenFile(runs[r].path, O_RDONLY)));
+    readers.emplace_back(new PrefetchReader(fds[r]->Get(), 0, runs[r].n * sizeof(InType), buffer_bytes));
+    windows[r] = (const InType *) readers[r]->Next(sizes[r]);
+    sizes[r] /= sizeof(InType);
+  }
+  ScopedFd out(OpenFile(path, O_WRONLY | O_CREAT | O_TRUNC));
+  StreamWriter writer(out.Get(), k * buffer_bytes);
+
+  std::vector<size_t> take(k);
+  while (true) {
+    const InType *bound = nullptr;
+    for (size_t r = 0; r < k; r++) {
+      if (sizes[r] > 0 && (bound == nullptr || windows[r][sizes[r] - 1] < *bound)) {
+        bound = &windows[r][sizes[r] - 1];
+      }
+    }
+    if (bound == nullptr) {
+      break;
+    }
+    InType limit = *bound;
+    size_t total = 0;
+    for (size_t r = 0; r < k; r++) {
+      take[r] = std::upper_bound(windows[r], windows[r] + sizes[r], limit) - windows[r];
+      total += take[r];
+    }
+    KWayMergeRuns(windows, take, (InType *) writer.Buffer(), merge_segment);
+    if (index != nullptr) {
+      index->Add((const InType *) writer.Buffer(), total);
+    }
+    writer.Commit(total * sizeof(InType));
+    for (size_t r = 0; r < k; r++) {
+      windows[r] += take[r];
+      sizes[r] -= take[r];
+      if (sizes[r] == 0 && take[r] > 0) {
+        windows[r] = (const InType *) readers[r]->Next(sizes[r]);
+        sizes[r] /= sizeof(InType);
+      }
+    }
+  }
+  writer.Close();
+  if (index != nullptr) {
+    index->Finish(out.Get());
+  }
+}
+
+template<typename InType>
+void ExternalSort(const std::string &input, const std::string &output, const ExternalSortOptions &options,
+                  void (*sort)(size_t N, InType *&arr),
+                  void (*merge_segment)(InType *, size_t, InType *, size_t, InType *)) {
+  ExecutionScope scope;
+  ScopedFd in(OpenFile(input, O_RDONLY));
+  size_t N = FileSize(in.Get()) / sizeof(InType);
+  std::string dir = options.temp_dir;
+  if (dir.empty()) {
+    size_t slash = output.rfind('/');
+    dir = slash == std::string::npos ? "." : output.substr(0, std::max(slash, (size_t) 1));
+  }
+  size_t run_size = EXTERNAL_MIN_RUN;
+  while (2 * (2 * run_size) * sizeof(InType) <= options.memory_bytes) {
+    run_size *= 2;
+  }
+  size_t block_bytes = std::max(options.run_block_bytes / sizeof(InType), (size_t) 1) * sizeof(InType);
+
+  std::vector<RunFile> runs;
+  // Temporary run files created so far, removed again if the sort fails
+  std::vector<std::string> temp_paths;
+  InType *keys = nullptr;
+  try {
+    // Run generation, the last run is padded to a power of two for the sort
+    aligned_init(keys, run_size);
+    for (size_t start = 0; start < N || runs.empty(); start += run_size) {
+      size_t n = std::min(run_size, N - start);
+      ReadFully(in.Get(), keys, n * sizeof(InType), start * sizeof(InType));
+      size_t size = EXTERNAL_MIN_RUN;
+      while (size < n) {
+        size *= 2;
+      }
+      std::fill(keys + n, keys + size, PadKey<InType>());
+      InType *sorted = keys;
+      sort(size, sorted);
+      if (sorted != keys) {
+        std::copy(sorted, sorted + n, keys);
+        aligned_free(sorted, size);
+      }
+      RunFile run = {N <= run_size ? output : RunPath(dir, runs.size()), n};
+      if (run.path != output) {
+        temp_paths.push_back(run.path);
+      }
+      ScopedFd fd(OpenFile(run.path, O_WRONLY | O_CREAT | O_TRUNC));
+      WriteFully(fd.Get(), keys, n * sizeof(InType), 0);
+      if (run.path != output || options.indexed_output) {
+        RunIndexWriter<InType> index(block_bytes);
+        index.Add(keys, n);
+        index.Finish(fd.Get());
+      }
+      runs.push_back(run);
+    }
+    aligned_free(keys, run_size);
+    keys = nullptr;
+
+    // Past memory_bytes / (4 * EXTERNAL_MIN_BUFFER) runs, the minimal buffers
+    // of a merge would overrun memory_bytes
+    size_t fan_in = std::max(std::min(options.max_fan_in, options.memory_bytes / (4 * EXTERNAL_MIN_BUFFER)),
+                             (size_t) 2);
+    size_t next_id = runs.size();
+    while (runs.size() > 1) {
+      bool last = runs.size() <= fan_in;
+      std::vector<RunFile> merged;
+      for (size_t g = 0; g < runs.size(); g += fan_in) {
+        std::vector<RunFile> group(runs.begin() + g, runs.begin() + std::min(g + fan_in, runs.size()));
+        if (group.size() == 1) {
+          merged.push_back(group[0]);
+          continue;
+        }
+        RunFile run = {last ? output : RunPath(dir, next_id++), 0};
+        if (!last) {
+          temp_paths.push_back(run.path);
+        }
+        for (const RunFile &r : group) {
+          run.n += r.n;
+        }
+        RunIndexWriter<InType> index(block_bytes);
+        MergeRunFiles(group, run.path, options.memory_bytes, !last || options.indexed_output ? &index : nullptr,
+                      merge_segment);
+        for (const RunFile &r : group) {
+          unlink(r.path.c_str());
+        }
+        merged.push_back(run);
+      }
+      runs = merged;
+    }
+  } catch (...) {
+    if (keys != nullptr) {
+      aligned_free(keys, run_size);
+    }
+    // Runs merged already are gone, unlink fails harmlessly on them
+    for (const std::string &path : temp_paths) {
+      unlink(path.c_str());
+    }
+    throw;
+  }
+}
+
+template void KWayMergeRuns<int>(std::vector<const int *> runs, std::vector<size_t> sizes, int *out, void (*merge_segment)(int *, size_t, int *, size_t, int *));
+template void KWayMergeRuns<int64_t>(std::vector<const int64_t *> runs, std::vector<size_t> sizes, int64_t *out, void (*merge_segment)(int64_t *, size_t, int64_t *, size_t, int64_t *));
+template void KWayMergeRuns<float>(std::vector<const float *> runs, std::vector<size_t> sizes, float *out, void (*merge_segment)(float *, size_t, float *, size_t, float *));
+template void KWayMergeRuns<double>(std::vector<const double *> runs, std::vector<size_t> sizes, double *out, void (*merge_segment)(double *, size_t, double *, size_t, double *));
+
+template void PartitionedSort<int>(size_t N, int *&arr, size_t block_size, bool (*sort_slice)(size_t, int *, int *), void (*merge_segment)(int *, size_t, int *, size_t, int *));
+template void PartitionedSort<int64_t>(size_t N, int64_t *&arr, size_t block_size, bool (*sort_slice)(size_t, int64_t *, int64_t *), void (*merge_segment)(int64_t *, size_t, int64_t *, size_t, int64_t *));
+template void PartitionedSort<float>(size_t N, float *&arr, size_t block_size, bool (*sort_slice)(size_t, float *, float *), void (*merge_segment)(float *, size_t, float *, size_t, float *));
+template void PartitionedSort<double>(size_t N, double *&arr, size_t block_size, bool (*sort_slice)(size_t, double *, double *), void (*merge_segment)(double *, size_t, double *, size_t, double *));
+
+template int *DistributedSort<int>(size_t N, int *arr, Transport &transport, size_t &result_N, void (*sort)(size_t, int *&), void (*merge_segment)(int *, size_t, int *, size_t, int *));
+template int64_t *DistributedSort<int64_t>(size_t N, int64_t *arr, Transport &transport, size_t &result_N, void (*sort)(size_t, int64_t *&), void (*merge_segment)(int64_t *, size_t, int64_t *, size_t, int64_t *));
+template float *DistributedSort<float>(size_t N, float *arr, Transport &transport, size_t &result_N, void (*sort)(size_t, float *&), void (*merge_segment)(float *, size_t, float *, size_t, float *));
+template double *DistributedSort<double>(size_t N, double *arr, Transport &transport, size_t &result_N, void (*sort)(size_t, double *&), void (*merge_segment)(double *, size_t, double *, size_t, double *));
+
+template void ExternalSort<int>(const std::string &input, const std::string &output, const ExternalSortOptions &options, void (*sort)(size_t, int *&), void (*merge_segment)(int *, size_t, int *, size_t, int *));
+template void ExternalSort<int64_t>(const std::string &input, const std::string &output, const ExternalSortOptions &options, void (*sort)(size_t, int64_t *&), void (*merge_segment)(int64_t *, size_t, int64_t *, size_t, int64_t *));
+template void ExternalSort<float>(const std::string &input, const std::string &output, const ExternalSortOptions &options, void (*sort)(size_t, float *&), void (*merge_segment)(float *, size_t, float *, size_t, float *));
+template void ExternalSort<double>(const std::string &input, const std::string &output, const ExternalSortOptions &options, void (*sort)(size_t, double *&), void (*merge_segment)(double *, size_t, double *, size_t, double *));
+
+template class SlicedSortDriver<int>;
+template class SlicedSortDriver<int64_t>;
+template class SlicedSortDriver<float>;
+template class SlicedSortDriver<double>;
+
+template class SortPipelineDriver<int>;
+template class SortPipelineDriver<int64_t>;
+template class SortPipelineDriver<float>;
+template class SortPipelineDriver<double>;
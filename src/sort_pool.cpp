@@ -0,0 +1,97 @@
+#include "sort_pool.h"
+#include "common.h"
+#include <algorithm>
+
+SortPool::SortPool(int threads) : stopping_(false) {
+  for (int t = 0; t < std::max(threads, 1); t++) {
+    workers_.emplace_back(&SortPool::Work, this);
+  }
+}
+
+SortPool::~SortPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  wake_.notify_all();
+  for (std::thread &worker : workers_) {
+    worker.join();
+  }
+}
+
+void SortPool::Submit(std::function<void()> job) {
+  Allocator allocator = CurrentAllocator();
+  Executor executor = GetExecutor();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    jobs_.push_back([job, allocator, executor]() {
+      ScopedAllocator scoped_allocator(allocator);
+      ExecutionContext context;
+      context.executor = executor;
+      ScopedExecutionContext scoped_context(context);
+      job();
+    });
+  }
+  wake_.notify_one();
+}
+
+Executor SortPool::GetExecutor() {
+  return {ParallelFor, Threads(), this};
+}
+
+int SortPool::Threads() const {
+  return workers_.size();
+}
+
+SortPool &SortPool::Shared() {
+  static SortPool pool(omp_get_max_threads());
+  return pool;
+}
+
+void SortPool::ParallelFor(size_t n, void (*task)(void *, size_t), void *arg, void *context) {
+  SortPool *pool = (SortPool *) context;
+  Batch batch = {task, arg, n};
+  std::unique_lock<std::mutex> lock(pool->mutex_);
+  for (size_t i = 0; i < n; i++) {
+    pool->items_.push_back({&batch, i});
+  }
+  pool->wake_.notify_all();
+  while (batch.remaining > 0) {
+    if (!pool->items_.empty()) {
+      pool->RunItem(lock);
+    } else {
+      pool->wake_.wait(lock);
+    }
+  }
+}
+
+void SortPool::RunItem(std::unique_lock<std::mutex> &lock) {
+  Item item = items_.front();
+  items_.pop_front();
+  lock.unlock();
+  item.batch->task(item.batch->arg, item.i);
+  lock.lock();
+  if (--item.batch->remaining == 0) {
+    wake_.notify_all();
+  }
+}
+
+void SortPool::Work() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    // Items of the sorts in flight go before starting another one
+    if (!items_.empty()) {
+      RunItem(lock);
+    } else if (!jobs_.empty()) {
+      std::function<void()> job = std::move(jobs_.front());
+      jobs_.pop_front();
+      lock.unlock();
+      job();
+      lock.lock();
+    } else if (stopping_) {
+      return;
+    } else {
+      wake_.wait(lock);
+    }
+  }
+}
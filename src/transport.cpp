@@ -0,0 +1,262 @@
+#include "transport.h"
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <system_error>
+#include <thread>
+#include <unistd.h>
+
+static void Fail(const char *call) {
+  throw std::system_error(errno, std::generic_category(), call);
+}
+
+SocketTransport::SocketTransport(int rank, std::vector<int> fds) : rank_(rank), fds_(std::move(fds)) {}
+
+SocketTransport::~SocketTransport() {
+  for (int fd : fds_) {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+}
+
+int SocketTransport::Rank() const {
+  return rank_;
+}
+
+int SocketTransport::Size() const {
+  return fds_.size();
+}
+
+void SocketTransport::Send(int peer, const void *data, size_t bytes) {
+  const char *p = (const char *) data;
+  while (bytes > 0) {
+    ssize_t sent = send(fds_[peer], p, bytes, MSG_NOSIGNAL);
+    if (sent < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      Fail("send");
+    }
+    p += sent;
+    bytes -= sent;
+  }
+}
+
+void SocketTransport::Recv(int peer, void *data, size_t bytes) {
+  char *p = (char *) data;
+  while (bytes > 0) {
+    ssize_t received = recv(fds_[peer], p, bytes, 0);
+    if (received < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      Fail("recv");
+    }
+    if (received == 0) {
+      errno = ECONNRESET;
+      Fail("recv");
+    }
+    p += received;
+    bytes -= received;
+  }
+}
+
+std::vector<std::vector<int>> SocketTransport::Mesh(int P) {
+  std::vector<std::vector<int>> fds(P, std::vector<int>(P, -1));
+  for (int a = 0; a < P; a++) {
+    for (int b = a + 1; b < P; b++) {
+      int pair[2];
+      if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0) {
+        Fail("socketpair");
+      }
+      fds[a][b] = pair[0];
+      fds[b][a] = pair[1];
+    }
+  }
+  return fds;
+}
+
+// Socket address of a "host:port" or "unix:/path" endpoint
+struct Endpoint {
+  sockaddr_storage address;
+  socklen_t length;
+  int family;
+};
+
+static Endpoint Resolve(const std::string &endpoint) {
+  Endpoint e;
+  memset(&e.address, 0, sizeof(e.address));
+  if (endpoint.compare(0, 5, "unix:") == 0) {
+    sockaddr_un *un = (sockaddr_un *) &e.address;
+    un->sun_family = AF_UNIX;
+    strncpy(un->sun_path, endpoint.c_str() + 5, sizeof(un->sun_path) - 1);
+    e.length = sizeof(sockaddr_un);
+    e.family = AF_UNIX;
+    return e;
+  }
+  size_t colon = endpoint.rfind(':');
+  std::string host = endpoint.substr(0, colon);
+  std::string port = endpoint.substr(colon + 1);
+  addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo *result;
+  int error = getaddrinfo(host.c_str(), port.c_str(), &hints, &result);
+  if (error != 0) {
+    errno = error == EAI_SYSTEM ? errno : EHOSTUNREACH;
+    Fail("getaddrinfo");
+  }
+  memcpy(&e.address, result->ai_addr, result->ai_addrlen);
+  e.length = result->ai_addrlen;
+  e.family = result->ai_family;
+  freeaddrinfo(result);
+  return e;
+}
+
+static void Configure(int fd, int family) {
+  if (family != AF_UNIX) {
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  }
+}
+
+std::unique_ptr<SocketTransport> SocketTransport::Connect(int rank, const std::vector<std::string> &endpoints,
+                                                          int timeout_ms) {
+  int P = endpoints.size();
+  std::vector<int> fds(P, -1);
+  Endpoint own = Resolve(endpoints[rank]);
+  int listener = -1;
+  auto close_listener = [&]() {
+    if (listener >= 0) {
+      close(listener);
+      if (own.family == AF_UNIX) {
+        unlink(((sockaddr_un *) &own.address)->sun_path);
+      }
+    }
+  };
+  // A failed step closes the sockets opened so far before the error propagates
+  try {
+    if (rank < P - 1) {
+      listener = socket(own.family, SOCK_STREAM, 0);
+      if (listener < 0) {
+        Fail("socket");
+      }
+      int on = 1;
+      setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+      if (own.family == AF_UNIX) {
+        unlink(((sockaddr_un *) &own.address)->sun_path);
+      }
+      if (bind(listener, (sockaddr *) &own.address, own.length) != 0 || listen(listener, P) != 0) {
+        Fail("listen");
+      }
+    }
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    for (int peer = 0; peer < rank; peer++) {
+      Endpoint e = Resolve(endpoints[peer]);
+      while (true) {
+        int fd = socket(e.family, SOCK_STREAM, 0);
+        if (fd < 0) {
+          Fail("socket");
+        }
+        if (connect(fd, (sockaddr *) &e.address, e.length) == 0) {
+          Configure(fd, e.family);
+          int32_t id = rank;
+          fds[peer] = fd;
+          if (send(fd, &id, sizeof(id), MSG_NOSIGNAL) != sizeof(id)) {
+            Fail("send");
+          }
+          break;
+        }
+        close(fd);
+        if (std::chrono::steady_clock::now() > deadline) {
+          Fail("connect");
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      }
+    }
+    // Peers above identify themselves by their rank
+    for (int accepted = rank + 1; accepted < P; accepted++) {
+      int fd = accept(listener, nullptr, nullptr);
+      if (fd < 0) {
+        Fail("accept");
+      }
+      Configure(fd, own.family);
+      int32_t id;
+      if (recv(fd, &id, sizeof(id), MSG_WAITALL) != sizeof(id) || id <= rank || id >= P || fds[id] >= 0) {
+        close(fd);
+        errno = EPROTO;
+        Fail("accept");
+      }
+      fds[id] = fd;
+    }
+  } catch (...) {
+    for (int fd : fds) {
+      if (fd >= 0) {
+        close(fd);
+      }
+    }
+    close_listener();
+    throw;
+  }
+  close_listener();
+  return std::unique_ptr<SocketTransport>(new SocketTransport(rank, fds));
+}
+
+std::vector<size_t> AllToAll(Transport &transport, const std::vector<const void *> &send,
+                             const std::vector<size_t> &send_bytes, std::unique_ptr<char[]> &recv) {
+  int P = transport.Size();
+  int rank = transport.Rank();
+  std::vector<uint64_t> counts(P);
+  counts[rank] = send_bytes[rank];
+  // Round k sends to rank + k and receives from rank - k, so each pair of
+  // ranks exchanges in the same round and no rank waits on a third
+  auto exchange = [&](int k, const void *out, size_t out_bytes, void *in, size_t in_bytes) {
+    int to = (rank + k) % P;
+    int from = (rank - k + P) % P;
+    std::exception_ptr send_error;
+    std::thread sender([&]() {
+      try {
+        transport.Send(to, out, out_bytes);
+      } catch (...) {
+        send_error = std::current_exception();
+      }
+    });
+    try {
+      transport.Recv(from, in, in_bytes);
+    } catch (...) {
+      sender.join();
+      throw;
+    }
+    sender.join();
+    if (send_error) {
+      std::rethrow_exception(send_error);
+    }
+  };
+  for (int k = 1; k < P; k++) {
+    uint64_t count = send_bytes[(rank + k) % P];
+    exchange(k, &count, sizeof(count), &counts[(rank - k + P) % P], sizeof(uint64_t));
+  }
+
+  std::vector<size_t> offsets(P + 1, 0);
+  for (int q = 0; q < P; q++) {
+    offsets[q + 1] = offsets[q] + counts[q];
+  }
+  recv.reset(new char[offsets[P]]);
+  memcpy(&recv[offsets[rank]], send[rank], send_bytes[rank]);
+  for (int k = 1; k < P; k++) {
+    int to = (rank + k) % P;
+    int from = (rank - k + P) % P;
+    exchange(k, send[to], send_bytes[to], &recv[offsets[from]], counts[from]);
+  }
+  return std::vector<size_t>(counts.begin(), counts.end());
+}
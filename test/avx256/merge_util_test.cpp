@@ -302,4 +302,144 @@ TEST(MergeUtilsTest, AVX256MergePass4Float64BitTest) {
   free(temp_arr);
 }
 
+TEST(MergeUtilsTest, AVX256MergePass8SplitInt32BitTest) {
+  // A single run pair split across threads by merge path co-ranks
+  int N = 8192;
+  int *arr, *buffer;
+  TestUtil::RandGenInt<int>(arr, N, -10, 10);
+  aligned_init<int>(buffer, N);
+  std::sort(arr, arr + N / 2);
+  std::sort(arr + N / 2, arr + N);
+  std::vector<int> check_arr(arr, arr + N);
+  std::sort(check_arr.begin(), check_arr.end());
+
+  int threads = omp_get_max_threads();
+  omp_set_num_threads(8);
+  MergePass8<int, __m256i>(arr, buffer, N, N / 2);
+  omp_set_num_threads(threads);
+
+  for (int m = 0; m < N; ++m) {
+    EXPECT_EQ(check_arr[m], buffer[m]);
+  }
+
+  delete[](arr);
+  delete[](buffer);
+}
+
+TEST(MergeUtilsTest, AVX256MergePass4WideFloat64BitTest) {
+  // Long runs go through the multi-register merge network and its scalar tail
+  int N = 8192;
+  double *arr, *buffer;
+  TestUtil::RandGenFloat<double>(arr, N, -10, 10);
+  aligned_init<double>(buffer, N);
+  std::sort(arr, arr + N / 2);
+  std::sort(arr + N / 2, arr + N);
+  std::vector<double> check_arr(arr, arr + N);
+  std::sort(check_arr.begin(), check_arr.end());
+
+  MergePass4<double, __m256d>(arr, buffer, N, N / 2);
+
+  for (int m = 0; m < N; ++m) {
+    EXPECT_EQ(check_arr[m], buffer[m]);
+  }
+
+  delete[](arr);
+  delete[](buffer);
+}
+
+TEST(MergeUtilsTest, AVX256MergeRunPair8FloatTest) {
+  // Segments of one run pair are independent and may be merged in any order
+  int N = 4096;
+  int segments = 4;
+  float *arr, *buffer;
+  TestUtil::RandGenFloat<float>(arr, N, -10, 10);
+  aligned_init<float>(buffer, N);
+  std::sort(arr, arr + N / 2);
+  std::sort(arr + N / 2, arr + N);
+  std::vector<float> check_arr(arr, arr + N);
+  std::sort(check_arr.begin(), check_arr.end());
+
+  for (int s = segments - 1; s >= 0; --s) {
+    MergeRunPair8<float, __m256>(arr, buffer, 0, N / 2, s, segments);
+  }
+
+  for (int m = 0; m < N; ++m) {
+    EXPECT_EQ(check_arr[m], buffer[m]);
+  }
+
+  delete[](arr);
+  delete[](buffer);
+}
+
+TEST(MergeUtilsTest, AVX256MergeRunPair8StreamingInt32BitTest) {
+  // Streaming stores forced on for small runs. Run pairs of 4100 values start
+  // their second segment off the register alignment, and the shifted buffer
+  // puts every segment off it, so both the non-temporal and the fallback
+  // stores are checked
+  SetStreamingThreshold(1);
+  int segments = 2;
+  for (int run_size : {4096, 4100}) {
+    for (int shift : {0, 1}) {
+      int N = 4 * run_size;
+      int *arr, *buffer;
+      TestUtil::RandGenInt<int>(arr, N, -1000, 1000);
+      aligned_init<int>(buffer, N + 8);
+      for (int start = 0; start < N; start += run_size) {
+        std::sort(arr + start, arr + start + run_size);
+      }
+      std::vector<int> check_arr(arr, arr + N);
+      for (int start = 0; start < N; start += 2 * run_size) {
+        std::sort(check_arr.begin() + start, check_arr.begin() + start + 2 * run_size);
+      }
+
+      for (int start = 0; start < N; start += 2 * run_size) {
+        for (int s = 0; s < segments; ++s) {
+          MergeRunPair8<int, __m256i>(arr, buffer + shift, start, run_size, s, segments);
+        }
+      }
+
+      for (int m = 0; m < N; ++m) {
+        EXPECT_EQ(check_arr[m], buffer[shift + m]);
+      }
+
+      delete[](arr);
+      delete[](buffer);
+    }
+  }
+  SetStreamingThreshold(0);
+}
+
+TEST(MergeUtilsTest, AVX256MaskedMergePass4SplitInt64BitTest) {
+  using T = int64_t;
+  int N = 4096;
+  T *arr, *buffer;
+  TestUtil::RandGenIntRecords<T>(arr, N, -10, 10);
+  aligned_init<T>(buffer, 2 * N);
+  auto *records = (std::pair<T, T> *) arr;
+  auto key_order = [](const std::pair<T, T> &left, const std::pair<T, T> &right) {
+    return left.first < right.first;
+  };
+  std::sort(records, records + N / 2, key_order);
+  std::sort(records + N / 2, records + N, key_order);
+  std::vector<std::pair<T, T>> check_arr(records, records + N);
+  std::sort(check_arr.begin(), check_arr.end());
+
+  int threads = omp_get_max_threads();
+  omp_set_num_threads(4);
+  MaskedMergePass4<T, __m256i>(arr, buffer, 2 * N, N);
+  omp_set_num_threads(threads);
+
+  auto *merged = (std::pair<T, T> *) buffer;
+  for (int m = 1; m < N; ++m) {
+    EXPECT_LE(merged[m - 1].first, merged[m].first);
+  }
+  std::sort(merged, merged + N);
+  for (int m = 0; m < N; ++m) {
+    EXPECT_EQ(check_arr[m], merged[m]);
+  }
+
+  delete[](arr);
+  delete[](buffer);
+}
+
 }
@@ -7,6 +7,19 @@
 #include "ips4o.hpp"
 #include "pdqsort.h"
 
+// Forwards to the default allocator and tracks the bytes still outstanding
+static void *CountingAllocate(size_t bytes, size_t alignment, void *context) {
+  *(size_t *) context += bytes;
+  Allocator allocator = DefaultAllocator();
+  return allocator.allocate(bytes, alignment, allocator.context);
+}
+
+static void CountingDeallocate(void *ptr, size_t bytes, void *context) {
+  *(size_t *) context -= bytes;
+  Allocator allocator = DefaultAllocator();
+  allocator.deallocate(ptr, bytes, allocator.context);
+}
+
 namespace avx2 {
 TEST(SIMDSortTests, AVX256SIMDSort32BitIntegerTest) {
   size_t N = NNUM;
@@ -663,4 +676,234 @@ TEST(SIMDSortTests, AVX256SIMDSort64BitKeyValueFloatTest) {
   delete rand_arr;
   delete soln_arr;
 }
+
+TEST(SIMDSortTests, AVX256SIMDSortPairVectorTest) {
+  // The pairs of a std::vector need not start on a cache line; they are sorted
+  // where they are, at the start of the vector and one record into it
+  using T = int;
+  size_t N = NNUM;
+  T lo = LO;
+  T hi = HI;
+  std::pair<T, T> *rand_arr;
+
+  TestUtil::RandGenIntRecords(rand_arr, N, lo, hi);
+  std::vector<std::pair<T, T>> check_arr(rand_arr, rand_arr + N);
+  std::sort(check_arr.begin(), check_arr.end());
+  for (size_t offset = 0; offset < 2; offset++) {
+    std::vector<std::pair<T, T>> records(offset + N);
+    std::copy(rand_arr, rand_arr + N, records.begin() + offset);
+    std::pair<T, T> *arr = records.data() + offset;
+    SIMDSort(N, arr);
+    EXPECT_EQ(arr, records.data() + offset);
+    for (unsigned int i = 0; i < N; i++) {
+      EXPECT_EQ(check_arr[i].first, arr[i].first);
+    }
+    // Values stay with their keys
+    std::sort(arr, arr + N);
+    EXPECT_TRUE(std::equal(check_arr.begin(), check_arr.end(), arr));
+  }
+  delete rand_arr;
+}
+
+TEST(SIMDSortTests, AVX256SIMDSortCacheBlocked32BitIntegerTest) {
+  // Large enough to span several L2-sized chunks and out-of-cache merge passes
+  size_t N = NNUM * 64;
+  int lo = LO;
+  int hi = HI;
+  int *rand_arr;
+  int *soln_arr;
+  double start, end;
+
+  TestUtil::RandGenInt(rand_arr, N, lo, hi);
+  aligned_init<int>(soln_arr, N);
+  std::copy(rand_arr, rand_arr + N, soln_arr);
+  std::vector<int> check_arr(rand_arr, rand_arr + N);
+  start = currentSeconds();
+  SIMDSort(N, soln_arr);
+  end = currentSeconds();
+  std::sort(check_arr.begin(), check_arr.end());
+  for (unsigned int i = 0; i < N; i++) {
+    EXPECT_EQ(check_arr[i], soln_arr[i]);
+  }
+  printf("[avx256::sort] %lu elements: %.8f seconds\n", N, end - start);
+  delete rand_arr;
+  delete soln_arr;
+}
+
+TEST(SIMDSortTests, AVX256NumaSIMDSort64BitFloatTest) {
+  // One partition per NUMA node, a plain SIMDSort on single node machines
+  size_t N = NNUM * 16;
+  double lo = LO;
+  double hi = HI;
+  double *rand_arr;
+  double *soln_arr;
+  double start, end;
+
+  TestUtil::RandGenFloat(rand_arr, N, lo, hi);
+  aligned_init<double>(soln_arr, N);
+  std::copy(rand_arr, rand_arr + N, soln_arr);
+  std::vector<double> check_arr(rand_arr, rand_arr + N);
+  start = currentSeconds();
+  NumaSIMDSort(N, soln_arr);
+  end = currentSeconds();
+  std::sort(check_arr.begin(), check_arr.end());
+  for (unsigned int i = 0; i < N; i++) {
+    EXPECT_EQ(check_arr[i], soln_arr[i]);
+  }
+  printf("[avx256::numa_sort] %lu elements: %.8f seconds\n", N, end - start);
+  delete rand_arr;
+  delete soln_arr;
+}
+
+
+TEST(SIMDSortTests, AVX256SIMDSortAllocatorTest) {
+  // Key-value sorts release all of their work memory through the allocator
+  using T = float;
+  size_t N = NNUM;
+  T lo = LO;
+  T hi = HI;
+  std::pair<T, T> *rand_arr;
+  std::pair<T, T> *soln_arr;
+  std::pair<int, int> *int_arr;
+  std::pair<int, int> *result_arr;
+
+  TestUtil::RandGenFloatRecords(rand_arr, N, lo, hi);
+  TestUtil::RandGenIntRecords(int_arr, N, (int) lo, (int) hi);
+  aligned_init<std::pair<T, T>>(soln_arr, N);
+  std::copy(rand_arr, rand_arr + N, soln_arr);
+  std::pair<T, T> *input = soln_arr;
+  size_t outstanding = 0;
+  {
+    ScopedAllocator scoped({CountingAllocate, CountingDeallocate, &outstanding});
+    // The pairs are sorted in place and the scratch buffer is released
+    SIMDSort(N, soln_arr);
+    EXPECT_EQ(soln_arr, input);
+    EXPECT_EQ(outstanding, 0);
+    SIMDOrderBy64(result_arr, N, int_arr, 0);
+    EXPECT_EQ(outstanding, N * sizeof(std::pair<int, int>));
+    aligned_free(result_arr, N);
+  }
+  EXPECT_EQ(outstanding, 0);
+  for (unsigned int i = 1; i < N; i++) {
+    EXPECT_LE(soln_arr[i - 1].first, soln_arr[i].first);
+  }
+  delete rand_arr;
+  delete soln_arr;
+  delete int_arr;
+}
+
+
+TEST(SIMDSortTests, AVX256LowMemorySIMDSort64BitFloatTest) {
+  // In place with the default O(sqrt(N)) scratch and with a small fixed budget
+  size_t N = NNUM * 16;
+  double lo = LO;
+  double hi = HI;
+  double *rand_arr;
+  double *soln_arr;
+  double start, end;
+
+  TestUtil::RandGenFloat(rand_arr, N, lo, hi);
+  std::vector<double> check_arr(rand_arr, rand_arr + N);
+  std::sort(check_arr.begin(), check_arr.end());
+  aligned_init<double>(soln_arr, N);
+  for (size_t scratch_bytes : {(size_t) 0, (size_t) 64 * 1024}) {
+    std::copy(rand_arr, rand_arr + N, soln_arr);
+    start = currentSeconds();
+    LowMemorySIMDSort(N, soln_arr, scratch_bytes);
+    end = currentSeconds();
+    for (unsigned int i = 0; i < N; i++) {
+      EXPECT_EQ(check_arr[i], soln_arr[i]);
+    }
+    printf("[avx256::low_memory_sort %lu scratch bytes] %lu elements: %.8f seconds\n", scratch_bytes, N,
+           end - start);
+  }
+  delete rand_arr;
+  delete soln_arr;
+}
+
+TEST(SIMDSortTests, AVX256LowMemorySIMDSort32BitKeyValueIntTest) {
+  using T = int;
+  size_t N = NNUM;
+  T lo = LO;
+  T hi = HI;
+  std::pair<T, T> *rand_arr;
+  std::pair<T, T> *soln_arr;
+  double start, end;
+
+  TestUtil::RandGenIntRecords(rand_arr, N, lo, hi);
+  std::map<T, T> kv_map;
+  for (unsigned int i = 0; i < N; ++i) {
+    kv_map.insert(std::pair<T, T>(rand_arr[i].second, rand_arr[i].first));
+  }
+  aligned_init<std::pair<T, T>>(soln_arr, N);
+  std::copy(rand_arr, rand_arr + N, soln_arr);
+  std::vector<std::pair<T, T>> check_arr(rand_arr, rand_arr + N);
+  start = currentSeconds();
+  LowMemorySIMDSort(N, soln_arr);
+  end = currentSeconds();
+  std::sort(check_arr.begin(), check_arr.end(), [](std::pair<T, T> &left, std::pair<T, T> &right) {
+    return left.first < right.first;
+  });
+  for (unsigned int i = 0; i < N; i++) {
+    EXPECT_EQ(check_arr[i].first, soln_arr[i].first);
+    EXPECT_EQ(kv_map[soln_arr[i].second], soln_arr[i].first);
+  }
+  printf("[avx256::low_memory_sort] %lu elements: %.8f seconds\n", N, end - start);
+  delete rand_arr;
+  delete soln_arr;
+}
+
+TEST(SIMDSortTests, AVX256SharedDrivers64BitIntegerTest) {
+  // The shared drivers with the avx2 kernels: partitioned, sliced, pipeline
+  using T = int64_t;
+  size_t N = NNUM;
+  T lo = LO;
+  T hi = HI;
+  T *rand_arr;
+  T *soln_arr;
+
+  TestUtil::RandGenInt(rand_arr, N, lo, hi);
+  std::vector<T> check_arr(rand_arr, rand_arr + N);
+  std::sort(check_arr.begin(), check_arr.end());
+  aligned_init<T>(soln_arr, N);
+  T *input = soln_arr;
+  std::copy(rand_arr, rand_arr + N, input);
+  PartitionedSIMDSort(N, soln_arr);
+  for (unsigned int i = 0; i < N; i++) {
+    EXPECT_EQ(check_arr[i], soln_arr[i]);
+  }
+  if (soln_arr != input) {
+    aligned_free(soln_arr, N);
+  }
+
+  std::copy(rand_arr, rand_arr + N, input);
+  T *result;
+  {
+    SlicedSort<T> sort(N, input);
+    while (!sort.Step(200)) {
+    }
+    result = sort.Result();
+  }
+  for (unsigned int i = 0; i < N; i++) {
+    EXPECT_EQ(check_arr[i], result[i]);
+  }
+  if (result != input) {
+    aligned_free(result, N);
+  }
+
+  SortPipeline<T> pipeline(N / 8, 2);
+  for (size_t i = 0; i < N; i += 1000) {
+    pipeline.Push(rand_arr + i, std::min((size_t) 1000, N - i));
+  }
+  size_t result_N;
+  result = pipeline.Finish(result_N);
+  EXPECT_EQ(result_N, N);
+  for (unsigned int i = 0; i < N; i++) {
+    EXPECT_EQ(check_arr[i], result[i]);
+  }
+  aligned_free(result, N);
+  delete rand_arr;
+  delete input;
+}
+
 }
\ No newline at end of file
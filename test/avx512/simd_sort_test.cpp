@@ -1,14 +1,62 @@
 #include "metrics/cycletimer.h"
+#include "metrics/perf_counter.h"
 #include "gtest/gtest.h"
 #include "test_util.h"
 #include "avx512/simd_sort.h"
+#include "numa_util.h"
 #include <algorithm>
+#include <atomic>
+#include <fcntl.h>
 #include <iterator>
+#include <memory>
+#include <sched.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <system_error>
+#include <thread>
+#include <unistd.h>
 #include "ips4o.hpp"
 #include "pdqsort.h"
 
 #ifdef AVX512
 
+// Forwards to the default allocator and tracks the bytes still outstanding
+static void *CountingAllocate(size_t bytes, size_t alignment, void *context) {
+  *(size_t *) context += bytes;
+  Allocator allocator = DefaultAllocator();
+  return allocator.allocate(bytes, alignment, allocator.context);
+}
+
+static void CountingDeallocate(void *ptr, size_t bytes, void *context) {
+  *(size_t *) context -= bytes;
+  Allocator allocator = DefaultAllocator();
+  allocator.deallocate(ptr, bytes, allocator.context);
+}
+
+// Callback pool for the executor tests: starts its threads per call and hands
+// out the items through a shared counter
+struct TestPool {
+  int threads;
+  std::atomic<size_t> items;
+};
+
+static void TestPoolParallelFor(size_t n, void (*task)(void *, size_t), void *arg, void *context) {
+  TestPool *pool = (TestPool *) context;
+  std::atomic<size_t> next(0);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < pool->threads; t++) {
+    threads.emplace_back([&]() {
+      for (size_t i = next++; i < n; i = next++) {
+        task(arg, i);
+        pool->items++;
+      }
+    });
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+}
+
 namespace avx512 {
 TEST(SIMDSortTests, AVX512SIMDSort32BitIntegerTest) {
   size_t N = NNUM;
@@ -623,6 +671,1183 @@ TEST(SIMDSortTests, AVX512SIMDSort64BitKeyValueFloatTest) {
   delete soln_arr;
 }
 
+TEST(SIMDSortTests, AVX512SIMDSortPairVectorTest) {
+  // The pairs of a std::vector need not start on a cache line; they are sorted
+  // where they are, at the start of the vector and one record into it
+  using T = float;
+  size_t N = NNUM;
+  T lo = LO;
+  T hi = HI;
+  std::pair<T, T> *rand_arr;
+
+  TestUtil::RandGenFloatRecords(rand_arr, N, lo, hi);
+  std::vector<std::pair<T, T>> check_arr(rand_arr, rand_arr + N);
+  std::sort(check_arr.begin(), check_arr.end());
+  for (size_t offset = 0; offset < 2; offset++) {
+    std::vector<std::pair<T, T>> records(offset + N);
+    std::copy(rand_arr, rand_arr + N, records.begin() + offset);
+    std::pair<T, T> *arr = records.data() + offset;
+    SIMDSort(N, arr);
+    EXPECT_EQ(arr, records.data() + offset);
+    for (unsigned int i = 0; i < N; i++) {
+      EXPECT_EQ(check_arr[i].first, arr[i].first);
+    }
+    // Values stay with their keys
+    std::sort(arr, arr + N);
+    EXPECT_TRUE(std::equal(check_arr.begin(), check_arr.end(), arr));
+  }
+  delete rand_arr;
+}
+
+TEST(SIMDSortTests, AVX512SIMDSortIntPairVectorTest) {
+  // As above, for int pairs, which are sorted as int64_t keys by SwapHalves
+  using T = int;
+  size_t N = NNUM;
+  T lo = LO;
+  T hi = HI;
+  std::pair<T, T> *rand_arr;
+
+  TestUtil::RandGenIntRecords(rand_arr, N, lo, hi);
+  std::vector<std::pair<T, T>> check_arr(rand_arr, rand_arr + N);
+  std::sort(check_arr.begin(), check_arr.end());
+  for (size_t offset = 0; offset < 2; offset++) {
+    std::vector<std::pair<T, T>> records(offset + N);
+    std::copy(rand_arr, rand_arr + N, records.begin() + offset);
+    std::pair<T, T> *arr = records.data() + offset;
+    SIMDSort(N, arr);
+    EXPECT_EQ(arr, records.data() + offset);
+    for (unsigned int i = 0; i < N; i++) {
+      EXPECT_EQ(check_arr[i].first, arr[i].first);
+    }
+    // Values stay with their keys
+    std::sort(arr, arr + N);
+    EXPECT_TRUE(std::equal(check_arr.begin(), check_arr.end(), arr));
+  }
+  delete rand_arr;
+}
+
+TEST(SIMDSortTests, AVX512SIMDSortCacheBlocked32BitIntegerTest) {
+  // Large enough to span several L2-sized chunks and out-of-cache merge passes
+  size_t N = NNUM * 64;
+  int lo = LO;
+  int hi = HI;
+  int *rand_arr;
+  int *soln_arr;
+  double start, end;
+
+  TestUtil::RandGenInt(rand_arr, N, lo, hi);
+  aligned_init<int>(soln_arr, N);
+  std::copy(rand_arr, rand_arr + N, soln_arr);
+  std::vector<int> check_arr(rand_arr, rand_arr + N);
+  start = currentSeconds();
+  SIMDSort(N, soln_arr);
+  end = currentSeconds();
+  std::sort(check_arr.begin(), check_arr.end());
+  for (unsigned int i = 0; i < N; i++) {
+    EXPECT_EQ(check_arr[i], soln_arr[i]);
+  }
+  printf("[avx512::sort] %lu elements: %.8f seconds\n", N, end - start);
+  delete rand_arr;
+  delete soln_arr;
+}
+
+TEST(SIMDSortTests, AVX512SIMDSortStreamingLevels32BitIntegerTest) {
+  // Every level above the L2-sized chunks, and the P-way merge of the slices,
+  // run as streaming passes once the threshold is below their size
+  size_t N = NNUM * 16;
+  int *rand_arr;
+  int *soln_arr;
+
+  SetStreamingThreshold(1);
+  for (bool partitioned : {false, true}) {
+    TestUtil::RandGenInt(rand_arr, N, LO, HI);
+    aligned_init<int>(soln_arr, N);
+    std::copy(rand_arr, rand_arr + N, soln_arr);
+    std::vector<int> check_arr(rand_arr, rand_arr + N);
+    int *input = soln_arr;
+    if (partitioned) {
+      PartitionedSIMDSort(N, soln_arr);
+    } else {
+      SIMDSort(N, soln_arr);
+    }
+    std::sort(check_arr.begin(), check_arr.end());
+    for (unsigned int i = 0; i < N; i++) {
+      EXPECT_EQ(check_arr[i], soln_arr[i]);
+    }
+    if (soln_arr != input) {
+      aligned_free(input, N);
+    }
+    delete rand_arr;
+    delete soln_arr;
+  }
+  SetStreamingThreshold(0);
+}
+
+TEST(SIMDSortTests, AVX512NumaSIMDSort64BitFloatTest) {
+  // One partition per NUMA node, a plain SIMDSort on single node machines
+  size_t N = NNUM * 16;
+  double lo = LO;
+  double hi = HI;
+  double *rand_arr;
+  double *soln_arr;
+  double start, end;
+
+  TestUtil::RandGenFloat(rand_arr, N, lo, hi);
+  aligned_init<double>(soln_arr, N);
+  std::copy(rand_arr, rand_arr + N, soln_arr);
+  std::vector<double> check_arr(rand_arr, rand_arr + N);
+  start = currentSeconds();
+  NumaSIMDSort(N, soln_arr);
+  end = currentSeconds();
+  std::sort(check_arr.begin(), check_arr.end());
+  for (unsigned int i = 0; i < N; i++) {
+    EXPECT_EQ(check_arr[i], soln_arr[i]);
+  }
+  printf("[avx512::numa_sort] %lu elements: %.8f seconds\n", N, end - start);
+  delete rand_arr;
+  delete soln_arr;
+}
+
+TEST(SIMDSortTests, AVX512NumaSIMDSortFakeNodesTest) {
+  // Two nodes made of the CPUs this process may use, then a second node whose
+  // only CPU does not exist, so its partition cannot be bound and is sorted
+  // where its thread runs
+  size_t N = NNUM * 4;
+  int *rand_arr;
+  int *soln_arr;
+
+  cpu_set_t affinity, after;
+  sched_getaffinity(0, sizeof(affinity), &affinity);
+  std::vector<int> cpus;
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &affinity)) {
+      cpus.push_back(cpu);
+    }
+  }
+  size_t half = (cpus.size() + 1) / 2;
+  std::vector<int> first(cpus.begin(), cpus.begin() + half);
+  std::vector<int> second(cpus.begin() + cpus.size() / 2, cpus.end());
+  ExecutionContext context;
+  context.threads = 4;
+  ScopedExecutionContext scoped(context);
+  for (auto topology : {std::vector<std::vector<int>>{first, second},
+                        std::vector<std::vector<int>>{first, {CPU_SETSIZE - 1}}}) {
+    SetNumaTopology(topology);
+    EXPECT_EQ(NumaNodes(), std::vector<int>({0, 1}));
+    EXPECT_EQ(NumaNodeCpus(1), topology[1]);
+    TestUtil::RandGenInt(rand_arr, N, LO, HI);
+    aligned_init<int>(soln_arr, N);
+    std::copy(rand_arr, rand_arr + N, soln_arr);
+    std::vector<int> check_arr(rand_arr, rand_arr + N);
+    int *input = soln_arr;
+    NumaSIMDSort(N, soln_arr);
+    std::sort(check_arr.begin(), check_arr.end());
+    for (unsigned int i = 0; i < N; i++) {
+      EXPECT_EQ(check_arr[i], soln_arr[i]);
+    }
+    sched_getaffinity(0, sizeof(after), &after);
+    EXPECT_TRUE(CPU_EQUAL(&affinity, &after));
+    if (soln_arr != input) {
+      aligned_free(input, N);
+    }
+    delete rand_arr;
+    delete soln_arr;
+  }
+  SetNumaTopology({});
+  EXPECT_FALSE(NumaNodes().empty());
+}
+
+TEST(SIMDSortTests, AVX512PartitionedSIMDSort32BitIntegerTest) {
+  // Eight slices and one 8-way merge, with many duplicate keys across slices
+  size_t N = NNUM * 16;
+  int *rand_arr;
+  int *soln_arr;
+  double start, end;
+
+  ExecutionContext context;
+  context.threads = 8;
+  ScopedExecutionContext scoped(context);
+  for (int hi : {HI, 100}) {
+    TestUtil::RandGenInt(rand_arr, N, 0, hi);
+    aligned_init<int>(soln_arr, N);
+    std::copy(rand_arr, rand_arr + N, soln_arr);
+    std::vector<int> check_arr(rand_arr, rand_arr + N);
+    int *input = soln_arr;
+    start = currentSeconds();
+    PartitionedSIMDSort(N, soln_arr);
+    end = currentSeconds();
+    std::sort(check_arr.begin(), check_arr.end());
+    for (unsigned int i = 0; i < N; i++) {
+      EXPECT_EQ(check_arr[i], soln_arr[i]);
+    }
+    printf("[avx512::partitioned_sort] %lu elements: %.8f seconds\n", N, end - start);
+    if (soln_arr != input) {
+      aligned_free(input, N);
+    }
+    delete rand_arr;
+    delete soln_arr;
+  }
+}
+
+// One rank of a distributed sort test: sorts its shard and sends its range to
+// rank 0, which checks the concatenation
+static bool DistributedRank(Transport &transport, std::vector<std::vector<int>> &shards) {
+  int rank = transport.Rank();
+  size_t N = shards[rank].size();
+  int *arr;
+  aligned_init(arr, N);
+  std::copy(shards[rank].begin(), shards[rank].end(), arr);
+  size_t result_N;
+  int *result = DistributedSIMDSort(N, arr, transport, result_N);
+  aligned_free(arr, N);
+  if (rank != 0) {
+    uint64_t n = result_N;
+    transport.Send(0, &n, sizeof(n));
+    transport.Send(0, result, result_N * sizeof(int));
+    aligned_free(result, result_N);
+    return true;
+  }
+  std::vector<int> merged(result, result + result_N);
+  aligned_free(result, result_N);
+  std::vector<int> check_arr;
+  for (const std::vector<int> &shard : shards) {
+    check_arr.insert(check_arr.end(), shard.begin(), shard.end());
+  }
+  // Every rank ends up with about its share of the keys
+  size_t share = check_arr.size() / transport.Size();
+  bool balanced = result_N <= share + share / 4;
+  for (int q = 1; q < transport.Size(); q++) {
+    uint64_t n;
+    transport.Recv(q, &n, sizeof(n));
+    merged.resize(merged.size() + n);
+    transport.Recv(q, &merged[merged.size() - n], n * sizeof(int));
+    balanced = balanced && n <= share + share / 4;
+  }
+  std::sort(check_arr.begin(), check_arr.end());
+  return merged == check_arr && balanced;
+}
+
+// Runs ranks 1..P-1 in forked processes; they run single threaded, since
+// OpenMP teams do not survive a fork
+template<typename Connect>
+static bool ForkRanks(int P, Connect connect, std::vector<std::vector<int>> &shards) {
+  std::vector<pid_t> children;
+  for (int rank = 1; rank < P; rank++) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      // Errors must not unwind into the test runner of the child
+      try {
+        ExecutionContext context;
+        context.threads = 1;
+        ScopedExecutionContext scoped(context);
+        std::unique_ptr<Transport> transport = connect(rank);
+        _exit(DistributedRank(*transport, shards) ? 0 : 1);
+      } catch (...) {
+        _exit(1);
+      }
+    }
+    children.push_back(pid);
+  }
+  bool ok = DistributedRank(*connect(0), shards);
+  for (pid_t pid : children) {
+    int status;
+    waitpid(pid, &status, 0);
+    ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+  }
+  return ok;
+}
+
+TEST(SIMDSortTests, AVX512DistributedSIMDSort32BitIntegerTest) {
+  // Four processes over socket pairs, shards of different sizes over disjoint
+  // key ranges, one of them empty; then three processes over Unix socket paths
+  // with duplicate keys, and two with no keys at all
+  std::vector<std::vector<int>> shards;
+  std::vector<size_t> sizes = {NNUM * 4, NNUM, 0, NNUM * 2};
+  for (size_t r = 0; r < sizes.size(); r++) {
+    size_t N = sizes[r];
+    int *rand_arr;
+    int lo = LO + (int) r * (HI - LO) / 4;
+    TestUtil::RandGenInt(rand_arr, std::max(N, (size_t) 1), lo, lo + (HI - LO) / 4);
+    shards.emplace_back(rand_arr, rand_arr + N);
+    delete rand_arr;
+  }
+  std::vector<std::vector<int>> mesh = SocketTransport::Mesh(4);
+  double start = currentSeconds();
+  EXPECT_TRUE(ForkRanks(4, [&](int rank) {
+    for (int other = 0; other < 4; other++) {
+      if (other != rank) {
+        for (int fd : mesh[other]) {
+          if (fd >= 0) {
+            close(fd);
+          }
+        }
+      }
+    }
+    return std::unique_ptr<Transport>(new SocketTransport(rank, mesh[rank]));
+  }, shards));
+  double end = currentSeconds();
+  printf("[avx512::distributed_sort] %lu elements on 4 ranks: %.8f seconds\n", (size_t) NNUM * 7, end - start);
+
+  shards.clear();
+  std::vector<std::string> endpoints;
+  for (int rank = 0; rank < 3; rank++) {
+    int *rand_arr;
+    TestUtil::RandGenInt(rand_arr, NNUM, 0, 10);
+    shards.emplace_back(rand_arr, rand_arr + NNUM);
+    delete rand_arr;
+    endpoints.push_back("unix:/tmp/ultrasort-" + std::to_string(getpid()) + "-" + std::to_string(rank));
+  }
+  EXPECT_TRUE(ForkRanks(3, [&](int rank) {
+    return std::unique_ptr<Transport>(SocketTransport::Connect(rank, endpoints));
+  }, shards));
+
+  // No rank has keys
+  shards.assign(2, std::vector<int>());
+  mesh = SocketTransport::Mesh(2);
+  EXPECT_TRUE(ForkRanks(2, [&](int rank) {
+    for (int fd : mesh[1 - rank]) {
+      if (fd >= 0) {
+        close(fd);
+      }
+    }
+    return std::unique_ptr<Transport>(new SocketTransport(rank, mesh[rank]));
+  }, shards));
+}
+
+TEST(SIMDSortTests, AVX512ExternalSIMDSort32BitIntegerTest) {
+  // 1 MiB of memory gives runs of 128K keys; a fan-in of 2 takes two passes
+  size_t N = NNUM * 4 + 123;
+  int *rand_arr;
+  double start, end;
+
+  TestUtil::RandGenInt(rand_arr, N, LO, HI);
+  std::string dir = "/tmp/ultrasort-external-" + std::to_string(getpid());
+  mkdir(dir.c_str(), 0755);
+  std::string input = dir + "/input";
+  std::string output = dir + "/output";
+  int fd = OpenFile(input, O_WRONLY | O_CREAT | O_TRUNC);
+  WriteFully(fd, rand_arr, N * sizeof(int), 0);
+  close(fd);
+  std::vector<int> check_arr(rand_arr, rand_arr + N);
+  std::sort(check_arr.begin(), check_arr.end());
+
+  ExternalSortOptions options;
+  options.memory_bytes = 1 << 20;
+  options.max_fan_in = 2;
+  start = currentSeconds();
+  ExternalSIMDSort(input, output, KEY_INT32, options);
+  end = currentSeconds();
+  fd = OpenFile(output, O_RDONLY);
+  ASSERT_EQ(N * sizeof(int), FileSize(fd));
+  std::vector<int> soln_arr(N);
+  ReadFully(fd, soln_arr.data(), N * sizeof(int), 0);
+  close(fd);
+  EXPECT_EQ(check_arr, soln_arr);
+  printf("[avx512::external_sort] %lu elements: %.8f seconds\n", N, end - start);
+
+  // A fan-in too wide for the memory is cut back to 2
+  options.max_fan_in = 256;
+  ExternalSIMDSort(input, output, KEY_INT32, options);
+  fd = OpenFile(output, O_RDONLY);
+  ReadFully(fd, soln_arr.data(), N * sizeof(int), 0);
+  close(fd);
+  EXPECT_EQ(check_arr, soln_arr);
+
+  // An output that cannot be created fails the last merge, and the runs
+  // spilled to dir are removed again
+  options.temp_dir = dir;
+  options.max_fan_in = 8;
+  EXPECT_THROW(ExternalSIMDSort(input, dir + "/missing/output", KEY_INT32, options), std::system_error);
+
+  // Only the input and output are left
+  unlink(input.c_str());
+  unlink(output.c_str());
+  EXPECT_EQ(0, rmdir(dir.c_str()));
+  delete rand_arr;
+}
+
+TEST(SIMDSortTests, AVX512RunFileRange32BitIntegerTest) {
+  // Output as a run file of 4 KiB blocks, after merging runs of 128K keys
+  size_t N = NNUM * 4 + 123;
+  int *rand_arr;
+  double start, end;
+
+  TestUtil::RandGenInt(rand_arr, N, LO, HI);
+  std::string input = "/tmp/ultrasort-run-input-" + std::to_string(getpid());
+  std::string output = "/tmp/ultrasort-run-output-" + std::to_string(getpid());
+  int fd = OpenFile(input, O_WRONLY | O_CREAT | O_TRUNC);
+  WriteFully(fd, rand_arr, N * sizeof(int), 0);
+  close(fd);
+  std::vector<int> check_arr(rand_arr, rand_arr + N);
+  std::sort(check_arr.begin(), check_arr.end());
+
+  ExternalSortOptions options;
+  options.memory_bytes = 1 << 20;
+  options.run_block_bytes = 4096;
+  options.indexed_output = true;
+  ExternalSIMDSort(input, output, KEY_INT32, options);
+  RunFileReader<int> run(output);
+  ASSERT_EQ(N, run.Size());
+  ASSERT_EQ((N + 1023) / 1024, run.Blocks());
+  std::vector<int> soln_arr(N);
+  fd = OpenFile(output, O_RDONLY);
+  ReadFully(fd, soln_arr.data(), N * sizeof(int), 0);
+  close(fd);
+  EXPECT_EQ(check_arr, soln_arr);
+  for (size_t b = 0; b < run.Blocks(); b++) {
+    EXPECT_EQ(check_arr[b * 1024], run.BlockMin(b));
+    EXPECT_EQ(check_arr[std::min(b * 1024 + 1023, N - 1)], run.BlockMax(b));
+  }
+
+  start = currentSeconds();
+  for (int q = 0; q < 100; q++) {
+    int lo = LO + (HI - LO) / 100 * q;
+    int hi = lo + (HI - LO) / 1000;
+    std::vector<int> range;
+    run.Range(lo, hi, range);
+    EXPECT_EQ(std::vector<int>(std::lower_bound(check_arr.begin(), check_arr.end(), lo),
+                               std::upper_bound(check_arr.begin(), check_arr.end(), hi)), range);
+  }
+  end = currentSeconds();
+  printf("[avx512::run_file] 100 range lookups in %lu elements: %.8f seconds\n", N, end - start);
+  EXPECT_THROW(RunFileReader<float>{output}, std::invalid_argument);
+  EXPECT_THROW(RunFileReader<int>{input}, std::invalid_argument);
+
+  unlink(input.c_str());
+  unlink(output.c_str());
+  delete rand_arr;
+}
+
+TEST(SIMDSortTests, AVX512SortFile32BitIntegerTest) {
+  // Not a power of 2, keys and then key-value pairs with the index as value
+  size_t N = NNUM * 4 + 123;
+  int *rand_arr;
+  double start, end;
+
+  TestUtil::RandGenInt(rand_arr, N, LO, HI);
+  std::string path = "/tmp/ultrasort-sort-file-" + std::to_string(getpid());
+  int fd = OpenFile(path, O_RDWR | O_CREAT | O_TRUNC);
+  WriteFully(fd, rand_arr, N * sizeof(int), 0);
+  std::vector<int> check_arr(rand_arr, rand_arr + N);
+  std::sort(check_arr.begin(), check_arr.end());
+  start = currentSeconds();
+  SortFile(path, KEY_INT32);
+  end = currentSeconds();
+  std::vector<int> soln_arr(N);
+  ReadFully(fd, soln_arr.data(), N * sizeof(int), 0);
+  EXPECT_EQ(check_arr, soln_arr);
+  printf("[avx512::sort_file] %lu elements: %.8f seconds\n", N, end - start);
+
+  std::vector<std::pair<int, int>> pairs(N);
+  for (size_t i = 0; i < N; i++) {
+    pairs[i] = {rand_arr[i], (int) i};
+  }
+  ASSERT_EQ(0, ftruncate(fd, 0));
+  WriteFully(fd, pairs.data(), N * sizeof(pairs[0]), 0);
+  start = currentSeconds();
+  SortFile(path, KEY_INT32_KV);
+  end = currentSeconds();
+  ReadFully(fd, pairs.data(), N * sizeof(pairs[0]), 0);
+  std::vector<bool> seen(N, false);
+  for (size_t i = 0; i < N; i++) {
+    EXPECT_EQ(check_arr[i], pairs[i].first);
+    EXPECT_EQ(rand_arr[pairs[i].second], pairs[i].first);
+    seen[pairs[i].second] = true;
+  }
+  EXPECT_EQ(std::vector<bool>(N, true), seen);
+  printf("[avx512::sort_file] %lu pairs: %.8f seconds\n", N, end - start);
+
+  // A partial record is rejected
+  WriteFully(fd, rand_arr, 1, N * sizeof(pairs[0]));
+  EXPECT_THROW(SortFile(path, KEY_INT32_KV), std::invalid_argument);
+  close(fd);
+  unlink(path.c_str());
+  delete rand_arr;
+}
+
+TEST(SIMDSortTests, AVX512SIMDSortHugePages64BitIntegerTest) {
+  // Same sort on 4 KiB and on transparent huge pages, with dTLB load misses
+  size_t N = NNUM * 64;
+  int64_t lo = LO;
+  int64_t hi = HI;
+  int64_t *rand_arr;
+  double start, end;
+
+  TestUtil::RandGenInt(rand_arr, N, lo, hi);
+  std::vector<int64_t> check_arr(rand_arr, rand_arr + N);
+  std::sort(check_arr.begin(), check_arr.end());
+  bool huge_pages = HugePagesEnabled();
+  for (bool huge : {false, true}) {
+    SetHugePages(huge);
+    int64_t *soln_arr;
+    aligned_init<int64_t>(soln_arr, N);
+    std::copy(rand_arr, rand_arr + N, soln_arr);
+    PerfCounter dtlb_misses(PERF_TYPE_HW_CACHE, PERF_DTLB_LOAD_MISSES);
+    start = currentSeconds();
+    dtlb_misses.Start();
+    SIMDSort(N, soln_arr);
+    int64_t misses = dtlb_misses.Stop();
+    end = currentSeconds();
+    for (unsigned int i = 0; i < N; i++) {
+      EXPECT_EQ(check_arr[i], soln_arr[i]);
+    }
+    printf("[avx512::sort %s pages] %lu elements: %.8f seconds, ", huge ? "2M" : "4K", N, end - start);
+    if (misses >= 0) {
+      printf("%ld dTLB load misses\n", misses);
+    } else {
+      printf("dTLB counter unavailable\n");
+    }
+    free(soln_arr);
+  }
+  SetHugePages(huge_pages);
+  delete rand_arr;
+}
+
+
+TEST(SIMDSortTests, AVX512SIMDSortAllocatorTest) {
+  // Key-value sorts release all of their work memory through the allocator
+  using T = float;
+  size_t N = NNUM;
+  T lo = LO;
+  T hi = HI;
+  std::pair<T, T> *rand_arr;
+  std::pair<T, T> *soln_arr;
+  std::pair<int, int> *int_arr;
+  std::pair<int, int> *result_arr;
+
+  TestUtil::RandGenFloatRecords(rand_arr, N, lo, hi);
+  TestUtil::RandGenIntRecords(int_arr, N, (int) lo, (int) hi);
+  aligned_init<std::pair<T, T>>(soln_arr, N);
+  std::copy(rand_arr, rand_arr + N, soln_arr);
+  std::pair<T, T> *input = soln_arr;
+  size_t outstanding = 0;
+  {
+    ScopedAllocator scoped({CountingAllocate, CountingDeallocate, &outstanding});
+    // The pairs are sorted in place and the scratch buffer is released
+    SIMDSort(N, soln_arr);
+    EXPECT_EQ(soln_arr, input);
+    EXPECT_EQ(outstanding, 0);
+    SIMDOrderBy(result_arr, N, int_arr, 0);
+    EXPECT_EQ(outstanding, N * sizeof(std::pair<int, int>));
+    aligned_free(result_arr, N);
+  }
+  EXPECT_EQ(outstanding, 0);
+  for (unsigned int i = 1; i < N; i++) {
+    EXPECT_LE(soln_arr[i - 1].first, soln_arr[i].first);
+  }
+  delete rand_arr;
+  delete soln_arr;
+  delete int_arr;
+}
+
+TEST(SIMDSortTests, AVX512PartitionedSIMDSortAllocatorTest) {
+  // A single slice or a k-way merge, the sort owns the input and the result
+  // and keeps nothing else
+  size_t N = NNUM * 4;
+  int *rand_arr;
+  int *soln_arr;
+
+  TestUtil::RandGenInt(rand_arr, N, LO, HI);
+  std::vector<int> check_arr(rand_arr, rand_arr + N);
+  std::sort(check_arr.begin(), check_arr.end());
+  for (int threads : {1, 8}) {
+    ExecutionContext context;
+    context.threads = threads;
+    ScopedExecutionContext scoped_context(context);
+    size_t outstanding = 0;
+    {
+      ScopedAllocator scoped({CountingAllocate, CountingDeallocate, &outstanding});
+      aligned_init<int>(soln_arr, N);
+      std::copy(rand_arr, rand_arr + N, soln_arr);
+      int *input = soln_arr;
+      PartitionedSIMDSort(N, soln_arr);
+      EXPECT_EQ(outstanding, (soln_arr == input ? 1 : 2) * N * sizeof(int));
+      for (unsigned int i = 0; i < N; i++) {
+        EXPECT_EQ(check_arr[i], soln_arr[i]);
+      }
+      if (soln_arr != input) {
+        aligned_free(input, N);
+      }
+      aligned_free(soln_arr, N);
+    }
+    EXPECT_EQ(outstanding, 0);
+  }
+  delete rand_arr;
+}
+
+TEST(SIMDSortTests, AVX512SIMDSortBumpArenaTest) {
+  // Scratch comes out of a preallocated region and the sort stays in place
+  size_t N = NNUM * 16;
+  int lo = LO;
+  int hi = HI;
+  int *rand_arr;
+  int *soln_arr;
+  int *region;
+  double start, end;
+
+  TestUtil::RandGenInt(rand_arr, N, lo, hi);
+  aligned_init<int>(soln_arr, N);
+  std::copy(rand_arr, rand_arr + N, soln_arr);
+  std::vector<int> check_arr(rand_arr, rand_arr + N);
+  std::sort(check_arr.begin(), check_arr.end());
+  aligned_init<int>(region, 2 * N);
+  BumpArena arena(region, 2 * N * sizeof(int));
+  int *input = soln_arr;
+  {
+    ScopedAllocator scoped(arena.GetAllocator());
+    start = currentSeconds();
+    SIMDSort(N, soln_arr);
+    end = currentSeconds();
+  }
+  EXPECT_EQ(arena.Used(), N * sizeof(int));
+  for (unsigned int i = 0; i < N; i++) {
+    EXPECT_EQ(check_arr[i], soln_arr[i]);
+  }
+  printf("[avx512::sort arena] %lu elements: %.8f seconds\n", N, end - start);
+  if (soln_arr == input) {
+    arena.Reset();
+    EXPECT_EQ(arena.Used(), 0);
+  }
+  delete rand_arr;
+  delete input;
+  delete region;
+}
+
+TEST(SIMDSortTests, AVX512SIMDSortExecutionContextTest) {
+  // The team is confined to the given CPUs and the caller's settings come back
+  size_t N = NNUM * 16;
+  int lo = LO;
+  int hi = HI;
+  int *rand_arr;
+  int *soln_arr;
+  double start, end;
+
+  TestUtil::RandGenInt(rand_arr, N, lo, hi);
+  aligned_init<int>(soln_arr, N);
+  std::copy(rand_arr, rand_arr + N, soln_arr);
+  std::vector<int> check_arr(rand_arr, rand_arr + N);
+  std::sort(check_arr.begin(), check_arr.end());
+  cpu_set_t affinity, after;
+  sched_getaffinity(0, sizeof(affinity), &affinity);
+  int max_threads = omp_get_max_threads();
+  ExecutionContext context;
+  context.threads = 2;
+  for (int cpu = 0; context.cpus.empty(); cpu++) {
+    if (CPU_ISSET(cpu, &affinity)) {
+      context.cpus.push_back(cpu);
+    }
+  }
+  int *input = soln_arr;
+  {
+    ScopedExecutionContext scoped(context);
+    start = currentSeconds();
+    SIMDSort(N, soln_arr);
+    end = currentSeconds();
+  }
+  for (unsigned int i = 0; i < N; i++) {
+    EXPECT_EQ(check_arr[i], soln_arr[i]);
+  }
+  sched_getaffinity(0, sizeof(after), &after);
+  EXPECT_TRUE(CPU_EQUAL(&affinity, &after));
+  // So do the pooled threads that ran the team
+  bool restored = true;
+#pragma omp parallel num_threads(2) reduction(&&: restored)
+  {
+    cpu_set_t thread_after;
+    sched_getaffinity(0, sizeof(thread_after), &thread_after);
+    restored = CPU_EQUAL(&affinity, &thread_after);
+  }
+  EXPECT_TRUE(restored);
+  EXPECT_EQ(omp_get_max_threads(), max_threads);
+  EXPECT_EQ(ThreadBudgetInUse(), 0);
+  printf("[avx512::sort one cpu] %lu elements: %.8f seconds\n", N, end - start);
+  if (soln_arr != input) {
+    aligned_free(soln_arr, N);
+  }
+  delete rand_arr;
+  delete input;
+}
+
+TEST(SIMDSortTests, AVX512SIMDSortThreadBudgetTest) {
+  // Concurrent low priority sorts from several threads share two helpers
+  const int CALLERS = 4;
+  size_t N = NNUM * 4;
+  int lo = LO;
+  int hi = HI;
+  int *rand_arr[CALLERS];
+  int *soln_arr[CALLERS];
+  double start, end;
+
+  for (int c = 0; c < CALLERS; c++) {
+    TestUtil::RandGenInt(rand_arr[c], N, lo, hi);
+    aligned_init<int>(soln_arr[c], N);
+    std::copy(rand_arr[c], rand_arr[c] + N, soln_arr[c]);
+  }
+  SetThreadBudget(2);
+  std::vector<std::thread> callers;
+  start = currentSeconds();
+  for (int c = 0; c < CALLERS; c++) {
+    callers.emplace_back([&, c]() {
+      ExecutionContext context;
+      context.threads = 4;
+      context.priority = 1;
+      ScopedExecutionContext scoped(context);
+      int *input = soln_arr[c];
+      SIMDSort(N, soln_arr[c]);
+      if (soln_arr[c] != input) {
+        std::copy(soln_arr[c], soln_arr[c] + N, input);
+        aligned_free(soln_arr[c], N);
+        soln_arr[c] = input;
+      }
+    });
+  }
+  for (std::thread &caller : callers) {
+    caller.join();
+  }
+  end = currentSeconds();
+  SetThreadBudget(0);
+  EXPECT_EQ(ThreadBudgetInUse(), 0);
+  for (int c = 0; c < CALLERS; c++) {
+    std::sort(rand_arr[c], rand_arr[c] + N);
+    for (unsigned int i = 0; i < N; i++) {
+      EXPECT_EQ(rand_arr[c][i], soln_arr[c][i]);
+    }
+    delete rand_arr[c];
+    delete soln_arr[c];
+  }
+  printf("[avx512::sort budget] %d x %lu elements: %.8f seconds\n", CALLERS, N, end - start);
+}
+
+TEST(SIMDSortTests, AVX512SIMDSortExecutorTest) {
+  // Block sorts and merges are submitted to the host's pool instead of OpenMP
+  size_t N = NNUM * 16;
+  int lo = LO;
+  int hi = HI;
+  int *rand_arr;
+  int *soln_arr;
+  std::pair<int, int> *records;
+  std::pair<int, int> *result_arr;
+  double start, end;
+
+  TestUtil::RandGenInt(rand_arr, N, lo, hi);
+  TestUtil::RandGenIntRecords(records, N, lo, hi);
+  aligned_init<int>(soln_arr, N);
+  std::copy(rand_arr, rand_arr + N, soln_arr);
+  std::vector<int> check_arr(rand_arr, rand_arr + N);
+  std::sort(check_arr.begin(), check_arr.end());
+  int *input = soln_arr;
+  TestPool pool = {4, {0}};
+  ExecutionContext context;
+  context.executor = {TestPoolParallelFor, pool.threads, &pool};
+  {
+    ScopedExecutionContext scoped(context);
+    start = currentSeconds();
+    SIMDSort(N, soln_arr);
+    end = currentSeconds();
+    EXPECT_GE(pool.items, N / CacheBlockSize(N, sizeof(int), 256));
+    for (unsigned int i = 0; i < N; i++) {
+      EXPECT_EQ(check_arr[i], soln_arr[i]);
+    }
+    std::copy(rand_arr, rand_arr + N, input);
+    LowMemorySIMDSort(N, input, 64 * 1024);
+    for (unsigned int i = 0; i < N; i++) {
+      EXPECT_EQ(check_arr[i], input[i]);
+    }
+    SIMDOrderBy(result_arr, N, records, 0);
+    std::stable_sort(records, records + N, [](const std::pair<int, int> &a, const std::pair<int, int> &b) {
+      return a.first < b.first;
+    });
+    for (unsigned int i = 0; i < N; i++) {
+      EXPECT_EQ(records[i], result_arr[i]);
+    }
+  }
+  printf("[avx512::sort executor] %lu elements: %.8f seconds\n", N, end - start);
+  aligned_free(result_arr, N);
+  if (soln_arr != input) {
+    aligned_free(soln_arr, N);
+  }
+  delete rand_arr;
+  delete input;
+  delete records;
+}
+
+TEST(SIMDSortTests, AVX512MergeRunsAffinityPolicyTest) {
+  // Merge phase alone under each placement of the team
+  size_t N = NNUM * 64;
+  int lo = LO;
+  int hi = HI;
+  int *rand_arr;
+  int *soln_arr;
+  double start, end;
+
+  TestUtil::RandGenInt(rand_arr, N, lo, hi);
+  for (size_t i = 0; i < N; i += 16) {
+    std::sort(rand_arr + i, rand_arr + i + 16);
+  }
+  std::vector<int> check_arr(rand_arr, rand_arr + N);
+  std::sort(check_arr.begin(), check_arr.end());
+  aligned_init<int>(soln_arr, N);
+  int *input = soln_arr;
+  // The list policy runs the team on the allowed CPUs in reverse order
+  std::vector<int> cpus;
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  sched_getaffinity(0, sizeof(allowed), &allowed);
+  for (int cpu = CPU_SETSIZE - 1; cpu >= 0; cpu--) {
+    if (CPU_ISSET(cpu, &allowed)) {
+      cpus.push_back(cpu);
+    }
+  }
+  const char *names[] = {"none", "compact", "scatter", "compact no smt", "scatter no smt", "list"};
+  AffinityPolicy policies[] = {AFFINITY_NONE, AFFINITY_COMPACT, AFFINITY_SCATTER, AFFINITY_COMPACT, AFFINITY_SCATTER,
+                               AFFINITY_LIST};
+  for (int p = 0; p < 6; p++) {
+    ExecutionContext context;
+    context.affinity = policies[p];
+    context.skip_smt_siblings = p == 3 || p == 4;
+    if (policies[p] == AFFINITY_LIST) {
+      context.cpus = cpus;
+    }
+    std::copy(rand_arr, rand_arr + N, input);
+    soln_arr = input;
+    {
+      ScopedExecutionContext scoped(context);
+      start = currentSeconds();
+      MergeRuns16<int, __m512i>(soln_arr, N);
+      end = currentSeconds();
+    }
+    for (unsigned int i = 0; i < N; i++) {
+      EXPECT_EQ(check_arr[i], soln_arr[i]);
+    }
+    printf("[avx512::merge_runs %s] %lu elements: %.8f seconds\n", names[p], N, end - start);
+    if (soln_arr != input) {
+      aligned_free(soln_arr, N);
+    }
+  }
+  delete rand_arr;
+  delete input;
+}
+
+TEST(SIMDSortTests, AVX512SIMDSortStreamingThreadsTest) {
+  // Halves the threads of memory-bound passes until the bandwidth drops
+  size_t GB = 1 << 30;
+  SetAdaptiveStreamingThreads(true);
+  EXPECT_EQ(StreamingThreads(16), 16);
+  ReportStreamingPass(16, 20 * GB, 1.0);
+  EXPECT_EQ(StreamingThreads(16), 8);
+  ReportStreamingPass(8, 19 * GB, 1.0);
+  EXPECT_EQ(StreamingThreads(16), 4);
+  ReportStreamingPass(4, 12 * GB, 1.0);
+  EXPECT_EQ(StreamingThreads(16), 8);
+  EXPECT_EQ(StreamingThreads(2), 2);
+  SetAdaptiveStreamingThreads(false);
+  EXPECT_EQ(StreamingThreads(16), 16);
+  SetAdaptiveStreamingThreads(true);
+}
+
+TEST(SIMDSortTests, AVX512SortAsyncTest) {
+  // Sorts in flight on the shared pool and on a private one interleave
+  const int SORTS = 8;
+  size_t N = NNUM * 4;
+  int lo = LO;
+  int hi = HI;
+  int *rand_arr[SORTS];
+  int *soln_arr[SORTS];
+  std::pair<float, float> *kv_arr;
+  std::future<int *> sorted[SORTS];
+  double start, end;
+
+  for (int s = 0; s < SORTS; s++) {
+    TestUtil::RandGenInt(rand_arr[s], N << (s % 3), lo, hi);
+    aligned_init<int>(soln_arr[s], N << (s % 3));
+    std::copy(rand_arr[s], rand_arr[s] + (N << (s % 3)), soln_arr[s]);
+  }
+  TestUtil::RandGenFloatRecords(kv_arr, N, (float) lo, (float) hi);
+  std::vector<std::pair<float, float>> check_kv(kv_arr, kv_arr + N);
+  std::sort(check_kv.begin(), check_kv.end(), [](const std::pair<float, float> &a, const std::pair<float, float> &b) {
+    return a.first < b.first;
+  });
+  SortPool pool(2);
+  start = currentSeconds();
+  std::future<std::pair<float, float> *> sorted_kv = SortAsync(N, kv_arr, pool);
+  for (int s = 0; s < SORTS; s++) {
+    sorted[s] = s % 2 == 0 ? SortAsync(N << (s % 3), soln_arr[s]) : SortAsync(N << (s % 3), soln_arr[s], pool);
+  }
+  int *results[SORTS];
+  for (int s = 0; s < SORTS; s++) {
+    results[s] = sorted[s].get();
+  }
+  std::pair<float, float> *kv_result = sorted_kv.get();
+  end = currentSeconds();
+  for (int s = 0; s < SORTS; s++) {
+    int *result = results[s];
+    std::sort(rand_arr[s], rand_arr[s] + (N << (s % 3)));
+    for (unsigned int i = 0; i < N << (s % 3); i++) {
+      EXPECT_EQ(rand_arr[s][i], result[i]);
+    }
+    if (result != soln_arr[s]) {
+      aligned_free(result, N << (s % 3));
+    }
+    delete rand_arr[s];
+    delete soln_arr[s];
+  }
+  for (unsigned int i = 0; i < N; i++) {
+    EXPECT_EQ(check_kv[i].first, kv_result[i].first);
+  }
+  printf("[avx512::sort async] %d sorts of %lu to %lu elements: %.8f seconds\n", SORTS + 1, N, N << 2, end - start);
+  if (kv_result != kv_arr) {
+    aligned_free(kv_result, N);
+  }
+  delete kv_arr;
+}
+
+TEST(SIMDSortTests, AVX512SlicedSort32BitIntegerTest) {
+  // Resumed in 200us slices, and in slices of a fixed amount of work
+  size_t N = NNUM * 16;
+  int lo = LO;
+  int hi = HI;
+  int *rand_arr;
+  int *soln_arr;
+  double start, end;
+
+  TestUtil::RandGenInt(rand_arr, N, lo, hi);
+  std::vector<int> check_arr(rand_arr, rand_arr + N);
+  std::sort(check_arr.begin(), check_arr.end());
+  aligned_init<int>(soln_arr, N);
+  std::copy(rand_arr, rand_arr + N, soln_arr);
+  int steps = 0;
+  double longest = 0;
+  {
+    SlicedSort<int> sort(N, soln_arr);
+    bool done = false;
+    while (!done) {
+      start = currentSeconds();
+      done = sort.Step(200);
+      end = currentSeconds();
+      longest = std::max(longest, end - start);
+      steps++;
+    }
+    int *result = sort.Result();
+    for (unsigned int i = 0; i < N; i++) {
+      EXPECT_EQ(check_arr[i], result[i]);
+    }
+    if (result != soln_arr) {
+      aligned_free(result, N);
+    }
+  }
+  printf("[avx512::sliced_sort 200us] %lu elements: %d steps, longest %.8f seconds\n", N, steps, longest);
+
+  std::copy(rand_arr, rand_arr + N, soln_arr);
+  SlicedSort<int> sort(N, soln_arr);
+  EXPECT_FALSE(sort.Step(1000000, 1));
+  EXPECT_FALSE(sort.Done());
+  while (!sort.Step(1000000, N)) {
+  }
+  int *result = sort.Result();
+  for (unsigned int i = 0; i < N; i++) {
+    EXPECT_EQ(check_arr[i], result[i]);
+  }
+  if (result != soln_arr) {
+    aligned_free(result, N);
+  }
+  delete rand_arr;
+  delete soln_arr;
+}
+
+TEST(SIMDSortTests, AVX512SortPipeline32BitIntegerTest) {
+  // Producers push uneven pieces while the workers sort full chunks
+  size_t N = NNUM * 16 + 1000;
+  int lo = LO;
+  int hi = HI;
+  int *rand_arr;
+  double start, end;
+
+  TestUtil::RandGenInt(rand_arr, N, lo, hi);
+  std::vector<int> check_arr(rand_arr, rand_arr + N);
+  std::sort(check_arr.begin(), check_arr.end());
+  const int PRODUCERS = 4;
+  size_t N_result;
+  int *result;
+  start = currentSeconds();
+  {
+    SortPipeline<int> pipeline(1 << 14, 2, 2);
+    std::vector<std::thread> producers;
+    for (int p = 0; p < PRODUCERS; p++) {
+      producers.emplace_back([&, p]() {
+        size_t begin = p * N / PRODUCERS;
+        size_t end = (p + 1) * N / PRODUCERS;
+        for (size_t i = begin; i < end; i += 3001) {
+          pipeline.Push(&rand_arr[i], std::min(end - i, (size_t) 3001));
+        }
+      });
+    }
+    for (std::thread &producer : producers) {
+      producer.join();
+    }
+    result = pipeline.Finish(N_result);
+  }
+  end = currentSeconds();
+  EXPECT_EQ(N, N_result);
+  for (unsigned int i = 0; i < N; i++) {
+    EXPECT_EQ(check_arr[i], result[i]);
+  }
+  aligned_free(result, N_result);
+  printf("[avx512::sort_pipeline] %lu elements: %.8f seconds\n", N, end - start);
+
+  SortPipeline<int> empty;
+  EXPECT_EQ(nullptr, empty.Finish(N_result));
+  EXPECT_EQ(0u, N_result);
+  delete rand_arr;
+}
+
+TEST(SIMDSortTests, AVX512SortPipelineAllocatorTest) {
+  // Producers, workers and merger all use the allocator of the constructor
+  size_t N = NNUM * 4 + 1000;
+  int lo = LO;
+  int hi = HI;
+  int *rand_arr;
+  size_t outstanding = 0;
+  Allocator counting = {CountingAllocate, CountingDeallocate, &outstanding};
+
+  TestUtil::RandGenInt(rand_arr, N, lo, hi);
+  std::vector<int> check_arr(rand_arr, rand_arr + N);
+  std::sort(check_arr.begin(), check_arr.end());
+  size_t N_result;
+  int *result;
+  {
+    std::unique_ptr<SortPipeline<int>> pipeline;
+    {
+      ScopedAllocator scoped(counting);
+      pipeline.reset(new SortPipeline<int>(1 << 12, 2, 2));
+    }
+    std::thread producer([&]() {
+      for (size_t i = 0; i < N; i += 3001) {
+        pipeline->Push(&rand_arr[i], std::min(N - i, (size_t) 3001));
+      }
+    });
+    producer.join();
+    result = pipeline->Finish(N_result);
+  }
+  // Only the result is left, and it goes back to the same allocator
+  EXPECT_EQ(N * sizeof(int), outstanding);
+  EXPECT_EQ(N, N_result);
+  for (unsigned int i = 0; i < N; i++) {
+    EXPECT_EQ(check_arr[i], result[i]);
+  }
+  {
+    ScopedAllocator scoped(counting);
+    aligned_free(result, N_result);
+  }
+  EXPECT_EQ(0u, outstanding);
+  delete rand_arr;
+}
+
+TEST(SIMDSortTests, AVX512SortPipelineBumpArenaTest) {
+  // The arena is not thread safe, the pipeline's threads take turns on it
+  size_t N = NNUM * 4 + 1000;
+  int lo = LO;
+  int hi = HI;
+  int *rand_arr;
+  int *region;
+
+  TestUtil::RandGenInt(rand_arr, N, lo, hi);
+  std::vector<int> check_arr(rand_arr, rand_arr + N);
+  std::sort(check_arr.begin(), check_arr.end());
+  // Frees are no-ops: every chunk, sort buffer and merged run stays allocated
+  aligned_init<int>(region, 16 * N);
+  BumpArena arena(region, 16 * N * sizeof(int));
+  size_t N_result;
+  int *result;
+  {
+    std::unique_ptr<SortPipeline<int>> pipeline;
+    {
+      ScopedAllocator scoped(arena.GetAllocator());
+      pipeline.reset(new SortPipeline<int>(1 << 12, 4, 2));
+    }
+    std::vector<std::thread> producers;
+    for (size_t p = 0; p < 2; p++) {
+      producers.emplace_back([&, p]() {
+        size_t half = N / 2;
+        size_t end = p == 0 ? half : N;
+        for (size_t i = p * half; i < end; i += 3001) {
+          pipeline->Push(&rand_arr[i], std::min(end - i, (size_t) 3001));
+        }
+      });
+    }
+    for (std::thread &producer : producers) {
+      producer.join();
+    }
+    result = pipeline->Finish(N_result);
+  }
+  EXPECT_EQ(N, N_result);
+  EXPECT_GE(arena.Used(), N * sizeof(int));
+  for (unsigned int i = 0; i < N; i++) {
+    EXPECT_EQ(check_arr[i], result[i]);
+  }
+  delete rand_arr;
+  delete region;
+}
+
+TEST(SIMDSortTests, AVX512LowMemorySIMDSort32BitIntegerTest) {
+  // In place with the default O(sqrt(N)) scratch and with a small fixed budget
+  size_t N = NNUM * 16;
+  int lo = LO;
+  int hi = HI;
+  int *rand_arr;
+  int *soln_arr;
+  double start, end;
+
+  TestUtil::RandGenInt(rand_arr, N, lo, hi);
+  std::vector<int> check_arr(rand_arr, rand_arr + N);
+  std::sort(check_arr.begin(), check_arr.end());
+  aligned_init<int>(soln_arr, N);
+  for (size_t scratch_bytes : {(size_t) 0, (size_t) 64 * 1024}) {
+    std::copy(rand_arr, rand_arr + N, soln_arr);
+    start = currentSeconds();
+    LowMemorySIMDSort(N, soln_arr, scratch_bytes);
+    end = currentSeconds();
+    for (unsigned int i = 0; i < N; i++) {
+      EXPECT_EQ(check_arr[i], soln_arr[i]);
+    }
+    printf("[avx512::low_memory_sort %lu scratch bytes] %lu elements: %.8f seconds\n", scratch_bytes, N,
+           end - start);
+  }
+  delete rand_arr;
+  delete soln_arr;
+}
+
+TEST(SIMDSortTests, AVX512LowMemorySIMDSort32BitKeyValueFloatTest) {
+  using T = float;
+  size_t N = NNUM;
+  T lo = LO;
+  T hi = HI;
+  std::pair<T, T> *rand_arr;
+  std::pair<T, T> *soln_arr;
+  double start, end;
+
+  TestUtil::RandGenFloatRecords(rand_arr, N, lo, hi);
+  std::map<T, T> kv_map;
+  for (unsigned int i = 0; i < N; ++i) {
+    kv_map.insert(std::pair<T, T>(rand_arr[i].second, rand_arr[i].first));
+  }
+  aligned_init<std::pair<T, T>>(soln_arr, N);
+  std::copy(rand_arr, rand_arr + N, soln_arr);
+  std::vector<std::pair<T, T>> check_arr(rand_arr, rand_arr + N);
+  start = currentSeconds();
+  LowMemorySIMDSort(N, soln_arr);
+  end = currentSeconds();
+  std::sort(check_arr.begin(), check_arr.end(), [](std::pair<T, T> &left, std::pair<T, T> &right) {
+    return left.first < right.first;
+  });
+  for (unsigned int i = 0; i < N; i++) {
+    EXPECT_EQ(check_arr[i].first, soln_arr[i].first);
+    EXPECT_EQ(kv_map[soln_arr[i].second], soln_arr[i].first);
+  }
+  printf("[avx512::low_memory_sort] %lu elements: %.8f seconds\n", N, end - start);
+  delete rand_arr;
+  delete soln_arr;
+}
+
 }
 
 #endif
\ No newline at end of file
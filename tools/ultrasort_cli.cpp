@@ -0,0 +1,641 @@
+#include "metrics/cycletimer.h"
+#include "avx512/simd_sort.h"
+#include "avx256/simd_sort.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <fcntl.h>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+// Sorts binary files or stdin streams of fixed-width records by a key inside
+// them, and reports where the time went
+
+static const char *TYPE_NAMES[] = {"int32", "int64", "float", "double",
+                                   "int32-kv", "int64-kv", "float-kv", "double-kv"};
+static const char *ENGINES[] = {"lowmem", "simd", "partitioned", "numa", "mmap", "external"};
+
+// Records of 4-byte keys sort as 8-byte key-index pairs from this many on
+const size_t WIDE_INDEX_RECORDS = size_t(1) << 30;
+// Smallest power of two the padded engines sort, as the sorting networks
+// take whole blocks
+const size_t MIN_PADDED_RECORDS = 1 << 10;
+// Bytes per read and write of the mmap engine's copy to the output
+const size_t COPY_BYTES = size_t(64) << 20;
+
+struct Options {
+  std::string input = "-";
+  // Empty to sort the input file in place, or stdin to stdout
+  std::string output;
+  bool is_float = false;
+  size_t key_width = 4;
+  size_t key_offset = 0;
+  // 0 for the key width
+  size_t record_bytes = 0;
+  std::string isa = "auto";
+  std::string engine = "lowmem";
+  size_t scratch_bytes = 0;
+  ExternalSortOptions external;
+  bool verify = false;
+};
+
+class Phases {
+ public:
+  template<typename F>
+  void Run(const char *name, F f) {
+    double start = currentSeconds();
+    f();
+    phases_.push_back({name, currentSeconds() - start});
+  }
+
+  // Seconds of every phase and GB/s of the records through it
+  void Report(const Options &options, size_t records, size_t bytes) const {
+    double total = 0;
+    for (const auto &phase : phases_) {
+      total += phase.second;
+    }
+    fprintf(stderr, "%zu records of %zu bytes, key %s%zu at %zu, %s engine on %s\n", records,
+            options.record_bytes, options.is_float ? "float" : "int", 8 * options.key_width, options.key_offset,
+            options.engine.c_str(), options.isa.c_str());
+    for (const auto &phase : phases_) {
+      fprintf(stderr, "  %-8s %10.4f s %8.3f GB/s %5.1f%%\n", phase.first, phase.second, Rate(bytes, phase.second),
+              total > 0 ? 100 * phase.second / total : 0.0);
+    }
+    fprintf(stderr, "  %-8s %10.4f s %8.3f GB/s\n", "total", total, Rate(bytes, total));
+  }
+
+ private:
+  static double Rate(size_t bytes, double seconds) {
+    return seconds > 0 ? bytes / seconds / 1e9 : 0.0;
+  }
+
+  std::vector<std::pair<const char *, double>> phases_;
+};
+
+// Aligned bytes from aligned_init
+struct Buffer {
+  char *data = nullptr;
+  size_t capacity = 0;
+
+  ~Buffer() {
+    Reset(nullptr, 0);
+  }
+
+  void Reset(char *new_data, size_t new_capacity) {
+    if (data != nullptr) {
+      aligned_free(data, capacity);
+    }
+    data = new_data;
+    capacity = new_capacity;
+  }
+
+  // Grows to at least bytes, keeping the first used bytes
+  void Reserve(size_t bytes, size_t used) {
+    if (bytes <= capacity) {
+      return;
+    }
+    char *grown;
+    aligned_init(grown, bytes);
+    if (used > 0) {
+      memcpy(grown, data, used);
+    }
+    Reset(grown, bytes);
+  }
+};
+
+static void Usage(const char *program) {
+  fprintf(stderr, "usage: %s [OPTION]... [INPUT [TYPE]]\n", program);
+  fprintf(stderr,
+          "Sorts the fixed-width records of INPUT, or of stdin if INPUT is - or missing.\n"
+          "  -o, --output=PATH     sorted records, - for stdout; default: INPUT in place, stdout for stdin\n"
+          "  --record=BYTES        record width (default: the key width)\n"
+          "  --key-offset=BYTES    position of the key in a record (default: 0)\n"
+          "  --key-width=4|8       (default: 4)\n"
+          "  --key-type=int|float  (default: int)\n"
+          "  TYPE                  int32, int64, float or double for records of one key, or one of them\n"
+          "                        with -kv for a key and a value of its type\n"
+          "  --isa=auto|avx512|avx2\n"
+          "  --engine=ENGINE       lowmem (default, in place), simd, partitioned, numa: in memory;\n"
+          "                        mmap: SortFile through a mapping; external: ExternalSIMDSort\n"
+          "  --scratch=BYTES       scratch of the lowmem and mmap engines (default: O(sqrt N))\n"
+          "  --memory=BYTES        memory of the external engine (default: 1 GiB)\n"
+          "  --temp-dir=DIR        run files of the external engine\n"
+          "  --verify              check the order of the output\n"
+          "The phase breakdown goes to stderr.\n");
+  exit(2);
+}
+
+static bool Flag(const char *arg, const char *name, const char *&value) {
+  size_t length = strlen(name);
+  if (strncmp(arg, name, length) != 0 || arg[length] != '=') {
+    return false;
+  }
+  value = arg + length + 1;
+  return true;
+}
+
+static size_t Bytes(const char *value, const char *program) {
+  char *end;
+  size_t bytes = strtoull(value, &end, 10);
+  if (end == value || *end != '\0') {
+    Usage(program);
+  }
+  return bytes;
+}
+
+static Options Parse(int argc, char *argv[]) {
+  Options options;
+  std::vector<std::string> positional;
+  const char *value;
+  for (int i = 1; i < argc; i++) {
+    const char *arg = argv[i];
+    if (strcmp(arg, "-o") == 0 && i + 1 < argc) {
+      options.output = argv[++i];
+    } else if (Flag(arg, "--output", value)) {
+      options.output = value;
+    } else if (Flag(arg, "--record", value)) {
+      options.record_bytes = Bytes(value, argv[0]);
+    } else if (Flag(arg, "--key-offset", value)) {
+      options.key_offset = Bytes(value, argv[0]);
+    } else if (Flag(arg, "--key-width", value)) {
+      options.key_width = Bytes(value, argv[0]);
+    } else if (Flag(arg, "--key-type", value) && (strcmp(value, "int") == 0 || strcmp(value, "float") == 0)) {
+      options.is_float = strcmp(value, "float") == 0;
+    } else if (Flag(arg, "--isa", value)) {
+      options.isa = value;
+    } else if (Flag(arg, "--engine", value)) {
+      options.engine = value;
+    } else if (Flag(arg, "--scratch", value)) {
+      options.scratch_bytes = Bytes(value, argv[0]);
+    } else if (Flag(arg, "--memory", value)) {
+      options.external.memory_bytes = Bytes(value, argv[0]);
+    } else if (Flag(arg, "--temp-dir", value)) {
+      options.external.temp_dir = value;
+    } else if (strcmp(arg, "--verify") == 0) {
+      options.verify = true;
+    } else if (arg[0] == '-' && arg[1] != '\0') {
+      Usage(argv[0]);
+    } else {
+      positional.push_back(arg);
+    }
+  }
+  if (positional.size() > 2) {
+    Usage(argv[0]);
+  }
+  if (positional.size() > 0) {
+    options.input = positional[0];
+  }
+  if (positional.size() > 1) {
+    int type = std::find_if(TYPE_NAMES, TYPE_NAMES + 8, [&](const char *name) {
+      return positional[1] == name;
+    }) - TYPE_NAMES;
+    if (type == 8) {
+      Usage(argv[0]);
+    }
+    options.is_float = type % 4 >= 2;
+    options.key_width = type % 2 == 0 ? 4 : 8;
+    options.key_offset = 0;
+    options.record_bytes = type >= 4 ? 2 * options.key_width : options.key_width;
+  }
+  if (options.record_bytes == 0) {
+    options.record_bytes = options.key_width;
+  }
+  if ((options.key_width != 4 && options.key_width != 8) ||
+      options.key_offset + options.key_width > options.record_bytes ||
+      std::find(ENGINES, ENGINES + 6, options.engine) == ENGINES + 6) {
+    Usage(argv[0]);
+  }
+  if (options.output.empty()) {
+    options.output = options.input;
+  }
+  return options;
+}
+
+static bool Supported(const std::string &isa) {
+#ifdef AVX512
+  if (isa == "avx512") {
+    return __builtin_cpu_supports("avx512f");
+  }
+#endif
+#ifdef AVX2
+  if (isa == "avx2") {
+    return __builtin_cpu_supports("avx2");
+  }
+#endif
+  return false;
+}
+
+static void Check(bool condition, const std::string &message) {
+  if (!condition) {
+    throw std::invalid_argument(message);
+  }
+}
+
+static void ReadStream(int fd, Buffer &buffer, size_t &bytes) {
+  bytes = 0;
+  while (true) {
+    if (bytes == buffer.capacity) {
+      buffer.Reserve(std::max(size_t(1) << 20, 2 * buffer.capacity), bytes);
+    }
+    ssize_t n = read(fd, buffer.data + bytes, buffer.capacity - bytes);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      throw std::system_error(errno, std::generic_category(), "read");
+    }
+    if (n == 0) {
+      return;
+    }
+    bytes += n;
+  }
+}
+
+static void ReadInput(const std::string &path, Buffer &buffer, size_t &bytes) {
+  if (path == "-") {
+    ReadStream(STDIN_FILENO, buffer, bytes);
+    return;
+  }
+  int fd = OpenFile(path, O_RDONLY);
+  try {
+    bytes = FileSize(fd);
+    buffer.Reserve(std::max(bytes, (size_t) 64), 0);
+    ReadFully(fd, buffer.data, bytes, 0);
+  } catch (...) {
+    close(fd);
+    throw;
+  }
+  close(fd);
+}
+
+// write(2) rather than pwrite, which pipes do not take
+static void WriteOutput(const std::string &path, const char *data, size_t bytes) {
+  int fd = path == "-" ? STDOUT_FILENO : OpenFile(path, O_WRONLY | O_CREAT | O_TRUNC);
+  while (bytes > 0) {
+    ssize_t n = write(fd, data, bytes);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      int error = errno;
+      if (fd != STDOUT_FILENO) {
+        close(fd);
+      }
+      throw std::system_error(error, std::generic_category(), "write");
+    }
+    data += n;
+    bytes -= n;
+  }
+  if (fd != STDOUT_FILENO) {
+    close(fd);
+  }
+}
+
+template<typename K>
+static K ReadKey(const char *record) {
+  K key;
+  memcpy(&key, record, sizeof(K));
+  return key;
+}
+
+template<typename K>
+static void VerifyKeys(const char *data, size_t N, const Options &options) {
+  const char *keys = data + options.key_offset;
+  for (size_t i = 1; i < N; i++) {
+    if (ReadKey<K>(keys + i * options.record_bytes) < ReadKey<K>(keys + (i - 1) * options.record_bytes)) {
+      throw std::runtime_error("record " + std::to_string(i) + " is out of order");
+    }
+  }
+}
+
+template<typename K>
+static K PadKey() {
+  return std::numeric_limits<K>::has_infinity ? std::numeric_limits<K>::infinity() : std::numeric_limits<K>::max();
+}
+
+static size_t PowerOfTwo(size_t N) {
+  size_t size = MIN_PADDED_RECORDS;
+  while (size < N) {
+    size *= 2;
+  }
+  return size;
+}
+
+// The in-memory engines on the chosen instruction set; arr may come back as
+// another buffer, as from SIMDSort
+template<typename K>
+static void SortKeys(const Options &options, size_t N, K *&arr) {
+#ifdef AVX512
+  if (options.isa == "avx512") {
+    if (options.engine == "lowmem") {
+      avx512::LowMemorySIMDSort(N, arr, options.scratch_bytes);
+    } else if (options.engine == "simd") {
+      avx512::SIMDSort(N, arr);
+    } else if (options.engine == "partitioned") {
+      avx512::PartitionedSIMDSort(N, arr);
+    } else {
+      avx512::NumaSIMDSort(N, arr);
+    }
+    return;
+  }
+#endif
+#ifdef AVX2
+  if (options.engine == "lowmem") {
+    avx2::LowMemorySIMDSort(N, arr, options.scratch_bytes);
+  } else if (options.engine == "simd") {
+    avx2::SIMDSort(N, arr);
+  } else if (options.engine == "partitioned") {
+    avx2::PartitionedSIMDSort(N, arr);
+  } else {
+    avx2::NumaSIMDSort(N, arr);
+  }
+#endif
+}
+
+template<typename K>
+static void SortPairs(const Options &options, size_t N, std::pair<K, K> *&arr) {
+#ifdef AVX512
+  if (options.isa == "avx512") {
+    if (options.engine == "lowmem") {
+      avx512::LowMemorySIMDSort(N, arr, options.scratch_bytes);
+    } else {
+      avx512::SIMDSort(N, arr);
+    }
+    return;
+  }
+#endif
+#ifdef AVX2
+  if (options.engine == "lowmem") {
+    avx2::LowMemorySIMDSort(N, arr, options.scratch_bytes);
+  } else {
+    avx2::SIMDSort(N, arr);
+  }
+#endif
+}
+
+// The engines other than lowmem take powers of two, padded with the largest key
+template<typename T, typename Sort>
+static void SortPadded(const Options &options, size_t N, Buffer &buffer, T pad, Sort sort) {
+  if (options.engine == "lowmem") {
+    T *arr = (T *) buffer.data;
+    sort(N, arr);
+    return;
+  }
+  size_t size = PowerOfTwo(N);
+  buffer.Reserve(size * sizeof(T), N * sizeof(T));
+  T *arr = (T *) buffer.data;
+  std::fill(arr + N, arr + size, pad);
+  sort(size, arr);
+  if ((char *) arr != buffer.data) {
+    buffer.Reset((char *) arr, size * sizeof(T));
+  }
+}
+
+/**
+ * Sorts records with the key elsewhere than alone or in front of a value of its
+ * type: the keys are sorted as (key, index) pairs of type W, the index in the
+ * bits of the value, and the records are gathered in that order
+ */
+template<typename K, typename W>
+static void SortKeyIndex(const Options &options, size_t N, Buffer &records, Phases &phases) {
+  typedef typename std::conditional<sizeof(W) == 4, uint32_t, uint64_t>::type Bits;
+  Buffer pairs;
+  phases.Run("extract", [&]() {
+    size_t size = options.engine == "lowmem" ? N : PowerOfTwo(N);
+    pairs.Reserve(std::max(size, (size_t) 1) * sizeof(std::pair<W, W>), 0);
+    std::pair<W, W> *kv = (std::pair<W, W> *) pairs.data;
+#pragma omp parallel for schedule(static)
+    for (size_t i = 0; i < N; i++) {
+      Bits index = i;
+      kv[i].first = ReadKey<K>(records.data + i * options.record_bytes + options.key_offset);
+      memcpy(&kv[i].second, &index, sizeof(Bits));
+    }
+  });
+  // Pads carry index N, past the records
+  std::pair<W, W> pad(PadKey<W>(), 0);
+  Bits end = N;
+  memcpy(&pad.second, &end, sizeof(Bits));
+  phases.Run("sort", [&]() {
+    SortPadded(options, N, pairs, pad, [&](size_t n, std::pair<W, W> *&arr) {
+      SortPairs(options, n, arr);
+    });
+  });
+  phases.Run("permute", [&]() {
+    std::pair<W, W> *kv = (std::pair<W, W> *) pairs.data;
+    if (options.engine != "lowmem") {
+      // The pads tie with the largest keys and may sit among them
+      std::remove_if(kv, kv + PowerOfTwo(N), [N](const std::pair<W, W> &pair) {
+        Bits index;
+        memcpy(&index, &pair.second, sizeof(Bits));
+        return index >= N;
+      });
+    }
+    Buffer sorted;
+    sorted.Reserve(std::max(N * options.record_bytes, (size_t) 64), 0);
+#pragma omp parallel for schedule(static)
+    for (size_t i = 0; i < N; i++) {
+      Bits index;
+      memcpy(&index, &kv[i].second, sizeof(Bits));
+      memcpy(sorted.data + i * options.record_bytes, records.data + index * options.record_bytes,
+             options.record_bytes);
+    }
+    std::swap(sorted.data, records.data);
+    std::swap(sorted.capacity, records.capacity);
+  });
+}
+
+template<typename K>
+static void SortInMemory(const Options &options, Phases &phases, size_t &N, size_t &bytes) {
+  Buffer records;
+  phases.Run("read", [&]() {
+    ReadInput(options.input, records, bytes);
+  });
+  Check(bytes % options.record_bytes == 0, options.input + " is not a whole number of records");
+  N = bytes / options.record_bytes;
+  bool keys = options.key_offset == 0 && options.record_bytes == sizeof(K);
+  bool kv = options.key_offset == 0 && options.record_bytes == 2 * sizeof(K);
+  Check(keys || (options.engine != "partitioned" && options.engine != "numa"),
+        "the " + options.engine + " engine sorts records of one key");
+  if (N > 0 && keys) {
+    phases.Run("sort", [&]() {
+      SortPadded(options, N, records, PadKey<K>(), [&](size_t n, K *&arr) {
+        SortKeys(options, n, arr);
+      });
+    });
+  } else if (N > 0 && kv && options.engine == "lowmem") {
+    phases.Run("sort", [&]() {
+      std::pair<K, K> *arr = (std::pair<K, K> *) records.data;
+      SortPairs(options, N, arr);
+    });
+  } else if (N > 0 && sizeof(K) == 4 && N >= WIDE_INDEX_RECORDS) {
+    SortKeyIndex<K, typename std::conditional<std::is_integral<K>::value, int64_t, double>::type>(
+        options, N, records, phases);
+  } else if (N > 0) {
+    SortKeyIndex<K, K>(options, N, records, phases);
+  }
+  if (options.verify) {
+    phases.Run("verify", [&]() {
+      VerifyKeys<K>(records.data, N, options);
+    });
+  }
+  phases.Run("write", [&]() {
+    WriteOutput(options.output, records.data, bytes);
+  });
+}
+
+static KeyType ScalarKeyType(const Options &options) {
+  if (options.is_float) {
+    return options.key_width == 4 ? KEY_FLOAT : KEY_DOUBLE;
+  }
+  return options.key_width == 4 ? KEY_INT32 : KEY_INT64;
+}
+
+template<typename K>
+static void VerifyFile(const Options &options, const std::string &path) {
+  MappedFile file(path);
+  VerifyKeys<K>(file.Data(), file.Size() / options.record_bytes, options);
+}
+
+static void Verify(const Options &options, const std::string &path) {
+  switch (ScalarKeyType(options)) {
+    case KEY_INT32:
+      VerifyFile<int>(options, path);
+      break;
+    case KEY_INT64:
+      VerifyFile<int64_t>(options, path);
+      break;
+    case KEY_FLOAT:
+      VerifyFile<float>(options, path);
+      break;
+    default:
+      VerifyFile<double>(options, path);
+      break;
+  }
+}
+
+static void CopyFile(const std::string &from, const std::string &to) {
+  int in = OpenFile(from, O_RDONLY);
+  int out = -1;
+  std::vector<char> chunk(COPY_BYTES);
+  try {
+    out = OpenFile(to, O_WRONLY | O_CREAT | O_TRUNC);
+    size_t bytes = FileSize(in);
+    for (size_t offset = 0; offset < bytes; offset += chunk.size()) {
+      size_t n = std::min(chunk.size(), bytes - offset);
+      ReadFully(in, chunk.data(), n, offset);
+      WriteFully(out, chunk.data(), n, offset);
+    }
+  } catch (...) {
+    close(in);
+    if (out >= 0) {
+      close(out);
+    }
+    throw;
+  }
+  close(in);
+  close(out);
+}
+
+// The mmap and external engines go from file to file
+static void SortFileToFile(const Options &options, Phases &phases, size_t &N, size_t &bytes) {
+  Check(options.input != "-", "the " + options.engine + " engine sorts a file, not stdin");
+  Check(options.output != "-", "the " + options.engine + " engine writes a file, not stdout");
+  Check(options.key_offset == 0, "the " + options.engine + " engine takes the key at offset 0");
+  KeyType type = ScalarKeyType(options);
+  int fd = OpenFile(options.input, O_RDONLY);
+  bytes = FileSize(fd);
+  close(fd);
+  Check(bytes % options.record_bytes == 0, options.input + " is not a whole number of records");
+  N = bytes / options.record_bytes;
+
+  if (options.engine == "external") {
+    Check(options.record_bytes == options.key_width, "the external engine sorts records of one key");
+    phases.Run("sort", [&]() {
+#ifdef AVX512
+      if (options.isa == "avx512") {
+        avx512::ExternalSIMDSort(options.input, options.output, type, options.external);
+        return;
+      }
+#endif
+#ifdef AVX2
+      avx2::ExternalSIMDSort(options.input, options.output, type, options.external);
+#endif
+    });
+  } else {
+    Check(options.record_bytes == options.key_width || options.record_bytes == 2 * options.key_width,
+          "the mmap engine sorts keys or key-value records");
+    if (options.record_bytes == 2 * options.key_width) {
+      type = (KeyType) (type + KEY_INT32_KV);
+    }
+    if (options.output != options.input) {
+      phases.Run("copy", [&]() {
+        CopyFile(options.input, options.output);
+      });
+    }
+    phases.Run("sort", [&]() {
+#ifdef AVX512
+      if (options.isa == "avx512") {
+        avx512::SortFile(options.output, type, options.scratch_bytes);
+        return;
+      }
+#endif
+#ifdef AVX2
+      avx2::SortFile(options.output, type, options.scratch_bytes);
+#endif
+    });
+  }
+  if (options.verify) {
+    phases.Run("verify", [&]() {
+      Verify(options, options.output);
+    });
+  }
+}
+
+int main(int argc, char *argv[]) {
+  Options options = Parse(argc, argv);
+  if (options.isa == "auto") {
+    options.isa = Supported("avx512") ? "avx512" : "avx2";
+  }
+  if (!Supported(options.isa)) {
+    fprintf(stderr, "%s: the %s instruction set is not available\n", argv[0], options.isa.c_str());
+    return 2;
+  }
+
+  Phases phases;
+  size_t N = 0;
+  size_t bytes = 0;
+  try {
+    if (options.engine == "mmap" || options.engine == "external") {
+      SortFileToFile(options, phases, N, bytes);
+    } else {
+      switch (ScalarKeyType(options)) {
+        case KEY_INT32:
+          SortInMemory<int>(options, phases, N, bytes);
+          break;
+        case KEY_INT64:
+          SortInMemory<int64_t>(options, phases, N, bytes);
+          break;
+        case KEY_FLOAT:
+          SortInMemory<float>(options, phases, N, bytes);
+          break;
+        default:
+          SortInMemory<double>(options, phases, N, bytes);
+          break;
+      }
+    }
+  } catch (const std::exception &e) {
+    fprintf(stderr, "%s: %s\n", options.input.c_str(), e.what());
+    return 1;
+  }
+  phases.Report(options, N, bytes);
+  return 0;
+}